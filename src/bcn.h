@@ -0,0 +1,104 @@
+#ifndef _BCN_H
+#define _BCN_H
+
+#include <stdint.h>
+#include <string.h>
+
+// BC1 (DXT1, S3TC) compression of RGBA8 frames on the CPU, for compress_clip().
+// The endpoints of a 4x4 block are the corners of the bounding box of its colors,
+// inset by 1/16 against outliers, then each pixel gets the nearest of the 4 palette
+// colors. Meant for whole clips, it trades some quality for speed.
+
+#define BCN_BC1_BLOCK_SIZE 8
+
+// Bytes of a width x height BC1 image, the blocks past the edges included.
+int bcn_bc1_size(int width, int height) {
+	return ((width + 3) / 4) * ((height + 3) / 4) * BCN_BC1_BLOCK_SIZE;
+}
+
+static uint16_t _bcn_pack_565(const int *rgb) {
+	return (uint16_t)(((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3));
+}
+
+static void _bcn_unpack_565(uint16_t color, int *rgb) {
+	int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// `block` holds 16 RGBA8 pixels row by row, `out` gets BCN_BC1_BLOCK_SIZE bytes.
+void bcn_bc1_block(const uint8_t *block, uint8_t *out) {
+	int min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			int v = block[i * 4 + c];
+			min[c] = v < min[c] ? v : min[c];
+			max[c] = v > max[c] ? v : max[c];
+		}
+	}
+	for (int c = 0; c < 3; c++) {
+		int inset = (max[c] - min[c]) >> 4;
+		min[c] += inset;
+		max[c] -= inset;
+	}
+	uint16_t color0 = _bcn_pack_565(max);
+	uint16_t color1 = _bcn_pack_565(min);
+	uint32_t indices = 0;
+	if (color0 != color1) {
+		// color0 > color1 selects the 4 color mode
+		if (color0 < color1) {
+			uint16_t tmp = color0;
+			color0 = color1;
+			color1 = tmp;
+		}
+		int palette[4][3];
+		_bcn_unpack_565(color0, palette[0]);
+		_bcn_unpack_565(color1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (int i = 0; i < 16; i++) {
+			const uint8_t *pixel = block + i * 4;
+			int best = 0, best_dist = 1 << 30;
+			for (int p = 0; p < 4; p++) {
+				int dr = pixel[0] - palette[p][0], dg = pixel[1] - palette[p][1], db = pixel[2] - palette[p][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (dist < best_dist) {
+					best = p;
+					best_dist = dist;
+				}
+			}
+			indices |= (uint32_t)best << (i * 2);
+		}
+	}
+	out[0] = color0 & 0xff;
+	out[1] = color0 >> 8;
+	out[2] = color1 & 0xff;
+	out[3] = color1 >> 8;
+	for (int i = 0; i < 4; i++) {
+		out[4 + i] = (indices >> (i * 8)) & 0xff;
+	}
+}
+
+// A width x height RGBA8 image with lines `linesize` bytes apart, into bcn_bc1_size() bytes.
+// The last row and column are repeated in the blocks past the edges.
+void bcn_bc1_encode(const uint8_t *pixels, int linesize, int width, int height, uint8_t *out) {
+	uint8_t block[64];
+	for (int by = 0; by < height; by += 4) {
+		for (int bx = 0; bx < width; bx += 4) {
+			for (int y = 0; y < 4; y++) {
+				const uint8_t *row = pixels + (size_t)(by + y < height ? by + y : height - 1) * linesize;
+				for (int x = 0; x < 4; x++) {
+					int px = bx + x < width ? bx + x : width - 1;
+					memcpy(block + (y * 4 + x) * 4, row + px * 4, 4);
+				}
+			}
+			bcn_bc1_block(block, out);
+			out += BCN_BC1_BLOCK_SIZE;
+		}
+	}
+}
+
+#endif /* _BCN_H */
@@ -0,0 +1,264 @@
+#ifndef _FRAME_POOL_H
+#define _FRAME_POOL_H
+
+#include <gdnative_api_struct.gen.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "thread.h"
+
+extern const godot_gdnative_core_api_struct *api;
+
+// Decoded video frames come from pools shared by every decoder, keyed by format and
+// (aligned) size, so seeking or opening a similar file doesn't reallocate them.
+// Lines start FRAME_POOL_ALIGN aligned for the SIMD paths of swscale.
+
+#define FRAME_POOL_ALIGN 64
+
+typedef struct frame_pool_t {
+	enum AVPixelFormat format;
+	int width, height;
+	int linesize[4];
+	// of each plane from the aligned start of a buffer
+	ptrdiff_t offset[4];
+	AVBufferPool *pool;
+	struct frame_pool_t *next;
+} frame_pool_t;
+
+// Stored in AVCodecContext.opaque. It outlives the codec until its last frame is released.
+typedef struct frame_pool_stats_t {
+	// pool buffers held by frames of the codec
+	volatile int64_t bytes;
+	volatile int64_t frames;
+	// the codec and each of those frames
+	volatile int64_t refs;
+} frame_pool_stats_t;
+
+// What AVFrame.buf[0] points to: a pool buffer, counted in the stats of the codec that decoded it.
+typedef struct frame_pool_ref_t {
+	AVBufferRef *buf;
+	frame_pool_stats_t *stats;
+} frame_pool_ref_t;
+
+static frame_pool_t *frame_pools = NULL;
+static vd_mutex frame_pool_mutex;
+// bytes allocated by all pools, held by frames or not
+static volatile int64_t frame_pool_bytes = 0;
+// of those, held by frames
+static volatile int64_t frame_pool_held_bytes = 0;
+
+void frame_pool_init() {
+	vd_mutex_init(&frame_pool_mutex);
+}
+
+static void _frame_pool_free_buffer(void *opaque, uint8_t *data) {
+	vd_atomic_add(&frame_pool_bytes, -(int64_t)(intptr_t)opaque);
+	av_free(data);
+}
+
+static AVBufferRef *_frame_pool_alloc(void *opaque, int size) {
+	uint8_t *data = (uint8_t *)av_malloc(size);
+	if (data == NULL) {
+		return NULL;
+	}
+	AVBufferRef *buf = av_buffer_create(data, size, _frame_pool_free_buffer, (void *)(intptr_t)size, 0);
+	if (buf == NULL) {
+		av_free(data);
+		return NULL;
+	}
+	vd_atomic_add(&frame_pool_bytes, size);
+	return buf;
+}
+
+// av_buffer_pool_uninit()'ed and all its buffers are back.
+static void _frame_pool_free_pool(void *opaque) {
+	api->godot_free(opaque);
+}
+
+static void _frame_pool_stats_unref(frame_pool_stats_t *stats) {
+	if (vd_atomic_add(&stats->refs, -1) == 0) {
+		api->godot_free(stats);
+	}
+}
+
+static void _frame_pool_release(void *opaque, uint8_t *data) {
+	frame_pool_ref_t *ref = (frame_pool_ref_t *)opaque;
+	vd_atomic_add(&ref->stats->bytes, -ref->buf->size);
+	vd_atomic_add(&frame_pool_held_bytes, -ref->buf->size);
+	vd_atomic_add(&ref->stats->frames, -1);
+	_frame_pool_stats_unref(ref->stats);
+	av_buffer_unref(&ref->buf);
+	api->godot_free(ref);
+}
+
+// Call with frame_pool_mutex held.
+static frame_pool_t *_frame_pool_find(enum AVPixelFormat format, int width, int height) {
+	for (frame_pool_t *p = frame_pools; p != NULL; p = p->next) {
+		if (p->format == format && p->width == width && p->height == height) {
+			return p;
+		}
+	}
+	frame_pool_t *p = (frame_pool_t *)api->godot_alloc(sizeof(frame_pool_t));
+	if (p == NULL) {
+		return NULL;
+	}
+	memset(p, 0, sizeof(frame_pool_t));
+	p->format = format;
+	p->width = width;
+	p->height = height;
+	if (av_image_fill_linesizes(p->linesize, format, width) < 0) {
+		api->godot_free(p);
+		return NULL;
+	}
+	for (int i = 0; i < 4; i++) {
+		p->linesize[i] = FFALIGN(p->linesize[i], FRAME_POOL_ALIGN);
+	}
+	// offsets from a NULL base
+	uint8_t *data[4];
+	int size = av_image_fill_pointers(data, format, height, NULL, p->linesize);
+	if (size < 0) {
+		api->godot_free(p);
+		return NULL;
+	}
+	for (int i = 0; i < 4; i++) {
+		p->offset[i] = p->linesize[i] != 0 ? data[i] - data[0] : 0;
+	}
+	// room to align the start, and for the overreads of the SIMD code at the end.
+	p->pool = av_buffer_pool_init2(size + 2 * FRAME_POOL_ALIGN, p, _frame_pool_alloc, _frame_pool_free_pool);
+	if (p->pool == NULL) {
+		api->godot_free(p);
+		return NULL;
+	}
+	p->next = frame_pools;
+	frame_pools = p;
+	return p;
+}
+
+int frame_pool_get_buffer2(AVCodecContext *ctx, AVFrame *frame, int flags) {
+	frame_pool_stats_t *stats = (frame_pool_stats_t *)ctx->opaque;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	// palettes are a separate plane the pools don't lay out.
+	int own_flags = AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL;
+#ifdef AV_PIX_FMT_FLAG_PSEUDOPAL
+	own_flags |= AV_PIX_FMT_FLAG_PSEUDOPAL;
+#endif
+	if (stats == NULL || ctx->codec_type != AVMEDIA_TYPE_VIDEO || !(ctx->codec->capabilities & AV_CODEC_CAP_DR1)
+			|| desc == NULL || (desc->flags & own_flags)) {
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+	}
+	int width = frame->width, height = frame->height;
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+
+	vd_mutex_lock(&frame_pool_mutex);
+	frame_pool_t *pool = _frame_pool_find(frame->format, width, height);
+	AVBufferRef *buf = pool != NULL ? av_buffer_pool_get(pool->pool) : NULL;
+	int linesize[4];
+	ptrdiff_t offset[4];
+	if (buf != NULL) {
+		memcpy(linesize, pool->linesize, sizeof(linesize));
+		memcpy(offset, pool->offset, sizeof(offset));
+	}
+	vd_mutex_unlock(&frame_pool_mutex);
+	if (buf == NULL) {
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+	}
+
+	frame_pool_ref_t *ref = (frame_pool_ref_t *)api->godot_alloc(sizeof(frame_pool_ref_t));
+	if (ref == NULL) {
+		av_buffer_unref(&buf);
+		return AVERROR(ENOMEM);
+	}
+	ref->buf = buf;
+	ref->stats = stats;
+	frame->buf[0] = av_buffer_create(buf->data, buf->size, _frame_pool_release, ref, 0);
+	if (frame->buf[0] == NULL) {
+		av_buffer_unref(&buf);
+		api->godot_free(ref);
+		return AVERROR(ENOMEM);
+	}
+	vd_atomic_add(&stats->refs, 1);
+	vd_atomic_add(&stats->bytes, buf->size);
+	vd_atomic_add(&stats->frames, 1);
+	vd_atomic_add(&frame_pool_held_bytes, buf->size);
+
+	uint8_t *base = (uint8_t *)FFALIGN((uintptr_t)buf->data, FRAME_POOL_ALIGN);
+	for (int i = 0; i < 4; i++) {
+		frame->data[i] = linesize[i] != 0 ? base + offset[i] : NULL;
+		frame->linesize[i] = linesize[i];
+	}
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+// Before avcodec_open2(). False if the codec keeps FFmpeg's own allocator.
+bool frame_pool_attach(AVCodecContext *ctx) {
+	frame_pool_stats_t *stats = (frame_pool_stats_t *)api->godot_alloc(sizeof(frame_pool_stats_t));
+	if (stats == NULL) {
+		return false;
+	}
+	memset(stats, 0, sizeof(frame_pool_stats_t));
+	stats->refs = 1;
+	ctx->opaque = stats;
+	ctx->get_buffer2 = frame_pool_get_buffer2;
+	// frame threads call get_buffer2 themselves instead of waiting on each other.
+	ctx->thread_safe_callbacks = 1;
+	return true;
+}
+
+// Before avcodec_free_context().
+void frame_pool_detach(AVCodecContext *ctx) {
+	if (ctx->get_buffer2 != frame_pool_get_buffer2 || ctx->opaque == NULL) {
+		return;
+	}
+	_frame_pool_stats_unref((frame_pool_stats_t *)ctx->opaque);
+	ctx->opaque = NULL;
+}
+
+// Pool bytes held by the frames a codec decoded (inside the codec or not).
+int64_t frame_pool_codec_bytes(AVCodecContext *ctx) {
+	if (ctx->get_buffer2 != frame_pool_get_buffer2 || ctx->opaque == NULL) {
+		return 0;
+	}
+	return vd_atomic_add(&((frame_pool_stats_t *)ctx->opaque)->bytes, 0);
+}
+
+int64_t frame_pool_codec_frames(AVCodecContext *ctx) {
+	if (ctx->get_buffer2 != frame_pool_get_buffer2 || ctx->opaque == NULL) {
+		return 0;
+	}
+	return vd_atomic_add(&((frame_pool_stats_t *)ctx->opaque)->frames, 0);
+}
+
+int64_t frame_pool_total_bytes() {
+	return vd_atomic_add(&frame_pool_bytes, 0);
+}
+
+// Bytes of the buffers no frame holds, what frame_pool_trim() frees.
+int64_t frame_pool_idle_bytes() {
+	int64_t idle = vd_atomic_add(&frame_pool_bytes, 0) - vd_atomic_add(&frame_pool_held_bytes, 0);
+	return idle > 0 ? idle : 0;
+}
+
+// Frees the buffers nobody holds, the pools themselves go once their last frame is released.
+void frame_pool_trim() {
+	vd_mutex_lock(&frame_pool_mutex);
+	while (frame_pools != NULL) {
+		frame_pool_t *p = frame_pools;
+		frame_pools = p->next;
+		av_buffer_pool_uninit(&p->pool);
+	}
+	vd_mutex_unlock(&frame_pool_mutex);
+}
+
+void frame_pool_shutdown() {
+	frame_pool_trim();
+	vd_mutex_destroy(&frame_pool_mutex);
+}
+
+#endif /* _FRAME_POOL_H */
@@ -0,0 +1,172 @@
+#ifndef _GDFILE_H
+#define _GDFILE_H
+
+#include <gdnative_api_struct.gen.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+extern const godot_gdnative_core_api_struct *api;
+
+// Reads a res:// (or any godot) path through the _File class so the plugin
+// can open media on its own, e.g. from a background thread,
+// without going through VideoStreamGDNative's FileAccess.
+
+typedef struct gdfile_t {
+	godot_object *file;
+	int64_t len;
+} gdfile_t;
+
+static godot_method_bind *gdfile_mb_open = NULL;
+static godot_method_bind *gdfile_mb_close = NULL;
+static godot_method_bind *gdfile_mb_get_len = NULL;
+static godot_method_bind *gdfile_mb_get_position = NULL;
+static godot_method_bind *gdfile_mb_seek = NULL;
+static godot_method_bind *gdfile_mb_get_buffer = NULL;
+static godot_method_bind *gdfile_mb_globalize_path = NULL;
+
+// Must be called from the main thread before using gdfile_open() on any thread.
+void gdfile_init() {
+	if (gdfile_mb_open != NULL) return;
+	gdfile_mb_close = api->godot_method_bind_get_method("_File", "close");
+	gdfile_mb_get_len = api->godot_method_bind_get_method("_File", "get_len");
+	gdfile_mb_get_position = api->godot_method_bind_get_method("_File", "get_position");
+	gdfile_mb_seek = api->godot_method_bind_get_method("_File", "seek");
+	gdfile_mb_get_buffer = api->godot_method_bind_get_method("_File", "get_buffer");
+	gdfile_mb_globalize_path = api->godot_method_bind_get_method("ProjectSettings", "globalize_path");
+	gdfile_mb_open = api->godot_method_bind_get_method("_File", "open");
+}
+
+static godot_variant _gdfile_call(godot_method_bind *mb, godot_object *obj, const godot_variant **args, int nargs) {
+	godot_variant_call_error err;
+	return api->godot_method_bind_call(mb, obj, args, nargs, &err);
+}
+
+static int64_t _gdfile_call_int(godot_method_bind *mb, godot_object *obj, const godot_variant **args, int nargs) {
+	godot_variant ret = _gdfile_call(mb, obj, args, nargs);
+	int64_t val = api->godot_variant_as_int(&ret);
+	api->godot_variant_destroy(&ret);
+	return val;
+}
+
+gdfile_t *gdfile_open(const char *path) {
+	godot_class_constructor file_ctor = api->godot_get_class_constructor("_File");
+	if (file_ctor == NULL || gdfile_mb_open == NULL) {
+		return NULL;
+	}
+	gdfile_t *f = (gdfile_t *)api->godot_alloc(sizeof(gdfile_t));
+	if (f == NULL) {
+		return NULL;
+	}
+	f->file = file_ctor();
+
+	godot_string g_path = api->godot_string_chars_to_utf8(path);
+	godot_variant v_path, v_mode;
+	api->godot_variant_new_string(&v_path, &g_path);
+	api->godot_variant_new_int(&v_mode, 1); // File.READ
+	const godot_variant *args[] = { &v_path, &v_mode };
+	int64_t err = _gdfile_call_int(gdfile_mb_open, f->file, args, 2);
+	api->godot_variant_destroy(&v_mode);
+	api->godot_variant_destroy(&v_path);
+	api->godot_string_destroy(&g_path);
+
+	if (err != 0) {
+		api->godot_object_destroy(f->file);
+		api->godot_free(f);
+		return NULL;
+	}
+	f->len = _gdfile_call_int(gdfile_mb_get_len, f->file, NULL, 0);
+	return f;
+}
+
+void gdfile_close(gdfile_t *f) {
+	if (f == NULL) return;
+	godot_variant ret = _gdfile_call(gdfile_mb_close, f->file, NULL, 0);
+	api->godot_variant_destroy(&ret);
+	api->godot_object_destroy(f->file);
+	api->godot_free(f);
+}
+
+int64_t gdfile_get_position(gdfile_t *f) {
+	return _gdfile_call_int(gdfile_mb_get_position, f->file, NULL, 0);
+}
+
+// The OS path of a res:// or user:// path, for files the plugin reads or writes
+// without godot (memory maps). Freed with godot_free(). NULL if godot can't tell.
+char *gdfile_globalize_path(const char *path) {
+	godot_object *settings = api->godot_global_get_singleton((char *)"ProjectSettings");
+	if (settings == NULL || gdfile_mb_globalize_path == NULL) {
+		return NULL;
+	}
+	godot_string g_path = api->godot_string_chars_to_utf8(path);
+	godot_variant v_path;
+	api->godot_variant_new_string(&v_path, &g_path);
+	const godot_variant *args[] = { &v_path };
+	godot_variant ret = _gdfile_call(gdfile_mb_globalize_path, settings, args, 1);
+	api->godot_variant_destroy(&v_path);
+	api->godot_string_destroy(&g_path);
+
+	godot_string g_os_path = api->godot_variant_as_string(&ret);
+	godot_char_string c_os_path = api->godot_string_utf8(&g_os_path);
+	const char *chars = api->godot_char_string_get_data(&c_os_path);
+	char *os_path = (char *)api->godot_alloc(strlen(chars) + 1);
+	if (os_path != NULL) {
+		strcpy(os_path, chars);
+	}
+	api->godot_char_string_destroy(&c_os_path);
+	api->godot_string_destroy(&g_os_path);
+	api->godot_variant_destroy(&ret);
+	return os_path;
+}
+
+// AVIOContext read_packet callback
+int gdfile_read(void *opaque, uint8_t *buf, int buf_size) {
+	gdfile_t *f = (gdfile_t *)opaque;
+	godot_variant v_len;
+	api->godot_variant_new_int(&v_len, buf_size);
+	const godot_variant *args[] = { &v_len };
+	godot_variant ret = _gdfile_call(gdfile_mb_get_buffer, f->file, args, 1);
+	api->godot_variant_destroy(&v_len);
+
+	godot_pool_byte_array bytes = api->godot_variant_as_pool_byte_array(&ret);
+	int read_bytes = api->godot_pool_byte_array_size(&bytes);
+	if (read_bytes > buf_size) {
+		read_bytes = buf_size;
+	}
+	if (read_bytes > 0) {
+		godot_pool_byte_array_read_access *read_access = api->godot_pool_byte_array_read(&bytes);
+		memcpy(buf, api->godot_pool_byte_array_read_access_ptr(read_access), read_bytes);
+		api->godot_pool_byte_array_read_access_destroy(read_access);
+	}
+	api->godot_pool_byte_array_destroy(&bytes);
+	api->godot_variant_destroy(&ret);
+	return read_bytes > 0 ? read_bytes : AVERROR_EOF;
+}
+
+// AVIOContext seek callback
+int64_t gdfile_seek(void *opaque, int64_t offset, int whence) {
+	gdfile_t *f = (gdfile_t *)opaque;
+	int64_t pos;
+	if (whence & AVSEEK_SIZE) {
+		return f->len;
+	}
+	switch (whence & ~AVSEEK_FORCE) {
+		case SEEK_SET: pos = offset; break;
+		case SEEK_CUR: pos = gdfile_get_position(f) + offset; break;
+		case SEEK_END: pos = f->len + offset; break;
+		default: return -1;
+	}
+	if (pos < 0 || pos > f->len) {
+		return -1;
+	}
+	godot_variant v_pos;
+	api->godot_variant_new_int(&v_pos, pos);
+	const godot_variant *args[] = { &v_pos };
+	godot_variant ret = _gdfile_call(gdfile_mb_seek, f->file, args, 1);
+	api->godot_variant_destroy(&ret);
+	api->godot_variant_destroy(&v_pos);
+	return pos;
+}
+
+#endif /* _GDFILE_H */
@@ -4,8 +4,16 @@
 #include <unistd.h>
 #endif
 #include <time.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VD_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VD_NEON
+#include <arm_neon.h>
+#endif
 
 #include <gdnative_api_struct.gen.h>
 
@@ -17,8 +25,16 @@
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 
+#include "bcn.h"
+#include "frame_pool.h"
+#include "gdfile.h"
+#include "io_sched.h"
+#include "mapfile.h"
+#include "mem.h"
 #include "packet_queue.h"
 #include "set.h"
+#include "thread.h"
+#include "worker.h"
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
@@ -26,12 +42,146 @@
 #endif
 
 // TODO: is this sample rate defined somewhere in the godot api etc?
+// Default of the mix_rate option.
 #define AUDIO_MIX_RATE 22050
 
 enum POSITION_TYPE {POS_V_PTS, POS_TIME, POS_A_TIME};
+
+// Per instance options, instances start with a copy of default_options.
+typedef struct videodecoder_options {
+	// ignore the video streams: no video codec, scaler or frame buffers.
+	godot_bool audio_only;
+	// demuxing stops once every queue holds queue_duration seconds (or its byte limit) ...
+	double queue_duration;
+	int64_t video_queue_bytes;
+	int64_t audio_queue_bytes;
+	// ... or all queues together hold max_queue_bytes.
+	int64_t max_queue_bytes;
+	// the demuxer wraps around to the start at the end of the file, playback never ends.
+	godot_bool loop;
+	// non-seekable or growing input (pipe, capture): no rewinding, minimal buffering,
+	// the clock follows the input.
+	godot_bool live;
+	// live: how far (seconds) the shown frame may lag behind the newest received packet.
+	double live_latency;
+	// every frame once, in order: no dropping and no wall clock, frames are decoded ahead on worker threads.
+	godot_bool offline;
+	// offline: how many converted frames are kept ready.
+	int64_t decode_ahead;
+	// playback rate, MIN_SPEED to MAX_SPEED. Ignored by offline and live instances.
+	double speed;
+	// only this region of the video's frames is converted, e.g. one view of a packed layout.
+	// The size is fixed when the file is opened (0: up to the right/bottom edge),
+	// the position can change during playback.
+	int64_t crop_x;
+	int64_t crop_y;
+	int64_t crop_width;
+	int64_t crop_height;
+	// build the mipmaps of every frame godot gets on a worker thread, see get_mipmaps().
+	godot_bool mipmaps;
+	// with loop: keep the converted frames of the first loop and serve the later ones from
+	// them, shared with every instance playing the same file, see _bake_serve().
+	godot_bool bake;
+	// bytes the frames of a baked clip may take, longer or larger clips are decoded as usual.
+	int64_t bake_budget;
+	// size of the buffer the demuxer reads the file through, fixed when the file is opened.
+	int64_t io_buffer_size;
+	// the file is read in chunks of this size through the io scheduler, 0 reads it as the demuxer asks.
+	// Ignored by live instances.
+	int64_t io_chunk_size;
+	// a queue always holds at least this many packets unless it hit a byte limit.
+	int64_t min_queue_packets;
+	// get_videoframe() drops late frames for at most this long (ms) ...
+	int64_t max_frame_drop_msec;
+	// ... after dropping at least this many.
+	int64_t min_frame_drop_count;
+	// threads of the video codec, 0: one per core. Applies to codecs opened afterwards.
+	int64_t decoder_threads;
+	// SWS_* flags of the scaler (filter), applies when the conversion is set up.
+	int64_t scale_flags;
+	// seeks land on a keyframe at most this many seconds before the target.
+	double seek_margin;
+	// sample rate of the audio handed to godot, fixed by the first file opened with audio.
+	int64_t mix_rate;
+} videodecoder_options;
+
+typedef struct ahead_frame_t {
+	godot_pool_byte_array pixels;
+	double time;
+	double duration;
+} ahead_frame_t;
+
+// offline mode: a ring of converted frames filled by _ahead_job() on the decoders pool.
+// Allocated apart from the instance like mip_chain_t, its mutexes must not be moved.
+typedef struct ahead_queue_t {
+	vd_mutex mutex;
+	vd_cond cond;
+	// held by the job while it decodes and by update()/get_audio(), they share the demuxer.
+	vd_mutex pipeline_mutex;
+	ahead_frame_t *frames;
+	int size;
+	int head;
+	int count;
+	// a job is queued or running
+	bool running;
+	// _ahead_stop() waits for the job
+	bool abort;
+	// the decoder has no more frames
+	bool eof;
+	// after a seek, any mode: _poster_job() decodes the frame at the new position into
+	// `poster` while get_videoframe() keeps returning the previous one.
+	bool poster_running;
+	// an atlas job (see update_atlas()) converts into the atlas
+	bool atlas_running;
+	bool poster_done;
+	double poster_target;
+	godot_pool_byte_array poster;
+	double poster_time;
+	double poster_duration;
+} ahead_queue_t;
+
+// mipmaps option: the chain of the newest frame, built by _mip_job() on the decoders pool.
+// Allocated apart from the instance so the job never sees _swap_pipeline() move it.
+typedef struct mip_chain_t {
+	vd_mutex mutex;
+	vd_cond cond;
+	// the frame get_videoframe() returned last, until the job takes it
+	godot_pool_byte_array source;
+	int source_width, source_height;
+	bool source_pending;
+	// frame_time of the last frame handed to the job, only touched by the main thread
+	double submitted_time;
+	// the newest finished chain, in the layout of a mipmapped RGBA8 godot Image
+	godot_pool_byte_array pixels;
+	// a job is queued or running
+	bool running;
+} mip_chain_t;
+
 typedef struct videodecoder_data_struct {
 
 	godot_object *instance; // Don't clean
+	godot_int id; // Don't clean
+	struct videodecoder_data_struct *next_instance; // Don't clean
+	videodecoder_options options; // Don't clean
+	// get_ticks_msec() of the last get_videoframe(), least recently visible instances shrink first.
+	uint64_t last_visible_msec; // Don't clean
+	// over the memory budget: keep the packet queues as short as possible.
+	bool mem_shrunk; // Don't clean
+	// what was queued and decoded ahead before mem_shrunk was set is dropped, see _shrink().
+	bool mem_trimmed;
+	mem_stats_t mem;
+	// preload handle of the clip that plays after this one, -1 if none
+	godot_int next_clip; // Don't clean
+	// atlas mode: frames are converted into this shared buffer at atlas_x, atlas_y
+	// (out_width x out_height) instead of unwrapped_frame.
+	struct atlas_t *atlas; // Don't clean
+	int atlas_x, atlas_y; // Don't clean
+	// the rect has to be redrawn, e.g. after the atlas was repacked
+	bool atlas_dirty; // Don't clean
+	// set while update_atlas() converts: where the rect starts in the atlas buffer
+	uint8_t *atlas_dst; // Don't clean
+	ahead_queue_t *ahead; // Don't clean
+	mip_chain_t *mips; // Don't clean
 	AVIOContext *io_ctx;
 	AVFormatContext *format_ctx;
 	AVCodecContext *vcodec_ctx;
@@ -43,26 +193,74 @@ typedef struct videodecoder_data_struct {
 
 	int videostream_idx;
 	int frame_buffer_size;
+	// size of the converted frames, which is the texture size godot was given
+	int out_width;
+	int out_height;
+	// size of the region of the codec's frames the scaler reads, see _crop_size()
+	int crop_width;
+	int crop_height;
 	godot_pool_byte_array unwrapped_frame;
+	// media time, advances by p_delta * speed
 	godot_real time;
+	// godot's clock, advances by p_delta. Positions are reported on it.
+	godot_real clock;
+	// speed the codecs and resampler are set up for, 0 before _apply_speed()
+	double speed;
 
 	double audio_time;
 	double diff_tolerance;
 
 	int audiostream_idx;
+	// nth audio stream requested through set_audio_track(), kept across cleanups.
+	// -1: the stream av_find_best_stream() picks.
+	int audio_track;
+	// output format, godot sizes its mix buffer from get_channels() once
+	int audio_channels;
+	uint64_t audio_channel_layout;
+	int audio_mix_rate;
 	AVCodecContext *acodec_ctx;
 	godot_bool acodec_open;
 	AVFrame *audio_frame;
 	void *mix_udata;
 
 	int num_decoded_samples;
+	// resampled samples that didn't fit in godot's buffer yet
 	float *audio_buffer;
+	// in floats, grown by _audio_buffer_reserve()
+	int audio_buffer_size;
 	int audio_buffer_pos;
 
 	SwrContext *swr_ctx;
 
 	PacketQueue *audio_packet_queue;
 	PacketQueue *video_packet_queue;
+	// av_read_frame() hit the end of the file
+	bool demux_eof;
+	// loop option: added to the timestamps of every packet (AV_TIME_BASE units),
+	// grows by the file's duration each time the demuxer wraps around.
+	int64_t loop_offset;
+	// end of the latest packet of the file, without loop_offset
+	int64_t loop_end;
+	// playlist: seconds added to the file's timestamps, the end of the previous clips
+	double clip_offset;
+	// playlist: the file the demuxer reads, when it wasn't opened by godot
+	gdfile_t *clip_file;
+	// playlist: no more video frames, the last one is shown until the next clip starts
+	bool clip_ended;
+	// speed: keyframe-only decoding ended, video packets are dropped until the next keyframe
+	// since the frames the ones in between refer to were never decoded
+	bool wait_keyframe;
+	// live: timestamp (seconds, without clip_offset) of the newest packet, NAN before the first one
+	double live_newest;
+	// codecs, conversion buffers and queued packets are released, see _suspend()
+	bool suspended;
+	// bake option: the frames of the file, being recorded by this instance (bake_recording)
+	// or by another one. Once bake_serving they come from it instead of the video codec.
+	struct bake_t *bake;
+	bool bake_recording;
+	bool bake_serving;
+	// loop number * frames per loop + index of the baked frame in unwrapped_frame
+	int64_t bake_frame;
 
 	unsigned long drop_frame;
 	unsigned long total_frame;
@@ -71,14 +269,67 @@ typedef struct videodecoder_data_struct {
 
 	enum POSITION_TYPE position_type;
 	uint8_t *io_buffer;
+	int io_buffer_size;
+	// what io_ctx reads through, see io_sched.h
+	io_source_t *io_source;
+	uint8_t *io_chunk;
+	int io_chunk_size;
 	godot_bool vcodec_open;
 	godot_bool input_open;
 	bool frame_unwrapped;
+	// unwrapped_frame holds a converted frame (decoded during open or seek)
+	// that get_videoframe hasn't returned yet.
+	bool poster_pending;
+	// presentation time and duration of the frame in unwrapped_frame
+	double frame_time;
+	double frame_duration;
+	// false when get_videoframe returned the same buffer as the previous call
+	bool frame_changed;
+	unsigned long repeat_frame;
+	// packets _queue_trim() dropped
+	unsigned long trimmed_packets;
 
 } videodecoder_data_struct;
 
-const godot_int IO_BUFFER_SIZE = 512 * 1024; // File reading buffer of 512 KiB
-const godot_int AUDIO_BUFFER_MAX_SIZE = 192000;
+const godot_int AUDIO_BUFFER_MIN_SIZE = 8192;
+// Live inputs: read as little as possible before the first frame.
+const godot_int LIVE_PROBE_SIZE = 32 * 1024;
+const int64_t LIVE_ANALYZE_DURATION = AV_TIME_BASE / 10;
+// Bytes hashed to match a prepared file against the one godot opens.
+const godot_int PROBE_KEY_SIZE = 4096;
+
+#define PRELOAD_POOL_SIZE 4
+
+enum PRELOAD_STATE {PRELOAD_EMPTY, PRELOAD_LOADING, PRELOAD_READY, PRELOAD_FAILED};
+// A decoder opened ahead of time on the loader thread, waiting for
+// godot_videodecoder_open_file() to be called with the same file.
+typedef struct preload_slot_t {
+	enum PRELOAD_STATE state;
+	godot_int handle;
+	bool release_pending;
+	char *path;
+	gdfile_t *file;
+	int64_t file_len;
+	uint32_t probe_hash;
+	// opened for an instance's playlist, not for whoever opens the same file
+	bool playlist;
+	videodecoder_data_struct *data;
+} preload_slot_t;
+
+static preload_slot_t preload_slots[PRELOAD_POOL_SIZE];
+static godot_int preload_serial = 0;
+static vd_mutex preload_mutex;
+static vd_cond preload_cond;
+static worker_t *loader = NULL;
+// Thumbnails and compression, on a thread of their own so they never delay a preload.
+static worker_t *batch_loader = NULL;
+// guards the bakes, see _bake_attach()
+static vd_mutex bake_mutex;
+
+static void videodecoder_release(godot_int handle);
+static void _atlas_remove(struct videodecoder_data_struct *data);
+static void _ahead_stop(struct videodecoder_data_struct *data);
+static void _bake_release(struct videodecoder_data_struct *data);
 
 const godot_gdnative_core_api_struct *api = NULL;
 const godot_gdnative_ext_nativescript_api_struct *nativescript_api = NULL;
@@ -88,6 +339,89 @@ const godot_gdnative_ext_videodecoder_api_struct *videodecoder_api = NULL;
 extern const godot_videodecoder_interface_gdnative plugin_interface;
 
 static const char *plugin_name = "ffmpeg_videoplayer";
+
+// io_buffer_size and io_chunk_size are clamped to these
+#define MIN_IO_BUFFER_SIZE 4096
+#define MAX_IO_BUFFER_SIZE (64 * 1024 * 1024)
+// with less packets queued (seconds), reading ahead ignores the io bandwidth cap.
+#define IO_URGENT_SECONDS 0.25
+// an instance counts as on screen for the io scheduler this long after its last get_videoframe().
+#define IO_FOREGROUND_MSEC 250
+
+static videodecoder_options default_options = {
+	GODOT_FALSE, // audio_only
+	1.0, // queue_duration
+	8 * 1024 * 1024, // video_queue_bytes
+	1024 * 1024, // audio_queue_bytes
+	15 * 1024 * 1024, // max_queue_bytes
+	GODOT_FALSE, // loop
+	GODOT_FALSE, // live
+	0.1, // live_latency
+	GODOT_FALSE, // offline
+	4, // decode_ahead
+	1.0, // speed
+	0, // crop_x
+	0, // crop_y
+	0, // crop_width
+	0, // crop_height
+	GODOT_FALSE, // mipmaps
+	GODOT_FALSE, // bake
+	64 * 1024 * 1024, // bake_budget
+	512 * 1024, // io_buffer_size
+	2 * 1024 * 1024, // io_chunk_size
+	24, // min_queue_packets
+	5, // max_frame_drop_msec
+	5, // min_frame_drop_count
+	0, // decoder_threads
+	SWS_BILINEAR, // scale_flags
+	10.0, // seek_margin
+	AUDIO_MIX_RATE, // mix_rate
+};
+
+enum OPTION_TYPE {OPTION_BOOL, OPTION_INT, OPTION_REAL};
+typedef struct option_desc {
+	const char *name;
+	enum OPTION_TYPE type;
+	size_t offset;
+} option_desc;
+
+// Options that can be set by name through VideoDecoderServer.
+static const option_desc option_descs[] = {
+	{ "audio_only", OPTION_BOOL, offsetof(videodecoder_options, audio_only) },
+	{ "queue_duration", OPTION_REAL, offsetof(videodecoder_options, queue_duration) },
+	{ "video_queue_bytes", OPTION_INT, offsetof(videodecoder_options, video_queue_bytes) },
+	{ "audio_queue_bytes", OPTION_INT, offsetof(videodecoder_options, audio_queue_bytes) },
+	{ "max_queue_bytes", OPTION_INT, offsetof(videodecoder_options, max_queue_bytes) },
+	{ "loop", OPTION_BOOL, offsetof(videodecoder_options, loop) },
+	{ "live", OPTION_BOOL, offsetof(videodecoder_options, live) },
+	{ "live_latency", OPTION_REAL, offsetof(videodecoder_options, live_latency) },
+	{ "offline", OPTION_BOOL, offsetof(videodecoder_options, offline) },
+	{ "decode_ahead", OPTION_INT, offsetof(videodecoder_options, decode_ahead) },
+	{ "speed", OPTION_REAL, offsetof(videodecoder_options, speed) },
+	{ "crop_x", OPTION_INT, offsetof(videodecoder_options, crop_x) },
+	{ "crop_y", OPTION_INT, offsetof(videodecoder_options, crop_y) },
+	{ "crop_width", OPTION_INT, offsetof(videodecoder_options, crop_width) },
+	{ "crop_height", OPTION_INT, offsetof(videodecoder_options, crop_height) },
+	{ "mipmaps", OPTION_BOOL, offsetof(videodecoder_options, mipmaps) },
+	{ "bake", OPTION_BOOL, offsetof(videodecoder_options, bake) },
+	{ "bake_budget", OPTION_INT, offsetof(videodecoder_options, bake_budget) },
+	{ "io_buffer_size", OPTION_INT, offsetof(videodecoder_options, io_buffer_size) },
+	{ "io_chunk_size", OPTION_INT, offsetof(videodecoder_options, io_chunk_size) },
+	{ "min_queue_packets", OPTION_INT, offsetof(videodecoder_options, min_queue_packets) },
+	{ "max_frame_drop_msec", OPTION_INT, offsetof(videodecoder_options, max_frame_drop_msec) },
+	{ "min_frame_drop_count", OPTION_INT, offsetof(videodecoder_options, min_frame_drop_count) },
+	{ "decoder_threads", OPTION_INT, offsetof(videodecoder_options, decoder_threads) },
+	{ "scale_flags", OPTION_INT, offsetof(videodecoder_options, scale_flags) },
+	{ "seek_margin", OPTION_REAL, offsetof(videodecoder_options, seek_margin) },
+	{ "mix_rate", OPTION_INT, offsetof(videodecoder_options, mix_rate) },
+};
+#define NUM_OPTIONS (sizeof(option_descs) / sizeof(option_descs[0]))
+
+// Every decoder attached to a godot playback object, so VideoDecoderServer can find them by id.
+static videodecoder_data_struct *instances = NULL;
+static godot_int instance_serial = 0;
+static godot_int last_instance_id = -1;
+static vd_mutex instances_mutex;
 static int num_supported_ext = 0;
 static char **supported_ext = NULL;
 
@@ -182,61 +516,279 @@ static uint64_t get_ticks_msec() {
 	__profile_sig__, get_ticks_usec() - __profile_ticks_start__ \
 )
 
-// Cleanup should empty the struct to the point where you can open a new file from.
-static void _cleanup(videodecoder_data_struct *data) {
-
-	if (data->audio_packet_queue != NULL) {
-		packet_queue_deinit(data->audio_packet_queue);
-		data->audio_packet_queue = NULL;
-	}
-
-	if (data->video_packet_queue != NULL) {
-		packet_queue_deinit(data->video_packet_queue);
-		data->video_packet_queue = NULL;
-	}
-
+static void _free_video_buffers(videodecoder_data_struct *data) {
 	if (data->sws_ctx != NULL) {
 		sws_freeContext(data->sws_ctx);
 		data->sws_ctx = NULL;
 	}
 
-	if (data->audio_frame != NULL) {
-		av_frame_unref(data->audio_frame);
-		data->audio_frame = NULL;
-	}
-
 	if (data->frame_rgb != NULL) {
-		av_frame_unref(data->frame_rgb);
+		av_frame_free(&data->frame_rgb);
 		data->frame_rgb = NULL;
 	}
 
 	if (data->frame_yuv != NULL) {
-		av_frame_unref(data->frame_yuv);
+		av_frame_free(&data->frame_yuv);
 		data->frame_yuv = NULL;
 	}
 
 	if (data->frame_buffer != NULL) {
-		api->godot_free(data->frame_buffer);
+		mem_free(&data->mem, MEM_VIDEO, data->frame_buffer, data->frame_buffer_size);
 		data->frame_buffer = NULL;
 		data->frame_buffer_size = 0;
 	}
+}
 
+static void _close_video_codec(videodecoder_data_struct *data) {
 	if (data->vcodec_ctx != NULL) {
 		if (data->vcodec_open) {
 			avcodec_close(data->vcodec_ctx);
 			data->vcodec_open = GODOT_FALSE;
 		}
+		frame_pool_detach(data->vcodec_ctx);
 		avcodec_free_context(&data->vcodec_ctx);
 		data->vcodec_ctx = NULL;
 	}
+}
 
+static void _close_audio_codec(videodecoder_data_struct *data) {
 	if (data->acodec_ctx != NULL) {
 		if (data->acodec_open) {
 			avcodec_close(data->acodec_ctx);
-			data->vcodec_open = GODOT_FALSE;
-			avcodec_free_context(&data->acodec_ctx);
-			data->acodec_ctx = NULL;
+			data->acodec_open = GODOT_FALSE;
+		}
+		avcodec_free_context(&data->acodec_ctx);
+		data->acodec_ctx = NULL;
+	}
+
+	if (data->swr_ctx != NULL) {
+		swr_free(&data->swr_ctx);
+		data->swr_ctx = NULL;
+	}
+}
+
+// Codecs join their frame and slice threads when they are freed and the buffers are large,
+// so instances hand them to the reaper thread instead of freeing them in place: closing
+// a screen full of players doesn't stall the main thread and the instance can open the
+// next file right away. The demuxer is still closed in place when it reads through godot's
+// FileAccess, which may be gone by the time the reaper gets to it. Only one reading a
+// clip_file of its own can go with TEARDOWN_INPUT.
+enum TEARDOWN_PART {
+	TEARDOWN_VIDEO_CODEC = 1,
+	TEARDOWN_VIDEO_BUFFERS = 2,
+	TEARDOWN_AUDIO_CODEC = 4,
+	TEARDOWN_AUDIO_BUFFERS = 8,
+	TEARDOWN_QUEUES = 16,
+	TEARDOWN_INPUT = 32,
+};
+
+typedef struct teardown_t {
+	// the bytes of frame_buffer and audio_buffer, moved from the instance
+	mem_stats_t mem;
+	AVCodecContext *vcodec_ctx;
+	struct SwsContext *sws_ctx;
+	AVFrame *frame_yuv;
+	AVFrame *frame_rgb;
+	uint8_t *frame_buffer;
+	int frame_buffer_size;
+	AVCodecContext *acodec_ctx;
+	SwrContext *swr_ctx;
+	AVFrame *audio_frame;
+	float *audio_buffer;
+	int audio_buffer_size;
+	PacketQueue *audio_packet_queue;
+	PacketQueue *video_packet_queue;
+	AVFormatContext *format_ctx;
+	godot_bool input_open;
+	AVIOContext *io_ctx;
+	io_source_t *io_source;
+	uint8_t *io_chunk;
+	int io_chunk_size;
+	uint8_t *io_buffer;
+	int io_buffer_size;
+	gdfile_t *clip_file;
+} teardown_t;
+
+static worker_t *reaper = NULL;
+static vd_mutex reaper_mutex;
+// teardowns handed to the reaper that aren't done yet
+static volatile int64_t teardown_pending = 0;
+
+static void _teardown_take(videodecoder_data_struct *data, teardown_t *t, int parts) {
+	if (parts & TEARDOWN_VIDEO_CODEC) {
+		t->vcodec_ctx = data->vcodec_ctx;
+		data->vcodec_ctx = NULL;
+		data->vcodec_open = GODOT_FALSE;
+	}
+	if (parts & TEARDOWN_VIDEO_BUFFERS) {
+		t->sws_ctx = data->sws_ctx;
+		t->frame_yuv = data->frame_yuv;
+		t->frame_rgb = data->frame_rgb;
+		if (data->frame_buffer != NULL) {
+			mem_transfer(&data->mem, &t->mem, MEM_VIDEO, data->frame_buffer_size);
+			t->frame_buffer = data->frame_buffer;
+			t->frame_buffer_size = data->frame_buffer_size;
+		}
+		data->sws_ctx = NULL;
+		data->frame_yuv = NULL;
+		data->frame_rgb = NULL;
+		data->frame_buffer = NULL;
+		data->frame_buffer_size = 0;
+	}
+	if (parts & TEARDOWN_AUDIO_CODEC) {
+		t->acodec_ctx = data->acodec_ctx;
+		t->swr_ctx = data->swr_ctx;
+		data->acodec_ctx = NULL;
+		data->acodec_open = GODOT_FALSE;
+		data->swr_ctx = NULL;
+	}
+	if (parts & TEARDOWN_AUDIO_BUFFERS) {
+		t->audio_frame = data->audio_frame;
+		if (data->audio_buffer != NULL) {
+			mem_transfer(&data->mem, &t->mem, MEM_AUDIO, data->audio_buffer_size * sizeof(float));
+			t->audio_buffer = data->audio_buffer;
+			t->audio_buffer_size = data->audio_buffer_size;
 		}
+		data->audio_frame = NULL;
+		data->audio_buffer = NULL;
+		data->audio_buffer_size = 0;
+	}
+	if (parts & TEARDOWN_QUEUES) {
+		t->audio_packet_queue = data->audio_packet_queue;
+		t->video_packet_queue = data->video_packet_queue;
+		data->audio_packet_queue = NULL;
+		data->video_packet_queue = NULL;
+	}
+	if ((parts & TEARDOWN_INPUT) && data->clip_file != NULL) {
+		t->format_ctx = data->format_ctx;
+		t->input_open = data->input_open;
+		t->io_ctx = data->io_ctx;
+		t->io_source = data->io_source;
+		if (data->io_chunk != NULL) {
+			mem_transfer(&data->mem, &t->mem, MEM_IO, data->io_chunk_size);
+			t->io_chunk = data->io_chunk;
+			t->io_chunk_size = data->io_chunk_size;
+		}
+		if (data->io_buffer != NULL) {
+			mem_transfer(&data->mem, &t->mem, MEM_IO, data->io_buffer_size);
+			t->io_buffer = data->io_buffer;
+			t->io_buffer_size = data->io_buffer_size;
+		}
+		t->clip_file = data->clip_file;
+		data->format_ctx = NULL;
+		data->input_open = GODOT_FALSE;
+		data->io_ctx = NULL;
+		data->io_source = NULL;
+		data->io_chunk = NULL;
+		data->io_chunk_size = 0;
+		data->io_buffer = NULL;
+		data->io_buffer_size = 0;
+		data->clip_file = NULL;
+	}
+}
+
+static bool _teardown_empty(const teardown_t *t) {
+	return t->vcodec_ctx == NULL && t->sws_ctx == NULL && t->frame_yuv == NULL && t->frame_rgb == NULL
+			&& t->frame_buffer == NULL && t->acodec_ctx == NULL && t->swr_ctx == NULL && t->audio_frame == NULL
+			&& t->audio_buffer == NULL && t->audio_packet_queue == NULL && t->video_packet_queue == NULL
+			&& t->format_ctx == NULL && t->clip_file == NULL;
+}
+
+static void _teardown_free(teardown_t *t) {
+	if (t->sws_ctx != NULL) {
+		sws_freeContext(t->sws_ctx);
+	}
+	av_frame_free(&t->frame_rgb);
+	av_frame_free(&t->frame_yuv);
+	av_frame_free(&t->audio_frame);
+	mem_free(&t->mem, MEM_VIDEO, t->frame_buffer, t->frame_buffer_size);
+	mem_free(&t->mem, MEM_AUDIO, t->audio_buffer, t->audio_buffer_size * sizeof(float));
+	if (t->vcodec_ctx != NULL) {
+		frame_pool_detach(t->vcodec_ctx);
+		avcodec_free_context(&t->vcodec_ctx);
+	}
+	avcodec_free_context(&t->acodec_ctx);
+	swr_free(&t->swr_ctx);
+	if (t->audio_packet_queue != NULL) {
+		packet_queue_deinit(t->audio_packet_queue);
+	}
+	if (t->video_packet_queue != NULL) {
+		packet_queue_deinit(t->video_packet_queue);
+	}
+	// in the order of _close_input()
+	if (t->format_ctx != NULL) {
+		if (t->input_open) {
+			avformat_close_input(&t->format_ctx);
+		}
+		avformat_free_context(t->format_ctx);
+	}
+	if (t->io_ctx != NULL) {
+		avio_context_free(&t->io_ctx);
+	}
+	io_source_close(t->io_source);
+	mem_free(&t->mem, MEM_IO, t->io_chunk, t->io_chunk_size);
+	mem_free(&t->mem, MEM_IO, t->io_buffer, t->io_buffer_size);
+	if (t->clip_file != NULL) {
+		gdfile_close(t->clip_file);
+	}
+}
+
+static void _teardown_job(void *arg) {
+	teardown_t *t = (teardown_t *)arg;
+	_teardown_free(t);
+	api->godot_free(t);
+	vd_atomic_add(&teardown_pending, -1);
+}
+
+// Detaches the `parts` (TEARDOWN_PART flags) of the instance and frees them on the reaper.
+static void _teardown(videodecoder_data_struct *data, int parts) {
+	teardown_t local;
+	memset(&local, 0, sizeof(local));
+	_teardown_take(data, &local, parts);
+	if (_teardown_empty(&local)) {
+		return;
+	}
+	teardown_t *t = (teardown_t *)api->godot_alloc(sizeof(teardown_t));
+	if (t == NULL) {
+		_teardown_free(&local);
+		return;
+	}
+	*t = local;
+
+	vd_mutex_lock(&reaper_mutex);
+	if (reaper == NULL) {
+		reaper = worker_create(1);
+	}
+	worker_t *w = reaper;
+	vd_mutex_unlock(&reaper_mutex);
+
+	vd_atomic_add(&teardown_pending, 1);
+	if (w == NULL || worker_push(w, _teardown_job, t) != 0) {
+		_teardown_job(t);
+	}
+}
+
+// Frees whatever is still queued before the library goes away.
+static void _teardown_shutdown() {
+	if (reaper != NULL) {
+		worker_destroy(reaper);
+		reaper = NULL;
+	}
+	vd_mutex_destroy(&reaper_mutex);
+}
+
+// Closes the file but keeps the codecs, scaler, resampler, queues and buffers,
+// so _open_stream() can reuse them when the next file is similar.
+static void _close_input(videodecoder_data_struct *data) {
+	_ahead_stop(data);
+	_bake_release(data);
+
+	if (data->audio_packet_queue != NULL) {
+		packet_queue_flush(data->audio_packet_queue);
+	}
+
+	if (data->video_packet_queue != NULL) {
+		packet_queue_flush(data->video_packet_queue);
 	}
 
 	if (data->format_ctx != NULL) {
@@ -253,30 +805,68 @@ static void _cleanup(videodecoder_data_struct *data) {
 		data->io_ctx = NULL;
 	}
 
-	if (data->io_buffer != NULL) {
-		api->godot_free(data->io_buffer);
-		data->io_buffer = NULL;
+	if (data->io_source != NULL) {
+		io_source_close(data->io_source);
+		data->io_source = NULL;
 	}
 
-	if (data->audio_buffer != NULL) {
-		api->godot_free(data->audio_buffer);
-		data->audio_buffer = NULL;
+	if (data->io_chunk != NULL) {
+		mem_free(&data->mem, MEM_IO, data->io_chunk, data->io_chunk_size);
+		data->io_chunk = NULL;
 	}
+	// set while suspended too, see _suspend()
+	data->io_chunk_size = 0;
 
-	if (data->swr_ctx != NULL) {
-		swr_free(&data->swr_ctx);
-		data->swr_ctx = NULL;
+	if (data->io_buffer != NULL) {
+		mem_free(&data->mem, MEM_IO, data->io_buffer, data->io_buffer_size * sizeof(uint8_t));
+		data->io_buffer = NULL;
+		data->io_buffer_size = 0;
+	}
+
+	if (data->clip_file != NULL) {
+		gdfile_close(data->clip_file);
+		data->clip_file = NULL;
 	}
 
 	data->time = 0;
+	data->clock = 0;
+	data->speed = 0;
 	data->seek_time = 0;
 	data->diff_tolerance = 0;
 	data->videostream_idx = -1;
 	data->audiostream_idx = -1;
+	data->audio_channels = 0;
+	data->audio_channel_layout = 0;
+	data->audio_mix_rate = 0;
+	data->out_width = data->out_height = 0;
+	data->crop_width = data->crop_height = 0;
 	data->num_decoded_samples = 0;
 	data->audio_buffer_pos = 0;
+	data->demux_eof = false;
+	data->loop_offset = data->loop_end = 0;
+	data->clip_offset = 0;
+	data->clip_ended = false;
+	data->wait_keyframe = false;
+	data->live_newest = NAN;
+	data->suspended = false;
+	data->bake_frame = -1;
+	data->poster_pending = false;
+	data->mem_trimmed = false;
+	data->frame_time = NAN;
+	data->frame_duration = 0;
+
+	data->drop_frame = data->total_frame = data->repeat_frame = 0;
+	data->trimmed_packets = 0;
+}
 
-	data->drop_frame = data->total_frame = 0;
+// Cleanup should empty the struct to the point where you can open a new file from.
+static void _cleanup(videodecoder_data_struct *data) {
+	_ahead_stop(data);
+
+	_teardown(data, TEARDOWN_VIDEO_CODEC | TEARDOWN_VIDEO_BUFFERS | TEARDOWN_AUDIO_CODEC
+			| TEARDOWN_AUDIO_BUFFERS | TEARDOWN_QUEUES);
+
+	_close_input(data);
 }
 
 static void _unwrap_video_frame(godot_pool_byte_array *dest, AVFrame *frame, int width, int height) {
@@ -405,6 +995,13 @@ inline static bool api_ver(godot_gdnative_api_version v, unsigned int want_major
 void GDN_EXPORT godot_gdnative_init(godot_gdnative_init_options *p_options) {
 	_setup_clock();
 	api = p_options->api_struct;
+	vd_mutex_init(&instances_mutex);
+	vd_mutex_init(&preload_mutex);
+	vd_mutex_init(&reaper_mutex);
+	vd_mutex_init(&bake_mutex);
+	frame_pool_init();
+	io_sched_init();
+	vd_cond_init(&preload_cond);
 	for (int i = 0; i < api->num_extensions; i++) {
 		switch (api->extensions[i]->type) {
 			case GDNATIVE_EXT_VIDEODECODER:
@@ -428,7 +1025,25 @@ void GDN_EXPORT godot_gdnative_init(godot_gdnative_init_options *p_options) {
 	print_codecs();
 }
 
+static void _preload_shutdown();
+static void _atlas_shutdown();
+static void _ahead_shutdown();
+static void _thumbnail_shutdown();
+static void _compress_shutdown();
+
 void GDN_EXPORT godot_gdnative_terminate(godot_gdnative_terminate_options *p_options) {
+	_preload_shutdown();
+	_thumbnail_shutdown();
+	_compress_shutdown();
+	_atlas_shutdown();
+	_ahead_shutdown();
+	_teardown_shutdown();
+	frame_pool_shutdown();
+	io_sched_shutdown();
+	vd_cond_destroy(&preload_cond);
+	vd_mutex_destroy(&bake_mutex);
+	vd_mutex_destroy(&preload_mutex);
+	vd_mutex_destroy(&instances_mutex);
 	api = NULL;
 }
 
@@ -438,13 +1053,33 @@ void GDN_EXPORT godot_gdnative_singleton() {
 	}
 }
 
+static ahead_queue_t *_ahead_create();
+static mip_chain_t *_mip_create();
+
 void *godot_videodecoder_constructor(godot_object *p_instance) {
 	videodecoder_data_struct *data = api->godot_alloc(sizeof(videodecoder_data_struct));
 
 	data->instance = p_instance;
+	data->id = -1;
+	data->next_instance = NULL;
+	data->options = default_options;
+	data->last_visible_msec = 0;
+	data->mem_shrunk = false;
+	memset(&data->mem, 0, sizeof(data->mem));
+	data->next_clip = -1;
+	data->atlas = NULL;
+	data->atlas_x = data->atlas_y = 0;
+	data->atlas_dirty = false;
+	data->atlas_dst = NULL;
+	data->ahead = _ahead_create();
+	data->mips = _mip_create();
 
 	data->io_buffer = NULL;
+	data->io_buffer_size = 0;
 	data->io_ctx = NULL;
+	data->io_source = NULL;
+	data->io_chunk = NULL;
+	data->io_chunk_size = 0;
 
 	data->format_ctx = NULL;
 	data->input_open = GODOT_FALSE;
@@ -459,12 +1094,19 @@ void *godot_videodecoder_constructor(godot_object *p_instance) {
 
 	data->frame_buffer = NULL;
 	data->frame_buffer_size = 0;
+	data->out_width = data->out_height = 0;
+	data->crop_width = data->crop_height = 0;
 
 	data->audiostream_idx = -1;
+	data->audio_track = -1;
+	data->audio_channels = 0;
+	data->audio_channel_layout = 0;
+	data->audio_mix_rate = 0;
 	data->acodec_ctx = NULL;
 	data->acodec_open = GODOT_FALSE;
 	data->audio_frame = NULL;
 	data->audio_buffer = NULL;
+	data->audio_buffer_size = 0;
 
 	data->swr_ctx = NULL;
 
@@ -473,25 +1115,82 @@ void *godot_videodecoder_constructor(godot_object *p_instance) {
 
 	data->audio_packet_queue = NULL;
 	data->video_packet_queue = NULL;
+	data->demux_eof = false;
+	data->loop_offset = data->loop_end = 0;
+	data->clip_offset = 0;
+	data->clip_file = NULL;
+	data->clip_ended = false;
+	data->wait_keyframe = false;
+	data->live_newest = NAN;
+	data->suspended = false;
+	data->bake = NULL;
+	data->bake_recording = false;
+	data->bake_serving = false;
+	data->bake_frame = -1;
 
 	data->position_type = POS_A_TIME;
 	data->time = 0;
+	data->clock = 0;
+	data->speed = 0;
 	data->audio_time = NAN;
 
 	data->frame_unwrapped = false;
+	data->poster_pending = false;
+	data->frame_time = NAN;
+	data->frame_duration = 0;
+	data->frame_changed = false;
+	data->drop_frame = data->total_frame = data->repeat_frame = 0;
+	data->trimmed_packets = 0;
 	api->godot_pool_byte_array_new(&data->unwrapped_frame);
 
+	if (p_instance != NULL) {
+		vd_mutex_lock(&instances_mutex);
+		data->id = ++instance_serial;
+		data->next_instance = instances;
+		instances = data;
+		vd_mutex_unlock(&instances_mutex);
+	}
+
 	return data;
 }
 
-void godot_videodecoder_destructor(void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+static void _ahead_free(ahead_queue_t *ahead);
+static void _mip_free(mip_chain_t *mips);
+
+static void _free_data(videodecoder_data_struct *data) {
 	_cleanup(data);
 
 	data->instance = NULL;
 	api->godot_pool_byte_array_destroy(&data->unwrapped_frame);
+	_ahead_free(data->ahead);
+	_mip_free(data->mips);
 
 	api->godot_free(data);
+}
+
+void godot_videodecoder_destructor(void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct **link = &instances;
+	while (*link != NULL && *link != data) {
+		link = &(*link)->next_instance;
+	}
+	if (*link != NULL) {
+		*link = data->next_instance;
+	}
+	if (last_instance_id == data->id) {
+		last_instance_id = -1;
+	}
+	if (data->atlas != NULL) {
+		_atlas_remove(data);
+	}
+	vd_mutex_unlock(&instances_mutex);
+
+	if (data->next_clip >= 0) {
+		videodecoder_release(data->next_clip);
+	}
+	_free_data(data);
 	data = NULL; // Not needed, but just to be safe.
 
 	if (num_supported_ext > 0) {
@@ -515,92 +1214,50 @@ const char *godot_videodecoder_get_plugin_name(void) {
 	return plugin_name;
 }
 
-godot_bool godot_videodecoder_open_file(void *p_data, void *file) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-
-	// Clean up the previous file.
-	_cleanup(data);
-
-	data->io_buffer = (uint8_t *)api->godot_alloc(IO_BUFFER_SIZE * sizeof(uint8_t));
-	if (data->io_buffer == NULL) {
-		_cleanup(data);
-		api->godot_print_warning("Buffer alloc error", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
-	}
-
-	godot_int read_bytes = videodecoder_api->godot_videodecoder_file_read(file, data->io_buffer, IO_BUFFER_SIZE);
-
-	// Rewind to 0
-	videodecoder_api->godot_videodecoder_file_seek(file, 0, SEEK_SET);
-
-	// Determine input format
-	AVProbeData probe_data;
-	probe_data.buf = data->io_buffer;
-	probe_data.buf_size = read_bytes;
-	probe_data.filename = "";
-	probe_data.mime_type = "";
-
-	AVInputFormat *input_format = NULL;
-	input_format = av_probe_input_format(&probe_data, 1);
-	if (input_format == NULL) {
-		_cleanup(data);
-		char msg[512] = {0};
-		snprintf(msg, sizeof(msg) - 1, "Format not recognized: %s (%s)", probe_data.filename, probe_data.mime_type);
-		api->godot_print_error(msg, "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
-	}
-	input_format->flags |= AVFMT_SEEK_TO_PTS;
-
-	data->io_ctx = avio_alloc_context(data->io_buffer, IO_BUFFER_SIZE, 0, file,
-			videodecoder_api->godot_videodecoder_file_read, NULL,
-			videodecoder_api->godot_videodecoder_file_seek);
-	if (data->io_ctx == NULL) {
-		_cleanup(data);
-		api->godot_print_error("IO context alloc error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+// Index of the nth stream of `type` in the container, or -1.
+static int _find_stream(videodecoder_data_struct *data, enum AVMediaType type, int nth) {
+	for (int i = 0; i < data->format_ctx->nb_streams; i++) {
+		if (data->format_ctx->streams[i]->codecpar->codec_type == type && nth-- == 0) {
+			return i;
+		}
 	}
+	return -1;
+}
 
-	data->format_ctx = avformat_alloc_context();
-	if (data->format_ctx == NULL) {
-		_cleanup(data);
-		api->godot_print_error("Format context alloc error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+#define MIN_SPEED 0.25
+#define MAX_SPEED 16.0
+// above NONREF_SPEED non-reference frames aren't decoded, above KEYFRAME_SPEED only keyframes are.
+#define NONREF_SPEED 2.0
+#define KEYFRAME_SPEED 4.0
+// audio is resampled up to this speed and muted above it.
+#define MAX_AUDIO_SPEED 2.0
+
+static double _speed(videodecoder_data_struct *data) {
+	if (data->options.offline || data->options.live) {
+		return 1.0;
 	}
+	return FFMIN(FFMAX(data->options.speed, MIN_SPEED), MAX_SPEED);
+}
 
-	data->format_ctx->pb = data->io_ctx;
-	data->format_ctx->flags = AVFMT_FLAG_CUSTOM_IO;
-	data->format_ctx->iformat = input_format;
-
-	if (avformat_open_input(&data->format_ctx, "", NULL, NULL) != 0) {
-		_cleanup(data);
-		api->godot_print_error("Input stream failed to open", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
-	}
-	data->input_open = GODOT_TRUE;
+static bool _audio_muted(videodecoder_data_struct *data) {
+	return data->speed > MAX_AUDIO_SPEED;
+}
 
-	if (avformat_find_stream_info(data->format_ctx, NULL) < 0) {
-		_cleanup(data);
-		api->godot_print_error("Could not find stream info.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
-	}
+static enum AVDiscard _skip_frame(double speed) {
+	return speed > KEYFRAME_SPEED ? AVDISCARD_NONKEY : (speed > NONREF_SPEED ? AVDISCARD_NONREF : AVDISCARD_DEFAULT);
+}
 
-	data->videostream_idx = -1; // should be -1 anyway, just being paranoid.
-	data->audiostream_idx = -1;
-	// find stream
+// Let the demuxer skip every packet of the streams we don't decode
+// instead of reading them just to unref them in read_frame().
+static void _update_discard(videodecoder_data_struct *data) {
 	for (int i = 0; i < data->format_ctx->nb_streams; i++) {
-		if (data->format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-			data->videostream_idx = i;
-		} else if (data->format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-			data->audiostream_idx = i;
-		}
-	}
-	if (data->videostream_idx == -1) {
-		_cleanup(data);
-		api->godot_print_error("Video Stream not found.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+		bool selected = (i == data->videostream_idx && !data->bake_serving) || (i == data->audiostream_idx && !_audio_muted(data));
+		data->format_ctx->streams[i]->discard = selected ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
 	}
+}
 
-	AVCodecParameters *vcodec_param = data->format_ctx->streams[data->videostream_idx]->codecpar;
+static godot_bool _open_video_codec(videodecoder_data_struct *data, int stream_idx) {
+	AVCodecParameters *vcodec_param = data->format_ctx->streams[stream_idx]->codecpar;
 
 	AVCodec *vcodec = NULL;
 	vcodec = avcodec_find_decoder(vcodec_param->codec_id);
@@ -609,548 +1266,4717 @@ godot_bool godot_videodecoder_open_file(void *p_data, void *file) {
 		char msg[512] = {0};
 		snprintf(msg, sizeof(msg) - 1, "Videodecoder %s (%s) not found.", desc->name, desc->long_name);
 		api->godot_print_warning(msg, "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		_cleanup(data);
 		return GODOT_FALSE;
 	}
 
 	data->vcodec_ctx = avcodec_alloc_context3(vcodec);
 	if (data->vcodec_ctx == NULL) {
-		_cleanup(data);
 		api->godot_print_warning("Videocodec allocation error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 		return GODOT_FALSE;
 	}
 
 	if (avcodec_parameters_to_context(data->vcodec_ctx, vcodec_param) < 0) {
-		_cleanup(data);
 		api->godot_print_warning("Videocodec context init error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 		return GODOT_FALSE;
 	}
-	// enable multi-thread decoding based on CPU core count
-	data->vcodec_ctx->thread_count = 0;
+	frame_pool_attach(data->vcodec_ctx);
+	// enable multi-thread decoding based on CPU core count, unless decoder_threads says otherwise
+	data->vcodec_ctx->thread_count = (int)FFMAX(data->options.decoder_threads, 0);
+	if (data->options.live) {
+		// frame threading holds back a frame per thread
+		data->vcodec_ctx->thread_type = FF_THREAD_SLICE;
+		data->vcodec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	}
+	// reopened on resume, track switches and bake fallback at the current speed
+	data->vcodec_ctx->skip_frame = _skip_frame(data->speed);
 
 	if (avcodec_open2(data->vcodec_ctx, vcodec, NULL) < 0) {
-		_cleanup(data);
 		api->godot_print_warning("Videocodec failed to open.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 		return GODOT_FALSE;
 	}
 	data->vcodec_open = GODOT_TRUE;
+	return GODOT_TRUE;
+}
 
+static godot_bool _init_audio_output(videodecoder_data_struct *data);
 
-	AVCodecParameters *acodec_param = NULL;
-	AVCodec *acodec = NULL;
-	if (data->audiostream_idx >= 0) {
-		acodec_param = data->format_ctx->streams[data->audiostream_idx]->codecpar;
+// A codec context opened for another file can decode this stream as is.
+static bool _codec_matches(AVCodecContext *ctx, AVCodecParameters *par) {
+	if (ctx->codec_id != par->codec_id || ctx->extradata_size != par->extradata_size) {
+		return false;
+	}
+	if (par->extradata_size > 0 && memcmp(ctx->extradata, par->extradata, par->extradata_size) != 0) {
+		return false;
+	}
+	if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+		return ctx->width == par->width && ctx->height == par->height && ctx->pix_fmt == par->format;
+	}
+	return ctx->sample_rate == par->sample_rate && ctx->channels == par->channels
+		&& ctx->channel_layout == par->channel_layout && ctx->sample_fmt == par->format;
+}
 
-		acodec = avcodec_find_decoder(acodec_param->codec_id);
-		if (acodec == NULL) {
-			const AVCodecDescriptor *desc = avcodec_descriptor_get(acodec_param->codec_id);
-			char msg[512] = {0};
-			snprintf(msg, sizeof(msg) - 1, "Audiodecoder %s (%s) not found.", desc-> name, desc->long_name);
-			api->godot_print_warning(msg, "godot_videodecoder_open_file()", __FILE__, __LINE__);
-			_cleanup(data);
-			return GODOT_FALSE;
-		}
-		data->acodec_ctx = avcodec_alloc_context3(acodec);
-		if (data->acodec_ctx == NULL) {
-			_cleanup(data);
-			api->godot_print_error("Audiocodec allocation error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-			return GODOT_FALSE;
+// Keeps the video codec (and its threads) of the previous file if it matches the stream.
+static godot_bool _reopen_video_codec(videodecoder_data_struct *data, int stream_idx) {
+	if (data->vcodec_ctx != NULL) {
+		if (_codec_matches(data->vcodec_ctx, data->format_ctx->streams[stream_idx]->codecpar)) {
+			avcodec_flush_buffers(data->vcodec_ctx);
+			return GODOT_TRUE;
 		}
+		_teardown(data, TEARDOWN_VIDEO_CODEC);
+	}
+	return _open_video_codec(data, stream_idx);
+}
 
-		if (avcodec_parameters_to_context(data->acodec_ctx, acodec_param) < 0) {
-			_cleanup(data);
-			api->godot_print_error("Audiocodec context init error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-			return GODOT_FALSE;
-		}
+// The output channel layout is fixed by the first audio stream that's opened,
+// godot sizes its mix buffer from get_channels() once.
+static godot_bool _open_audio_codec(videodecoder_data_struct *data, int stream_idx) {
+	AVCodecParameters *acodec_param = data->format_ctx->streams[stream_idx]->codecpar;
 
-		if (avcodec_open2(data->acodec_ctx, acodec, NULL) < 0) {
-			_cleanup(data);
-			api->godot_print_error("Audiocodec failed to open.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-			return GODOT_FALSE;
-		}
-		data->acodec_open = GODOT_TRUE;
+	AVCodec *acodec = avcodec_find_decoder(acodec_param->codec_id);
+	if (acodec == NULL) {
+		const AVCodecDescriptor *desc = avcodec_descriptor_get(acodec_param->codec_id);
+		char msg[512] = {0};
+		snprintf(msg, sizeof(msg) - 1, "Audiodecoder %s (%s) not found.", desc-> name, desc->long_name);
+		api->godot_print_warning(msg, "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+	data->acodec_ctx = avcodec_alloc_context3(acodec);
+	if (data->acodec_ctx == NULL) {
+		api->godot_print_error("Audiocodec allocation error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	if (avcodec_parameters_to_context(data->acodec_ctx, acodec_param) < 0) {
+		api->godot_print_error("Audiocodec context init error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	if (avcodec_open2(data->acodec_ctx, acodec, NULL) < 0) {
+		api->godot_print_error("Audiocodec failed to open.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+	data->acodec_open = GODOT_TRUE;
+	return _init_audio_output(data);
+}
 
-		data->audio_buffer = (float *)api->godot_alloc(AUDIO_BUFFER_MAX_SIZE * sizeof(float));
+// Decoded audio is resampled to audio_channel_layout, float, audio_mix_rate.
+// The resampler is kept when the codec was reused and the output layout didn't change.
+static godot_bool _init_audio_output(videodecoder_data_struct *data) {
+	if (data->audio_buffer == NULL) {
+		data->audio_buffer = (float *)mem_alloc(&data->mem, MEM_AUDIO, AUDIO_BUFFER_MIN_SIZE * sizeof(float));
 		if (data->audio_buffer == NULL) {
-			_cleanup(data);
 			api->godot_print_error("Audio buffer alloc failed.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 			return GODOT_FALSE;
 		}
+		data->audio_buffer_size = AUDIO_BUFFER_MIN_SIZE;
+	}
 
+	if (data->audio_frame == NULL) {
 		data->audio_frame = av_frame_alloc();
 		if (data->audio_frame == NULL) {
-			_cleanup(data);
 			api->godot_print_error("Frame alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 			return GODOT_FALSE;
 		}
-
-		data->swr_ctx = swr_alloc();
-		av_opt_set_int(data->swr_ctx, "in_channel_layout", data->acodec_ctx->channel_layout, 0);
-		av_opt_set_int(data->swr_ctx, "out_channel_layout", data->acodec_ctx->channel_layout, 0);
-		av_opt_set_int(data->swr_ctx, "in_sample_rate", data->acodec_ctx->sample_rate, 0);
-		av_opt_set_int(data->swr_ctx, "out_sample_rate", AUDIO_MIX_RATE, 0);
-		av_opt_set_sample_fmt(data->swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
-		av_opt_set_sample_fmt(data->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-		swr_init(data->swr_ctx);
 	}
 
-	// NOTE: Align of 1 (I think it is for 32 bit alignment.) Doesn't work otherwise
-	data->frame_buffer_size = av_image_get_buffer_size(AV_PIX_FMT_RGB32,
-			data->vcodec_ctx->width, data->vcodec_ctx->height, 1);
-
-	data->frame_buffer = (uint8_t *)api->godot_alloc(data->frame_buffer_size);
-	if (data->frame_buffer == NULL) {
-		_cleanup(data);
-		api->godot_print_error("Framebuffer alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+	uint64_t in_channel_layout = data->acodec_ctx->channel_layout;
+	if (in_channel_layout == 0) {
+		in_channel_layout = av_get_default_channel_layout(data->acodec_ctx->channels);
 	}
-
-	data->frame_rgb = av_frame_alloc();
-	if (data->frame_rgb == NULL) {
-		_cleanup(data);
-		api->godot_print_error("Frame alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+	if (data->audio_channels == 0) {
+		data->audio_channels = data->acodec_ctx->channels;
+		data->audio_channel_layout = in_channel_layout;
+		data->audio_mix_rate = (int)FFMIN(FFMAX(data->options.mix_rate, 8000), 192000);
 	}
 
-	data->frame_yuv = av_frame_alloc();
-	if (data->frame_yuv == NULL) {
-		_cleanup(data);
-		api->godot_print_error("Frame alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
-		return GODOT_FALSE;
+	// faster playback: the samples are played back at a higher rate (pitch included).
+	double audio_speed = data->speed > 0 ? FFMIN(data->speed, MAX_AUDIO_SPEED) : 1.0;
+	int64_t in_sample_rate = llrint(data->acodec_ctx->sample_rate * audio_speed);
+	if (data->swr_ctx != NULL) {
+		int64_t out_channel_layout = 0;
+		int64_t current_layout = 0;
+		int64_t current_rate = 0;
+		enum AVSampleFormat current_fmt = AV_SAMPLE_FMT_NONE;
+		av_opt_get_int(data->swr_ctx, "out_channel_layout", 0, &out_channel_layout);
+		av_opt_get_int(data->swr_ctx, "in_channel_layout", 0, &current_layout);
+		av_opt_get_int(data->swr_ctx, "in_sample_rate", 0, &current_rate);
+		av_opt_get_sample_fmt(data->swr_ctx, "in_sample_fmt", 0, &current_fmt);
+		if ((uint64_t)out_channel_layout == data->audio_channel_layout && (uint64_t)current_layout == in_channel_layout
+				&& current_rate == in_sample_rate && current_fmt == data->acodec_ctx->sample_fmt) {
+			// drops the samples it still buffers from the previous file or rate
+			if (swr_init(data->swr_ctx) >= 0) {
+				return GODOT_TRUE;
+			}
+		}
+		swr_free(&data->swr_ctx);
+	}
+	data->swr_ctx = swr_alloc();
+	av_opt_set_int(data->swr_ctx, "in_channel_layout", in_channel_layout, 0);
+	av_opt_set_int(data->swr_ctx, "out_channel_layout", data->audio_channel_layout, 0);
+	av_opt_set_int(data->swr_ctx, "in_sample_rate", in_sample_rate, 0);
+	av_opt_set_int(data->swr_ctx, "out_sample_rate", data->audio_mix_rate, 0);
+	av_opt_set_sample_fmt(data->swr_ctx, "in_sample_fmt", data->acodec_ctx->sample_fmt, 0);
+	av_opt_set_sample_fmt(data->swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+	swr_init(data->swr_ctx);
+	return GODOT_TRUE;
+}
+
+static godot_bool _reopen_audio_codec(videodecoder_data_struct *data, int stream_idx) {
+	if (data->acodec_ctx != NULL) {
+		if (_codec_matches(data->acodec_ctx, data->format_ctx->streams[stream_idx]->codecpar)) {
+			avcodec_flush_buffers(data->acodec_ctx);
+			return _init_audio_output(data);
+		}
+		_teardown(data, TEARDOWN_AUDIO_CODEC);
+	}
+	return _open_audio_codec(data, stream_idx);
+}
+
+// Size of the crop options' region within the video codec's frames.
+static void _crop_size(videodecoder_data_struct *data, int *width, int *height) {
+	int w = data->vcodec_ctx->width, h = data->vcodec_ctx->height;
+	int x = (int)FFMIN(FFMAX(data->options.crop_x, 0), w - 1);
+	int y = (int)FFMIN(FFMAX(data->options.crop_y, 0), h - 1);
+	// the region ends at the frame's edge
+	*width = data->options.crop_width > 0 ? (int)FFMIN(data->options.crop_width, w - x) : w - x;
+	*height = data->options.crop_height > 0 ? (int)FFMIN(data->options.crop_height, h - y) : h - y;
+}
+
+// Conversion from the video codec's frames to out_width x out_height RGBA.
+// Buffers of the previous file are kept if they have the right size.
+static godot_bool _alloc_video_buffers(videodecoder_data_struct *data) {
+	// NOTE: Align of 1 (I think it is for 32 bit alignment.) Doesn't work otherwise
+	int frame_buffer_size = av_image_get_buffer_size(AV_PIX_FMT_RGB32,
+			data->out_width, data->out_height, 1);
+
+	if (data->frame_buffer != NULL && data->frame_buffer_size != frame_buffer_size) {
+		mem_free(&data->mem, MEM_VIDEO, data->frame_buffer, data->frame_buffer_size);
+		data->frame_buffer = NULL;
+	}
+	if (data->frame_buffer == NULL) {
+		data->frame_buffer_size = frame_buffer_size;
+		data->frame_buffer = (uint8_t *)mem_alloc(&data->mem, MEM_VIDEO, data->frame_buffer_size);
+		if (data->frame_buffer == NULL) {
+			api->godot_print_error("Framebuffer alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+			return GODOT_FALSE;
+		}
+	}
+
+	if (data->frame_rgb == NULL) {
+		data->frame_rgb = av_frame_alloc();
+		if (data->frame_rgb == NULL) {
+			api->godot_print_error("Frame alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+			return GODOT_FALSE;
+		}
+	}
+
+	if (data->frame_yuv == NULL) {
+		data->frame_yuv = av_frame_alloc();
+		if (data->frame_yuv == NULL) {
+			api->godot_print_error("Frame alloc fail.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+			return GODOT_FALSE;
+		}
+	} else {
+		av_frame_unref(data->frame_yuv);
 	}
 
-	int width = data->vcodec_ctx->width;
-	int height = data->vcodec_ctx->height;
 	if (av_image_fill_arrays(data->frame_rgb->data, data->frame_rgb->linesize, data->frame_buffer,
-				AV_PIX_FMT_RGB32, width, height, 1) < 0) {
-		_cleanup(data);
+				AV_PIX_FMT_RGB32, data->out_width, data->out_height, 1) < 0) {
 		api->godot_print_error("Frame fill.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 		return GODOT_FALSE;
 	}
 
-	data->sws_ctx = sws_getContext(width, height, data->vcodec_ctx->pix_fmt,
-			width, height, AV_PIX_FMT_RGB0, SWS_BILINEAR,
+	_crop_size(data, &data->crop_width, &data->crop_height);
+	data->sws_ctx = sws_getCachedContext(data->sws_ctx,
+			data->crop_width, data->crop_height, data->vcodec_ctx->pix_fmt,
+			data->out_width, data->out_height, AV_PIX_FMT_RGB0, (int)data->options.scale_flags,
 			NULL, NULL, NULL);
 	if (data->sws_ctx == NULL) {
-		_cleanup(data);
 		api->godot_print_error("Swscale context not created.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
 		return GODOT_FALSE;
 	}
+	return GODOT_TRUE;
+}
+
+typedef int (*io_read_func)(void *opaque, uint8_t *buf, int buf_size);
+typedef int64_t (*io_seek_func)(void *opaque, int64_t offset, int whence);
+
+static void _preroll(videodecoder_data_struct *data);
+
+// Opens the demuxer and codecs for the file behind `opaque`.
+// Safe to call off the main thread as long as nothing else touches `data`.
+static godot_bool _open_stream(videodecoder_data_struct *data, void *opaque, io_read_func read_packet, io_seek_func seek) {
+	data->io_buffer_size = (int)FFMIN(FFMAX(data->options.io_buffer_size, MIN_IO_BUFFER_SIZE), MAX_IO_BUFFER_SIZE);
+	data->io_buffer = (uint8_t *)mem_alloc(&data->mem, MEM_IO, data->io_buffer_size * sizeof(uint8_t));
+	if (data->io_buffer == NULL) {
+		_cleanup(data);
+		api->godot_print_warning("Buffer alloc error", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	if (!data->options.live && data->options.io_chunk_size > 0) {
+		data->io_chunk_size = (int)FFMIN(FFMAX(data->options.io_chunk_size, MIN_IO_BUFFER_SIZE), MAX_IO_BUFFER_SIZE);
+		data->io_chunk = (uint8_t *)mem_alloc(&data->mem, MEM_IO, data->io_chunk_size);
+		if (data->io_chunk == NULL) {
+			data->io_chunk_size = 0;
+		}
+	}
+	data->io_source = io_source_open(opaque, read_packet, seek, data->io_chunk, data->io_chunk_size);
+	if (data->io_source == NULL) {
+		_cleanup(data);
+		api->godot_print_warning("IO source alloc error", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+	opaque = data->io_source;
+	read_packet = io_source_read;
+	seek = io_source_seek;
+
+	AVInputFormat *input_format = NULL;
+	if (data->options.live) {
+		// a pipe can't be rewound after probing, let avformat_open_input() probe what it reads.
+		seek = NULL;
+	} else {
+		godot_int read_bytes = read_packet(opaque, data->io_buffer, data->io_buffer_size);
+
+		// Rewind to 0
+		seek(opaque, 0, SEEK_SET);
+
+		// Determine input format
+		AVProbeData probe_data;
+		probe_data.buf = data->io_buffer;
+		probe_data.buf_size = read_bytes;
+		probe_data.filename = "";
+		probe_data.mime_type = "";
+
+		input_format = av_probe_input_format(&probe_data, 1);
+		if (input_format == NULL) {
+			_cleanup(data);
+			char msg[512] = {0};
+			snprintf(msg, sizeof(msg) - 1, "Format not recognized: %s (%s)", probe_data.filename, probe_data.mime_type);
+			api->godot_print_error(msg, "godot_videodecoder_open_file()", __FILE__, __LINE__);
+			return GODOT_FALSE;
+		}
+		input_format->flags |= AVFMT_SEEK_TO_PTS;
+	}
+
+	data->io_ctx = avio_alloc_context(data->io_buffer, data->io_buffer_size, 0, opaque,
+			read_packet, NULL, seek);
+	if (data->io_ctx == NULL) {
+		_cleanup(data);
+		api->godot_print_error("IO context alloc error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	data->format_ctx = avformat_alloc_context();
+	if (data->format_ctx == NULL) {
+		_cleanup(data);
+		api->godot_print_error("Format context alloc error.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	data->format_ctx->pb = data->io_ctx;
+	data->format_ctx->flags = AVFMT_FLAG_CUSTOM_IO;
+	data->format_ctx->iformat = input_format;
+	if (data->options.live) {
+		data->format_ctx->flags |= AVFMT_FLAG_NOBUFFER;
+		data->format_ctx->probesize = LIVE_PROBE_SIZE;
+		data->format_ctx->max_analyze_duration = LIVE_ANALYZE_DURATION;
+	}
+
+	if (avformat_open_input(&data->format_ctx, "", NULL, NULL) != 0) {
+		_cleanup(data);
+		api->godot_print_error("Input stream failed to open", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+	data->input_open = GODOT_TRUE;
+
+	if (avformat_find_stream_info(data->format_ctx, NULL) < 0) {
+		_cleanup(data);
+		api->godot_print_error("Could not find stream info.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	data->videostream_idx = -1;
+	if (!data->options.audio_only) {
+		data->videostream_idx = av_find_best_stream(data->format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		if (data->videostream_idx < 0) {
+			data->videostream_idx = -1;
+		}
+	}
+	data->audiostream_idx = data->audio_track >= 0 ? _find_stream(data, AVMEDIA_TYPE_AUDIO, data->audio_track) : -1;
+	if (data->audiostream_idx < 0) {
+		data->audiostream_idx = av_find_best_stream(data->format_ctx, AVMEDIA_TYPE_AUDIO, -1, data->videostream_idx, NULL, 0);
+		if (data->audiostream_idx < 0) {
+			data->audiostream_idx = -1;
+		}
+	}
+
+	if (data->videostream_idx == -1 && data->audiostream_idx == -1) {
+		_cleanup(data);
+		api->godot_print_error("Video Stream not found.", "godot_videodecoder_open_file()", __FILE__, __LINE__);
+		return GODOT_FALSE;
+	}
+
+	if (data->videostream_idx < 0) {
+		_teardown(data, TEARDOWN_VIDEO_CODEC | TEARDOWN_VIDEO_BUFFERS);
+	} else if (!_reopen_video_codec(data, data->videostream_idx)) {
+		_cleanup(data);
+		return GODOT_FALSE;
+	}
+
+	if (data->audiostream_idx < 0) {
+		_teardown(data, TEARDOWN_AUDIO_CODEC);
+	} else if (!_reopen_audio_codec(data, data->audiostream_idx)) {
+		_cleanup(data);
+		return GODOT_FALSE;
+	}
+	_update_discard(data);
+
+	if (data->videostream_idx >= 0) {
+		if (data->out_width == 0) {
+			_crop_size(data, &data->out_width, &data->out_height);
+		}
+		if (!_alloc_video_buffers(data)) {
+			_cleanup(data);
+			return GODOT_FALSE;
+		}
+		if (data->options.live) {
+			// nothing may have arrived yet, show black until it does.
+			int size = data->out_width * data->out_height * 4;
+			api->godot_pool_byte_array_resize(&data->unwrapped_frame, size);
+			godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(&data->unwrapped_frame);
+			memset(api->godot_pool_byte_array_write_access_ptr(write_access), 0, size);
+			api->godot_pool_byte_array_write_access_destroy(write_access);
+			data->frame_unwrapped = true;
+		}
+	} else {
+		// Audio only: godot still wants a texture, give it a single transparent pixel.
+		data->out_width = data->out_height = 1;
+		api->godot_pool_byte_array_resize(&data->unwrapped_frame, 4);
+		godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(&data->unwrapped_frame);
+		memset(api->godot_pool_byte_array_write_access_ptr(write_access), 0, 4);
+		api->godot_pool_byte_array_write_access_destroy(write_access);
+	}
 
 	data->time = 0;
+	data->clock = 0;
 	data->num_decoded_samples = 0;
 
-	data->audio_packet_queue = packet_queue_init();
-	data->video_packet_queue = packet_queue_init();
+	if (data->audio_packet_queue == NULL) {
+		data->audio_packet_queue = packet_queue_init();
+	}
+	if (data->video_packet_queue == NULL) {
+		data->video_packet_queue = packet_queue_init();
+	}
 
 	data->drop_frame = data->total_frame = 0;
 
 	return GODOT_TRUE;
 }
 
-godot_real godot_videodecoder_get_length(const void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-
-	if (data->format_ctx == NULL) {
-		api->godot_print_warning("Format context is null.", "godot_videodecoder_get_length()", __FILE__, __LINE__);
-		return -1;
+static uint32_t _fnv1a(const uint8_t *buf, int size) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < size; i++) {
+		hash = (hash ^ buf[i]) * 16777619u;
 	}
+	return hash;
+}
 
-	return data->format_ctx->streams[data->videostream_idx]->duration * av_q2d(data->format_ctx->streams[data->videostream_idx]->time_base);
+// Identifies a file by its length and the hash of its first bytes, leaves it rewound.
+static void _probe_key(void *opaque, io_read_func read_packet, io_seek_func seek, int64_t *r_len, uint32_t *r_hash) {
+	uint8_t buf[PROBE_KEY_SIZE];
+	*r_len = seek(opaque, 0, AVSEEK_SIZE);
+	seek(opaque, 0, SEEK_SET);
+	int read_bytes = read_packet(opaque, buf, PROBE_KEY_SIZE);
+	*r_hash = _fnv1a(buf, read_bytes > 0 ? read_bytes : 0);
+	seek(opaque, 0, SEEK_SET);
 }
 
-static bool read_frame(videodecoder_data_struct *data) {
-	while (data->video_packet_queue->nb_packets < 24)  {
-		AVPacket pkt;
-		int ret = av_read_frame(data->format_ctx, &pkt);
-		if (ret >= 0) {
-			if (pkt.stream_index == data->videostream_idx) {
-				packet_queue_put(data->video_packet_queue, &pkt);
-			} else if (pkt.stream_index == data->audiostream_idx) {
-				packet_queue_put(data->audio_packet_queue, &pkt);
-			} else {
-				av_packet_unref(&pkt);
-			}
-		} else {
-			return false;
+// Exchange everything that belongs to the opened file, but not the
+// fields that tie a struct to its godot playback object.
+static void _swap_pipeline(videodecoder_data_struct *a, videodecoder_data_struct *b) {
+	videodecoder_data_struct tmp = *a;
+	*a = *b;
+	*b = tmp;
+
+	b->instance = a->instance;
+	a->instance = tmp.instance;
+	b->id = a->id;
+	a->id = tmp.id;
+	b->next_instance = a->next_instance;
+	a->next_instance = tmp.next_instance;
+	b->last_visible_msec = a->last_visible_msec;
+	a->last_visible_msec = tmp.last_visible_msec;
+	b->mem_shrunk = a->mem_shrunk;
+	a->mem_shrunk = tmp.mem_shrunk;
+	b->next_clip = a->next_clip;
+	a->next_clip = tmp.next_clip;
+	b->atlas = a->atlas;
+	a->atlas = tmp.atlas;
+	b->atlas_x = a->atlas_x;
+	a->atlas_x = tmp.atlas_x;
+	b->atlas_y = a->atlas_y;
+	a->atlas_y = tmp.atlas_y;
+	b->atlas_dirty = a->atlas_dirty;
+	a->atlas_dirty = tmp.atlas_dirty;
+	b->atlas_dst = a->atlas_dst;
+	a->atlas_dst = tmp.atlas_dst;
+	b->ahead = a->ahead;
+	a->ahead = tmp.ahead;
+	b->mips = a->mips;
+	a->mips = tmp.mips;
+	b->options = a->options;
+	a->options = tmp.options;
+	b->audio_track = a->audio_track;
+	a->audio_track = tmp.audio_track;
+}
+
+// A file opened with `a` is what opening it with `b` would give. The other options
+// apply to an opened file as well.
+static bool _open_options_match(const videodecoder_data_struct *a, const videodecoder_data_struct *b) {
+	const videodecoder_options *oa = &a->options, *ob = &b->options;
+	return oa->audio_only == ob->audio_only && oa->live == ob->live
+		&& oa->crop_x == ob->crop_x && oa->crop_y == ob->crop_y
+		&& oa->crop_width == ob->crop_width && oa->crop_height == ob->crop_height
+		&& oa->scale_flags == ob->scale_flags && oa->decoder_threads == ob->decoder_threads
+		&& oa->io_buffer_size == ob->io_buffer_size && oa->io_chunk_size == ob->io_chunk_size
+		&& oa->mix_rate == ob->mix_rate && a->audio_track == b->audio_track;
+}
+
+static godot_bool _adopt_prepared(videodecoder_data_struct *data, void *file) {
+	int64_t file_len = -1;
+	uint32_t probe_hash = 0;
+	preload_slot_t *slot = NULL;
+
+	vd_mutex_lock(&preload_mutex);
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		preload_slot_t *s = &preload_slots[i];
+		// one still opening isn't waited for, the main thread opens the file as usual instead.
+		if (s->release_pending || s->playlist || s->state != PRELOAD_READY || !_open_options_match(s->data, data)) {
+			continue;
+		}
+		if (file_len < 0) {
+			vd_mutex_unlock(&preload_mutex);
+			_probe_key(file, videodecoder_api->godot_videodecoder_file_read, videodecoder_api->godot_videodecoder_file_seek, &file_len, &probe_hash);
+			vd_mutex_lock(&preload_mutex);
+		}
+		if (s->file_len == file_len && s->probe_hash == probe_hash) {
+			slot = s;
+			break;
 		}
 	}
-	return true;
+	if (slot == NULL) {
+		vd_mutex_unlock(&preload_mutex);
+		return GODOT_FALSE;
+	}
+	videodecoder_data_struct *prepared = slot->data;
+	gdfile_t *slot_file = slot->file;
+	slot->data = NULL;
+	slot->file = NULL;
+	api->godot_free(slot->path);
+	slot->path = NULL;
+	slot->state = PRELOAD_EMPTY;
+	vd_mutex_unlock(&preload_mutex);
+
+	_swap_pipeline(data, prepared);
+
+	// From now on read through godot's FileAccess like a regular open would. The io source
+	// keeps its chunk, godot's file continues where the prepared one stopped reading.
+	videodecoder_api->godot_videodecoder_file_seek(file, gdfile_get_position(slot_file), SEEK_SET);
+	io_source_retarget(data->io_source, file, videodecoder_api->godot_videodecoder_file_read, videodecoder_api->godot_videodecoder_file_seek);
+	gdfile_close(slot_file);
+
+	_free_data(prepared);
+	return GODOT_TRUE;
 }
 
-void godot_videodecoder_update(void *p_data, godot_real p_delta) {
-	PROFILE_START("update", __LINE__);
+static void _bake_attach(videodecoder_data_struct *data, int64_t file_len, uint32_t probe_hash);
+
+// Includes decoding the first frame, so the profiler shows open-to-first-frame time.
+godot_bool godot_videodecoder_open_file(void *p_data, void *file) {
+	PROFILE_START("open_file", __LINE__);
 	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-	// during an 'update' make sure to use the video frame's pts timestamp
-	// otherwise the godot VideoStreamNative update method
-	// won't even try to request a frame since it expects the plugin
-	// to use video presentation timestamp as the source of time.
 
-	data->position_type = POS_V_PTS;
+	// Close the previous file, its codecs and buffers are reused if they fit.
+	_close_input(data);
+	if (data->next_clip >= 0) {
+		videodecoder_release(data->next_clip);
+		data->next_clip = -1;
+	}
 
-	data->time += p_delta;
-	// afford one frame worth of slop when decoding
-	data->diff_tolerance = p_delta;
+	last_instance_id = data->id;
 
-	if (!isnan(data->audio_time)) {
-		data->audio_time += p_delta;
+	// bake option: the file is told apart the same way as a prepared one.
+	int64_t file_len = -1;
+	uint32_t probe_hash = 0;
+	if (data->options.bake && data->options.loop && !data->options.live) {
+		_probe_key(file, videodecoder_api->godot_videodecoder_file_read, videodecoder_api->godot_videodecoder_file_seek, &file_len, &probe_hash);
 	}
-	read_frame(data);
+
+	// matching a prepared file reads and rewinds the input, a live one can't be.
+	if (!data->options.live && _adopt_prepared(data, file)) {
+		_bake_attach(data, file_len, probe_hash);
+		PROFILE_END;
+		return GODOT_TRUE;
+	}
+	if (!_open_stream(data, file, videodecoder_api->godot_videodecoder_file_read, videodecoder_api->godot_videodecoder_file_seek)) {
+		PROFILE_END;
+		return GODOT_FALSE;
+	}
+	_preroll(data);
+	_bake_attach(data, file_len, probe_hash);
 	PROFILE_END;
+	return GODOT_TRUE;
 }
 
-godot_pool_byte_array *godot_videodecoder_get_videoframe(void *p_data) {
-	PROFILE_START("get_videoframe", __LINE__);
+godot_real godot_videodecoder_get_length(const void *p_data) {
 	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-	AVPacket pkt = {0};
-	int ret;
-	size_t drop_count = 0;
-	// to maintain a decent game frame rate
-	// don't let frame decoding take more than this number of ms
-	uint64_t max_frame_drop_time = 5;
-	// but we do need to drop frames, so try to drop at least some frames even if it's a bit slow :(
-	size_t min_frame_drop_count = 5;
-	uint64_t start = get_ticks_msec();
 
-retry:
-	ret = avcodec_receive_frame(data->vcodec_ctx, data->frame_yuv);
-	if (ret == AVERROR(EAGAIN)) {
-		// need to call avcodedc_send_packet, get a packet from queue to send it
-		while (!packet_queue_get(data->video_packet_queue, &pkt)) {
-			//api->godot_print_warning("video packet queue empty", "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
-			if (!read_frame(data)) {
-				PROFILE_END;
-				return NULL;
+	if (data->format_ctx == NULL) {
+		api->godot_print_warning("Format context is null.", "godot_videodecoder_get_length()", __FILE__, __LINE__);
+		return -1;
+	}
+
+	if (data->options.live) {
+		return 0;
+	}
+
+	int stream_idx = data->videostream_idx >= 0 ? data->videostream_idx : data->audiostream_idx;
+	AVStream *stream = data->format_ctx->streams[stream_idx];
+	if (stream->duration == AV_NOPTS_VALUE) {
+		return _avtime_to_sec(data->format_ctx->duration);
+	}
+	return stream->duration * av_q2d(stream->time_base);
+}
+
+// A queue has enough packets when it holds queue_duration seconds (or min_queue_packets
+// when the packets have no duration) or reached its own byte limit.
+static bool _queue_has_enough(videodecoder_data_struct *data, PacketQueue *q, int stream_idx, int64_t max_bytes) {
+	if (stream_idx < 0 || q->size >= max_bytes) {
+		return true;
+	}
+	if (data->mem_shrunk) {
+		// only what the decoder needs next, _read_frame_for() fetches the rest on demand.
+		return q->nb_packets > 0;
+	}
+	if (q->nb_packets < data->options.min_queue_packets) {
+		return false;
+	}
+	AVStream *stream = data->format_ctx->streams[stream_idx];
+	return q->duration == 0 || q->duration * av_q2d(stream->time_base) >= data->options.queue_duration;
+}
+
+static bool _queues_full(videodecoder_data_struct *data) {
+	if (data->video_packet_queue->size + data->audio_packet_queue->size >= data->options.max_queue_bytes) {
+		return true;
+	}
+	return _queue_has_enough(data, data->video_packet_queue, data->bake_serving ? -1 : data->videostream_idx, data->options.video_queue_bytes)
+		&& _queue_has_enough(data, data->audio_packet_queue, _audio_muted(data) ? -1 : data->audiostream_idx, data->options.audio_queue_bytes);
+}
+
+// Drops packets from q until the instance is back under max_queue_bytes, used while the
+// other stream needs a packet that is muxed far behind. Video loses the packets nothing
+// references first, then whole GOPs from the oldest, so the decoder resumes at a keyframe.
+// Audio loses its oldest packets and resyncs like after a seek.
+static void _queue_trim(videodecoder_data_struct *data, PacketQueue *q) {
+	PacketQueue *other = q == data->video_packet_queue ? data->audio_packet_queue : data->video_packet_queue;
+	int max_size = (int)FFMAX(data->options.max_queue_bytes - other->size, 0);
+	if (q->size <= max_size) {
+		return;
+	}
+	int dropped = 0;
+	if (q == data->video_packet_queue) {
+		dropped = packet_queue_drop_flagged(q, AV_PKT_FLAG_DISPOSABLE, max_size);
+		while (q->size > max_size) {
+			int gop = packet_queue_drop_to_key(q);
+			if (gop == 0) {
+				break;
 			}
+			dropped += gop;
 		}
-		ret = avcodec_send_packet(data->vcodec_ctx, &pkt);
-		if (ret < 0) {
-			char err[512];
-			char msg[768];
-			av_strerror(ret, err, sizeof(err) - 1);
-			snprintf(msg, sizeof(msg) - 1, "avcodec_send_packet returns %d (%s)", ret, err);
-			api->godot_print_error(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+	} else {
+		AVPacket pkt;
+		while (q->size > max_size && packet_queue_get(q, &pkt)) {
 			av_packet_unref(&pkt);
-			PROFILE_END;
-			return NULL;
+			dropped++;
 		}
-		av_packet_unref(&pkt);
-		goto retry;
-	} else if (ret < 0) {
-		char msg[512] = {0};
-		snprintf(msg, sizeof(msg) - 1, "avcodec_receive_frame returns %d", ret);
-		api->godot_print_error(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
-		PROFILE_END;
-		return NULL;
+		data->audio_time = NAN;
+	}
+	if (dropped > 0 && data->trimmed_packets == 0) {
+		// once per file, get_stats() counts the rest
+		api->godot_print_warning("packet queues over max_queue_bytes, dropping packets", "read_frame()", __FILE__, __LINE__);
 	}
+	data->trimmed_packets += dropped;
+}
 
-	bool pts_correct = data->frame_yuv->pts == AV_NOPTS_VALUE;
-	int64_t pts = pts_correct ? data->frame_yuv->pkt_dts : data->frame_yuv->pts;
+// loop option: continue from the start of the file without flushing anything,
+// the decoders see one stream with increasing timestamps.
+static bool _loop_wrap(videodecoder_data_struct *data) {
+	if (!data->options.loop || data->loop_end <= 0) {
+		return false;
+	}
+	int64_t start_time = data->format_ctx->start_time != AV_NOPTS_VALUE ? data->format_ctx->start_time : 0;
+	if (avformat_seek_file(data->format_ctx, -1, INT64_MIN, start_time, start_time, 0) < 0) {
+		api->godot_print_warning("Unable to loop, can't seek to the start.", "read_frame()", __FILE__, __LINE__);
+		return false;
+	}
+	data->loop_offset += data->loop_end - start_time;
+	data->loop_end = 0;
+	return true;
+}
 
-	double ts = pts * av_q2d(data->format_ctx->streams[data->videostream_idx]->time_base);
+static void _loop_shift(videodecoder_data_struct *data, AVPacket *pkt) {
+	AVRational time_base = data->format_ctx->streams[pkt->stream_index]->time_base;
+	int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	if (ts != AV_NOPTS_VALUE) {
+		int64_t end = av_rescale_q(ts + pkt->duration, time_base, AV_TIME_BASE_Q);
+		if (end > data->loop_end) {
+			data->loop_end = end;
+		}
+	}
+	if (data->loop_offset == 0) {
+		return;
+	}
+	int64_t offset = av_rescale_q(data->loop_offset, AV_TIME_BASE_Q, time_base);
+	if (pkt->pts != AV_NOPTS_VALUE) {
+		pkt->pts += offset;
+	}
+	if (pkt->dts != AV_NOPTS_VALUE) {
+		pkt->dts += offset;
+	}
+}
 
-	data->total_frame++;
+// live: anchors the clock to the first packet and tracks the newest one.
+static void _live_packet(videodecoder_data_struct *data, AVPacket *pkt) {
+	int clock_idx = data->videostream_idx >= 0 ? data->videostream_idx : data->audiostream_idx;
+	if (pkt->stream_index != clock_idx || pkt->pts == AV_NOPTS_VALUE) {
+		return;
+	}
+	double pts = pkt->pts * av_q2d(data->format_ctx->streams[clock_idx]->time_base);
+	if (isnan(data->live_newest)) {
+		// live streams start at any timestamp, the first one is shown right away.
+		data->clip_offset = data->time - pts;
+	}
+	if (isnan(data->live_newest) || pts > data->live_newest) {
+		data->live_newest = pts;
+	}
+}
 
-	// frame successfully decoded here, now if it lags behind too much (diff_tolerance sec)
-	// let's discard this frame and get the next frame instead
-	bool drop = ts < data->time - data->diff_tolerance;
-	uint64_t drop_duration = get_ticks_msec() - start;
-	if (drop && drop_duration > max_frame_drop_time && drop_count < min_frame_drop_count && data->frame_unwrapped) {
-		// only discard frames for max_frame_drop_time ms or we'll slow down the game's main thread!
-		if (fabs(data->seek_time - data->time) > data->diff_tolerance * 10) {
-			char msg[512];
-			snprintf(msg, sizeof(msg) -1, "Slow CPU? Dropped  %d frames for %"PRId64"ms frame dropped: %lu/%lu (%.1f%%) pts=%.1f t=%.1f",
-				(int)drop_count,
-				drop_duration,
-				data->drop_frame,
-				data->total_frame,
-				100.0 * data->drop_frame / data->total_frame,
-				ts, (double)data->time);
-			api->godot_print_warning(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+static int _read_packet(videodecoder_data_struct *data) {
+	AVPacket pkt;
+	int ret = av_read_frame(data->format_ctx, &pkt);
+	if (ret == AVERROR_EOF && data->options.live) {
+		// nothing more yet, try again on the next update.
+		data->io_ctx->eof_reached = 0;
+		return ret;
+	}
+	if (ret < 0 && _loop_wrap(data)) {
+		ret = av_read_frame(data->format_ctx, &pkt);
+	}
+	if (ret < 0) {
+		data->demux_eof = true;
+		return ret;
+	}
+	if (pkt.stream_index == data->videostream_idx || pkt.stream_index == data->audiostream_idx) {
+		_loop_shift(data, &pkt);
+		if (data->options.live) {
+			_live_packet(data, &pkt);
+		}
+	}
+	if (pkt.stream_index == data->videostream_idx) {
+		packet_queue_put(data->video_packet_queue, &pkt);
+	} else if (pkt.stream_index == data->audiostream_idx) {
+		packet_queue_put(data->audio_packet_queue, &pkt);
+	} else {
+		av_packet_unref(&pkt);
+	}
+	return ret;
+}
+
+// Seconds of packets queued for the stream, HUGE_VAL if it isn't decoded.
+static double _queue_seconds(videodecoder_data_struct *data, PacketQueue *q, int stream_idx) {
+	if (stream_idx < 0) {
+		return HUGE_VAL;
+	}
+	if (q->duration == 0) {
+		return q->nb_packets > 0 ? data->options.queue_duration : 0;
+	}
+	return q->duration * av_q2d(data->format_ctx->streams[stream_idx]->time_base);
+}
+
+// Tells the io scheduler how badly the instance needs its next chunk.
+static void _io_priority(videodecoder_data_struct *data) {
+	if (data->io_source == NULL) {
+		return;
+	}
+	data->io_source->foreground = get_ticks_msec() - data->last_visible_msec < IO_FOREGROUND_MSEC;
+	data->io_source->queued = FFMIN(_queue_seconds(data, data->video_packet_queue, data->bake_serving ? -1 : data->videostream_idx),
+			_queue_seconds(data, data->audio_packet_queue, _audio_muted(data) ? -1 : data->audiostream_idx));
+	if (!data->io_source->foreground || data->io_source->queued >= IO_URGENT_SECONDS) {
+		// caught up, the others don't need to wait for it anymore
+		data->io_source->short_usec = 0;
+	}
+}
+
+// Demuxes until the queues are full, or the io bandwidth cap says to wait.
+// Returns false at the end of the file.
+static bool read_frame(videodecoder_data_struct *data) {
+	_io_priority(data);
+	while (!_queues_full(data)) {
+		bool urgent = data->io_source == NULL || data->io_source->queued < IO_URGENT_SECONDS;
+		if (!io_sched_may_read(data->io_source, urgent, get_ticks_usec())) {
+			return true;
+		}
+		if (_read_packet(data) < 0) {
+			return false;
+		}
+		_io_priority(data);
+	}
+	return true;
+}
+
+// Demuxes until q has a packet, regardless of how full the queues are.
+// The other queue is trimmed so the instance stays within max_queue_bytes.
+static bool _read_frame_for(videodecoder_data_struct *data, PacketQueue *q) {
+	PacketQueue *other = q == data->video_packet_queue ? data->audio_packet_queue : data->video_packet_queue;
+	while (q->nb_packets == 0) {
+		if (_read_packet(data) < 0) {
+			return false;
+		}
+		_queue_trim(data, other);
+	}
+	read_frame(data);
+	return true;
+}
+
+// Everything that was demuxed has been handed to godot.
+static bool _audio_finished(videodecoder_data_struct *data) {
+	return data->demux_eof && data->audio_packet_queue->nb_packets == 0 && data->num_decoded_samples <= 0;
+}
+
+static void _enforce_memory_budget();
+
+// live: frames are shown by their distance to the newest packet, not by the time since start.
+// If the input got ahead by more than live_latency the clock jumps forward and the frames in
+// between are dropped, if it fell behind (nothing received) the clock waits for it.
+static void _live_sync(videodecoder_data_struct *data) {
+	if (isnan(data->live_newest)) {
+		return;
+	}
+	double lag = data->live_newest + data->clip_offset - data->time;
+	if (lag > data->options.live_latency || lag < 0) {
+		data->clip_offset -= lag;
+		data->frame_time -= lag;
+	}
+}
+static bool _clip_finished(videodecoder_data_struct *data);
+static void _switch_clip(videodecoder_data_struct *data);
+static bool _poster_running(const videodecoder_data_struct *data);
+static bool _shares_pipeline(const videodecoder_data_struct *data);
+
+// Picks the decoding strategy for the speed option: everything, no non-reference frames
+// or keyframes only, so the decoding cost stays about the same as the speed goes up.
+static void _apply_speed(videodecoder_data_struct *data) {
+	double speed = _speed(data);
+	if (speed == data->speed) {
+		return;
+	}
+	bool was_muted = _audio_muted(data);
+	if (data->speed > KEYFRAME_SPEED && speed <= KEYFRAME_SPEED) {
+		// the decoder's references are stale keyframes: restart clean at the next one
+		data->wait_keyframe = true;
+		if (data->vcodec_ctx != NULL) {
+			avcodec_flush_buffers(data->vcodec_ctx);
+		}
+	}
+	data->speed = speed;
+	if (data->vcodec_ctx != NULL) {
+		data->vcodec_ctx->skip_frame = _skip_frame(speed);
+	}
+	if (data->acodec_ctx == NULL) {
+		return;
+	}
+	// staged samples are at the previous rate
+	data->num_decoded_samples = 0;
+	data->audio_buffer_pos = 0;
+	data->audio_time = NAN;
+	if (_audio_muted(data)) {
+		packet_queue_flush(data->audio_packet_queue);
+	} else {
+		_init_audio_output(data);
+	}
+	if (_audio_muted(data) != was_muted) {
+		_update_discard(data);
+	}
+}
+
+void godot_videodecoder_update(void *p_data, godot_real p_delta) {
+	PROFILE_START("update", __LINE__);
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	// during an 'update' make sure to use the video frame's pts timestamp
+	// otherwise the godot VideoStreamNative update method
+	// won't even try to request a frame since it expects the plugin
+	// to use video presentation timestamp as the source of time.
+
+	data->position_type = POS_V_PTS;
+
+	double speed = data->speed > 0 ? data->speed : 1.0;
+	data->clock += p_delta;
+	data->time += p_delta * speed;
+	// afford one frame worth of slop when decoding
+	data->diff_tolerance = p_delta * speed;
+
+	if (data->suspended) {
+		// keep up with godot's clock, resume() picks up from there.
+		PROFILE_END;
+		return;
+	}
+
+	if (_poster_running(data)) {
+		// the poster job is demuxing and decoding, playback picks up once it's done.
+		_enforce_memory_budget();
+		PROFILE_END;
+		return;
+	}
+
+	if (data->next_clip >= 0 && _clip_finished(data)) {
+		_switch_clip(data);
+	}
+
+	bool shared = _shares_pipeline(data);
+	if (shared) {
+		vd_mutex_lock(&data->ahead->pipeline_mutex);
+	}
+	_apply_speed(data);
+	if (!isnan(data->audio_time)) {
+		data->audio_time += p_delta * data->speed;
+	}
+	read_frame(data);
+	if (shared) {
+		vd_mutex_unlock(&data->ahead->pipeline_mutex);
+	}
+	if (data->options.live) {
+		_live_sync(data);
+	}
+	_enforce_memory_budget();
+	PROFILE_END;
+}
+
+// Pops the next video packet for the decoder. Above KEYFRAME_SPEED, and after it until the next
+// keyframe, the others are dropped right here.
+static bool _next_video_packet(videodecoder_data_struct *data, AVPacket *pkt) {
+	while (packet_queue_get(data->video_packet_queue, pkt)) {
+		if (pkt->flags & AV_PKT_FLAG_KEY) {
+			data->wait_keyframe = false;
+			return true;
+		}
+		if (data->speed <= KEYFRAME_SPEED && !data->wait_keyframe) {
+			return true;
+		}
+		av_packet_unref(pkt);
+	}
+	return false;
+}
+
+// Decodes the next video frame into data->frame_yuv, demuxing as needed.
+// Returns false at the end of the stream or on error.
+static bool _decode_video_frame(videodecoder_data_struct *data) {
+	AVPacket pkt = {0};
+	int ret;
+retry:
+	ret = avcodec_receive_frame(data->vcodec_ctx, data->frame_yuv);
+	if (ret == AVERROR(EAGAIN)) {
+		// need to call avcodedc_send_packet, get a packet from queue to send it
+		while (!_next_video_packet(data, &pkt)) {
+			//api->godot_print_warning("video packet queue empty", "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+			if (!_read_frame_for(data, data->video_packet_queue)) {
+				return false;
+			}
+		}
+		ret = avcodec_send_packet(data->vcodec_ctx, &pkt);
+		if (ret < 0) {
+			char err[512];
+			char msg[768];
+			av_strerror(ret, err, sizeof(err) - 1);
+			snprintf(msg, sizeof(msg) - 1, "avcodec_send_packet returns %d (%s)", ret, err);
+			api->godot_print_error(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+			av_packet_unref(&pkt);
+			return false;
 		}
-	} else if (drop) {
-		drop_count++;
-		data->drop_frame++;
 		av_packet_unref(&pkt);
 		goto retry;
+	} else if (ret < 0) {
+		char msg[512] = {0};
+		snprintf(msg, sizeof(msg) - 1, "avcodec_receive_frame returns %d", ret);
+		api->godot_print_error(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+		return false;
 	}
-	if (!drop || fabs(data->seek_time - data->time) > data->diff_tolerance * 2) {
-		// Don't overwrite the current frame when dropping frames for performance reasons
-		// except when the time is within 2 frames of the most recent seek
-		// because we don't want a glitchy 'fast forward' effect when seeking.
-		// NOTE: VideoPlayer currently doesnt' ask for a frame when seeking while paused so you'd
-		// have to fake it inside godot by unpausing briefly. (see FIG1 below)
-		data->frame_unwrapped = true;
-		sws_scale(data->sws_ctx, (uint8_t const *const *)data->frame_yuv->data, data->frame_yuv->linesize, 0,
-				data->vcodec_ctx->height, data->frame_rgb->data, data->frame_rgb->linesize);
-		_unwrap_video_frame(&data->unwrapped_frame, data->frame_rgb, data->vcodec_ctx->width, data->vcodec_ctx->height);
+	return true;
+}
+
+static double _video_frame_time(videodecoder_data_struct *data) {
+	bool pts_correct = data->frame_yuv->pts == AV_NOPTS_VALUE;
+	int64_t pts = pts_correct ? data->frame_yuv->pkt_dts : data->frame_yuv->pts;
+
+	return pts * av_q2d(data->format_ctx->streams[data->videostream_idx]->time_base) + data->clip_offset;
+}
+
+static double _video_frame_duration(videodecoder_data_struct *data) {
+	AVStream *stream = data->format_ctx->streams[data->videostream_idx];
+	if (data->frame_yuv->pkt_duration > 0) {
+		return data->frame_yuv->pkt_duration * av_q2d(stream->time_base);
+	}
+	AVRational frame_rate = av_guess_frame_rate(data->format_ctx, stream, data->frame_yuv);
+	return frame_rate.num > 0 ? frame_rate.den / (double)frame_rate.num : 0;
+}
+
+// Converts the crop region of frame_yuv: the scaler starts at offset plane pointers,
+// so the rows and columns outside of it are never read.
+static void _scale_video_frame(videodecoder_data_struct *data, uint8_t *const dst[], const int dst_linesize[]) {
+	AVFrame *frame = data->frame_yuv;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int max_step[4];
+	av_image_fill_max_pixsteps(max_step, NULL, desc);
+	// the position may have changed since the size was fixed, keep the region inside the frame.
+	int x = (int)FFMIN(FFMAX(data->options.crop_x, 0), FFMAX(frame->width - data->crop_width, 0));
+	int y = (int)FFMIN(FFMAX(data->options.crop_y, 0), FFMAX(frame->height - data->crop_height, 0));
+	// on a chroma sample
+	x &= ~((1 << desc->log2_chroma_w) - 1);
+	y &= ~((1 << desc->log2_chroma_h) - 1);
+
+	const uint8_t *src[4] = { NULL, NULL, NULL, NULL };
+	for (int i = 0; i < 4 && frame->data[i] != NULL; i++) {
+		if ((desc->flags & AV_PIX_FMT_FLAG_PAL) && i == 1) {
+			src[i] = frame->data[i];
+			break;
+		}
+		int shift_x = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+		int shift_y = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+		src[i] = frame->data[i] + (y >> shift_y) * frame->linesize[i] + (x >> shift_x) * max_step[i];
+	}
+	sws_scale(data->sws_ctx, src, frame->linesize, 0, data->crop_height, dst, dst_linesize);
+}
+
+static void _atlas_draw(videodecoder_data_struct *data);
+static void _bake_record(videodecoder_data_struct *data);
+
+static void _convert_video_frame(videodecoder_data_struct *data) {
+	data->frame_unwrapped = true;
+	data->frame_changed = true;
+	data->frame_time = _video_frame_time(data);
+	data->frame_duration = _video_frame_duration(data);
+	if (data->atlas_dst != NULL) {
+		_atlas_draw(data);
+		return;
+	}
+	_scale_video_frame(data, data->frame_rgb->data, data->frame_rgb->linesize);
+	_unwrap_video_frame(&data->unwrapped_frame, data->frame_rgb, data->out_width, data->out_height);
+	if (data->bake_recording) {
+		_bake_record(data);
+	}
+}
+
+// Decode and convert the first frame at or after `target` so the next
+// get_videoframe() can return it without any codec or conversion work.
+static bool _decode_poster(videodecoder_data_struct *data, double target) {
+	data->poster_pending = false;
+	while (_decode_video_frame(data)) {
+		if (_video_frame_time(data) >= target - data->diff_tolerance) {
+			_convert_video_frame(data);
+			data->poster_pending = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Fill the packet queues and prepare the first frame so playback
+// can start without touching the demuxer or the codec.
+static void _preroll(videodecoder_data_struct *data) {
+	read_frame(data);
+	if (data->videostream_idx >= 0) {
+		_decode_poster(data, 0);
+	}
+}
+
+/* ---------------------- Offline ------------------------- */
+
+// For movie capture and baking: get_videoframe() returns every frame once, in order,
+// while jobs on the decoders pool keep decode_ahead converted frames ready.
+static worker_t *decoders = NULL;
+#define MAX_DECODER_THREADS 8
+#define MAX_DECODE_AHEAD 64
+
+// Regular file playback only, live inputs and atlas members keep their own pacing.
+static bool _is_offline(videodecoder_data_struct *data) {
+	return data->options.offline && !data->options.live && data->atlas == NULL && data->videostream_idx >= 0;
+}
+
+// Call with ahead->mutex held and no job running.
+static void _ahead_resize(ahead_queue_t *ahead, int size) {
+	for (int i = 0; i < ahead->size; i++) {
+		api->godot_pool_byte_array_destroy(&ahead->frames[i].pixels);
+	}
+	if (ahead->frames != NULL) {
+		api->godot_free(ahead->frames);
+	}
+	ahead->frames = size > 0 ? (ahead_frame_t *)api->godot_alloc(sizeof(ahead_frame_t) * size) : NULL;
+	ahead->size = ahead->frames != NULL ? size : 0;
+	for (int i = 0; i < ahead->size; i++) {
+		api->godot_pool_byte_array_new(&ahead->frames[i].pixels);
+	}
+	ahead->head = ahead->count = 0;
+}
+
+static ahead_queue_t *_ahead_create() {
+	ahead_queue_t *ahead = (ahead_queue_t *)api->godot_alloc(sizeof(ahead_queue_t));
+	memset(ahead, 0, sizeof(ahead_queue_t));
+	vd_mutex_init(&ahead->mutex);
+	vd_cond_init(&ahead->cond);
+	vd_mutex_init(&ahead->pipeline_mutex);
+	api->godot_pool_byte_array_new(&ahead->poster);
+	return ahead;
+}
+
+// Once no job is running, see _ahead_stop().
+static void _ahead_free(ahead_queue_t *ahead) {
+	_ahead_resize(ahead, 0);
+	api->godot_pool_byte_array_destroy(&ahead->poster);
+	vd_mutex_destroy(&ahead->pipeline_mutex);
+	vd_cond_destroy(&ahead->cond);
+	vd_mutex_destroy(&ahead->mutex);
+	api->godot_free(ahead);
+}
+
+// Decodes into the free slots of the ring until it is full, the stream ends or _ahead_stop() is called.
+static void _ahead_job(void *arg) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)arg;
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	while (!ahead->abort && !ahead->eof && ahead->count < ahead->size) {
+		// get_videoframe() only touches the filled slots
+		ahead_frame_t *frame = &ahead->frames[(ahead->head + ahead->count) % ahead->size];
+		vd_mutex_unlock(&ahead->mutex);
+
+		vd_mutex_lock(&ahead->pipeline_mutex);
+		bool decoded = _decode_video_frame(data);
+		if (decoded) {
+			frame->time = _video_frame_time(data);
+			frame->duration = _video_frame_duration(data);
+			_scale_video_frame(data, data->frame_rgb->data, data->frame_rgb->linesize);
+			_unwrap_video_frame(&frame->pixels, data->frame_rgb, data->out_width, data->out_height);
+		}
+		vd_mutex_unlock(&ahead->pipeline_mutex);
+
+		vd_mutex_lock(&ahead->mutex);
+		if (decoded) {
+			ahead->count++;
+		} else {
+			ahead->eof = true;
+		}
+		vd_cond_broadcast(&ahead->cond);
+	}
+	ahead->running = false;
+	vd_cond_broadcast(&ahead->cond);
+	vd_mutex_unlock(&ahead->mutex);
+}
+
+// Call with ahead->mutex held. True if a job has to be pushed, with _ahead_push() once the mutex is released.
+static bool _ahead_claim(ahead_queue_t *ahead) {
+	if (ahead->running || ahead->eof || ahead->count >= ahead->size) {
+		return false;
+	}
+	ahead->running = true;
+	return true;
+}
+
+// Created on first use, from the main thread.
+static worker_t *_decoders() {
+	if (decoders == NULL) {
+		int threads = av_cpu_count();
+		decoders = worker_create(threads < MAX_DECODER_THREADS ? threads : MAX_DECODER_THREADS);
+	}
+	return decoders;
+}
+
+static void _ahead_push(videodecoder_data_struct *data) {
+	if (_decoders() == NULL || worker_push(decoders, _ahead_job, data) != 0) {
+		_ahead_job(data);
+	}
+}
+
+// Waits for the jobs and drops the decoded frames, before anything else touches the pipeline.
+static void _ahead_stop(videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	ahead->abort = true;
+	while (ahead->running || ahead->poster_running || ahead->atlas_running) {
+		vd_cond_wait(&ahead->cond, &ahead->mutex);
+	}
+	ahead->abort = false;
+	ahead->eof = false;
+	ahead->head = ahead->count = 0;
+	ahead->poster_done = false;
+	vd_mutex_unlock(&ahead->mutex);
+}
+
+// A job on another thread may decode: the decode ahead, poster or atlas job. update()
+// and get_audio() take pipeline_mutex.
+static bool _shares_pipeline(const videodecoder_data_struct *data) {
+	return data->options.offline || data->atlas != NULL;
+}
+
+// Decodes up to poster_target like _decode_poster(), off the main thread. Until it's done
+// the demuxer, the codecs and the conversion belong to the job, see _poster_running().
+static void _poster_job(void *arg) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)arg;
+	ahead_queue_t *ahead = data->ahead;
+	bool found = false;
+	vd_mutex_lock(&ahead->mutex);
+	while (!ahead->abort) {
+		vd_mutex_unlock(&ahead->mutex);
+		bool decoded = _decode_video_frame(data);
+		found = decoded && _video_frame_time(data) >= ahead->poster_target;
+		if (found) {
+			ahead->poster_time = _video_frame_time(data);
+			ahead->poster_duration = _video_frame_duration(data);
+			_scale_video_frame(data, data->frame_rgb->data, data->frame_rgb->linesize);
+			_unwrap_video_frame(&ahead->poster, data->frame_rgb, data->out_width, data->out_height);
+		}
+		vd_mutex_lock(&ahead->mutex);
+		if (found || !decoded) {
+			break;
+		}
+	}
+	ahead->poster_done = found && !ahead->abort;
+	ahead->poster_running = false;
+	vd_cond_broadcast(&ahead->cond);
+	vd_mutex_unlock(&ahead->mutex);
+}
+
+// After a seek: the frame at `target` is decoded on the decoders pool, the game loop
+// doesn't wait for the GOP in front of it.
+static void _poster_start(videodecoder_data_struct *data, double target) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	ahead->poster_target = target - data->diff_tolerance;
+	ahead->poster_running = true;
+	ahead->poster_done = false;
+	vd_mutex_unlock(&ahead->mutex);
+	if (_decoders() == NULL || worker_push(decoders, _poster_job, data) != 0) {
+		_poster_job(data);
+	}
+}
+
+static bool _poster_running(const videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	bool running = ahead->poster_running;
+	vd_mutex_unlock(&ahead->mutex);
+	return running;
+}
+
+// True while the poster job owns the pipeline. Once it's done its frame becomes the
+// pending poster, like one decoded by _decode_poster().
+static bool _poster_busy(videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	bool running = ahead->poster_running;
+	bool done = ahead->poster_done;
+	ahead->poster_done = false;
+	if (done) {
+		godot_pool_byte_array pixels = data->unwrapped_frame;
+		data->unwrapped_frame = ahead->poster;
+		ahead->poster = pixels;
+		data->frame_time = ahead->poster_time;
+		data->frame_duration = ahead->poster_duration;
+	}
+	vd_mutex_unlock(&ahead->mutex);
+	if (!done) {
+		return running;
+	}
+	// the frame from before the seek isn't kept
+	api->godot_pool_byte_array_destroy(&ahead->poster);
+	api->godot_pool_byte_array_new(&ahead->poster);
+	data->frame_unwrapped = true;
+	data->frame_changed = true;
+	data->poster_pending = true;
+	if (data->atlas_dst != NULL) {
+		_atlas_draw(data);
+	}
+	if (data->bake_recording) {
+		_bake_record(data);
+	}
+	return false;
+}
+
+// Offline instances take every frame in order, they wait for the poster.
+static void _poster_wait(videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	while (ahead->poster_running) {
+		vd_cond_wait(&ahead->cond, &ahead->mutex);
+	}
+	vd_mutex_unlock(&ahead->mutex);
+	_poster_busy(data);
+}
+
+// The next frame in decode order, waits for the decoders pool when it isn't ready.
+// NULL at the end of the stream.
+static godot_pool_byte_array *_ahead_next(videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	_poster_wait(data);
+	bool poster = data->poster_pending;
+	data->poster_pending = false;
+
+	vd_mutex_lock(&ahead->mutex);
+	int size = data->options.decode_ahead < 1 || data->mem_shrunk ? 1 : (data->options.decode_ahead > MAX_DECODE_AHEAD ? MAX_DECODE_AHEAD : (int)data->options.decode_ahead);
+	if (size != ahead->size && !ahead->running && ahead->count == 0) {
+		_ahead_resize(ahead, size);
+		if (ahead->size == 0) {
+			api->godot_print_error("Unable to allocate the frames to decode ahead.", "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+			ahead->eof = true;
+		}
+	}
+	if (poster) {
+		// decoded during open or seek, it comes before everything in the ring.
+		bool push = _ahead_claim(ahead);
+		vd_mutex_unlock(&ahead->mutex);
+		if (push) {
+			_ahead_push(data);
+		}
+		data->frame_changed = true;
+		data->total_frame++;
+		return &data->unwrapped_frame;
+	}
+	while (ahead->count == 0 && !ahead->eof) {
+		if (_ahead_claim(ahead)) {
+			vd_mutex_unlock(&ahead->mutex);
+			_ahead_push(data);
+			vd_mutex_lock(&ahead->mutex);
+			continue;
+		}
+		vd_cond_wait(&ahead->cond, &ahead->mutex);
+	}
+	if (ahead->count == 0) {
+		vd_mutex_unlock(&ahead->mutex);
+		if (data->next_clip >= 0 && data->frame_unwrapped) {
+			// keep showing the last frame until update() switches to the next clip.
+			data->clip_ended = true;
+			data->frame_changed = false;
+			return &data->unwrapped_frame;
+		}
+		return NULL;
+	}
+	// hand out the slot's buffer, the job refills it with the one godot had.
+	ahead_frame_t *frame = &ahead->frames[ahead->head];
+	godot_pool_byte_array pixels = data->unwrapped_frame;
+	data->unwrapped_frame = frame->pixels;
+	frame->pixels = pixels;
+	data->frame_time = frame->time;
+	data->frame_duration = frame->duration;
+	ahead->head = (ahead->head + 1) % ahead->size;
+	ahead->count--;
+	bool push = _ahead_claim(ahead);
+	vd_mutex_unlock(&ahead->mutex);
+	if (push) {
+		_ahead_push(data);
+	}
+	data->frame_unwrapped = true;
+	data->frame_changed = true;
+	data->total_frame++;
+	return &data->unwrapped_frame;
+}
+
+static int64_t _ahead_memory(videodecoder_data_struct *data) {
+	return (int64_t)data->ahead->size * data->out_width * data->out_height * 4;
+}
+
+static void _ahead_shutdown() {
+	if (decoders != NULL) {
+		worker_destroy(decoders);
+		decoders = NULL;
+	}
+}
+
+static mip_chain_t *_mip_create() {
+	mip_chain_t *mips = (mip_chain_t *)api->godot_alloc(sizeof(mip_chain_t));
+	memset(mips, 0, sizeof(mip_chain_t));
+	vd_mutex_init(&mips->mutex);
+	vd_cond_init(&mips->cond);
+	api->godot_pool_byte_array_new(&mips->source);
+	api->godot_pool_byte_array_new(&mips->pixels);
+	mips->submitted_time = NAN;
+	return mips;
+}
+
+static void _mip_free(mip_chain_t *mips) {
+	vd_mutex_lock(&mips->mutex);
+	mips->source_pending = false;
+	while (mips->running) {
+		vd_cond_wait(&mips->cond, &mips->mutex);
+	}
+	vd_mutex_unlock(&mips->mutex);
+	api->godot_pool_byte_array_destroy(&mips->pixels);
+	api->godot_pool_byte_array_destroy(&mips->source);
+	vd_cond_destroy(&mips->cond);
+	vd_mutex_destroy(&mips->mutex);
+	api->godot_free(mips);
+}
+
+// Bytes of a width x height RGBA8 image and all its mipmaps, down to 1x1 like godot's Image.
+static int _mip_chain_size(int width, int height) {
+	int size = width * height * 4;
+	while (width > 1 || height > 1) {
+		width = FFMAX(width / 2, 1);
+		height = FFMAX(height / 2, 1);
+		size += width * height * 4;
+	}
+	return size;
+}
+
+// Averages the 2x2 blocks of two source rows into `count` output pixels, 4 at a time with
+// SSE2 or NEON. Returns how many it did, the scalar loop of _mip_downsample() does the rest.
+static int _mip_row_simd(const uint8_t *row0, const uint8_t *row1, uint8_t *out, int count) {
+	int x = 0;
+#if defined(VD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(2);
+	for (; x + 4 <= count; x += 4) {
+		__m128i sum[2];
+		for (int half = 0; half < 2; half++) {
+			// two source pixels side by side per 8 bytes: widen, add both rows, then each pair
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + x * 8 + half * 16));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + x * 8 + half * 16));
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+			hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+			sum[half] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), round), 2);
+		}
+		_mm_storeu_si128((__m128i *)(out + x * 4), _mm_packus_epi16(sum[0], sum[1]));
+	}
+#elif defined(VD_NEON)
+	for (; x + 4 <= count; x += 4) {
+		// even and odd source pixels apart, as 32-bit lanes
+		uint32x4x2_t a = vld2q_u32((const uint32_t *)(row0 + x * 8));
+		uint32x4x2_t b = vld2q_u32((const uint32_t *)(row1 + x * 8));
+		uint8x16_t a0 = vreinterpretq_u8_u32(a.val[0]), a1 = vreinterpretq_u8_u32(a.val[1]);
+		uint8x16_t b0 = vreinterpretq_u8_u32(b.val[0]), b1 = vreinterpretq_u8_u32(b.val[1]);
+		uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a0), vget_low_u8(a1)), vaddl_u8(vget_low_u8(b0), vget_low_u8(b1)));
+		uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a0), vget_high_u8(a1)), vaddl_u8(vget_high_u8(b0), vget_high_u8(b1)));
+		// rounding shift: (sum + 2) >> 2 like the scalar loop
+		vst1q_u8(out + x * 4, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+	}
+#endif
+	return x;
+}
+
+// One level down with a 2x2 box filter, the last row and column of odd sizes are repeated.
+static void _mip_downsample(const uint8_t *src, int src_width, int src_height, uint8_t *dst, int width, int height) {
+	// pixels whose right neighbour exists, the clamped last column of odd widths stays scalar
+	int paired = FFMIN(width, src_width / 2);
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row0 = src + (size_t)FFMIN(y * 2, src_height - 1) * src_width * 4;
+		const uint8_t *row1 = src + (size_t)FFMIN(y * 2 + 1, src_height - 1) * src_width * 4;
+		uint8_t *out = dst + (size_t)y * width * 4;
+		for (int x = _mip_row_simd(row0, row1, out, paired); x < width; x++) {
+			int x0 = x * 2 * 4;
+			int x1 = FFMIN(x * 2 + 1, src_width - 1) * 4;
+			for (int c = 0; c < 4; c++) {
+				out[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+			}
+		}
+	}
+}
+
+static void _mip_build(godot_pool_byte_array *chain, godot_pool_byte_array *source, int width, int height) {
+	if (api->godot_pool_byte_array_size(source) != width * height * 4) {
+		return;
+	}
+	api->godot_pool_byte_array_resize(chain, _mip_chain_size(width, height));
+	godot_pool_byte_array_read_access *read_access = api->godot_pool_byte_array_read(source);
+	godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(chain);
+	uint8_t *level = api->godot_pool_byte_array_write_access_ptr(write_access);
+	memcpy(level, api->godot_pool_byte_array_read_access_ptr(read_access), width * height * 4);
+	api->godot_pool_byte_array_read_access_destroy(read_access);
+	while (width > 1 || height > 1) {
+		int next_width = FFMAX(width / 2, 1);
+		int next_height = FFMAX(height / 2, 1);
+		uint8_t *next = level + (size_t)width * height * 4;
+		_mip_downsample(level, width, height, next, next_width, next_height);
+		level = next;
+		width = next_width;
+		height = next_height;
+	}
+	api->godot_pool_byte_array_write_access_destroy(write_access);
+}
+
+// Builds chains until no newer frame is waiting, frames that arrive meanwhile replace each other.
+static void _mip_job(void *arg) {
+	mip_chain_t *mips = (mip_chain_t *)arg;
+	vd_mutex_lock(&mips->mutex);
+	while (mips->source_pending) {
+		// take the reference, the next frame can't be converted into it without a copy.
+		godot_pool_byte_array source = mips->source;
+		api->godot_pool_byte_array_new(&mips->source);
+		int width = mips->source_width, height = mips->source_height;
+		mips->source_pending = false;
+		vd_mutex_unlock(&mips->mutex);
+
+		godot_pool_byte_array chain;
+		api->godot_pool_byte_array_new(&chain);
+		_mip_build(&chain, &source, width, height);
+		api->godot_pool_byte_array_destroy(&source);
+
+		vd_mutex_lock(&mips->mutex);
+		api->godot_pool_byte_array_destroy(&mips->pixels);
+		mips->pixels = chain;
+	}
+	mips->running = false;
+	vd_cond_broadcast(&mips->cond);
+	vd_mutex_unlock(&mips->mutex);
+}
+
+static void _mip_submit(videodecoder_data_struct *data, godot_pool_byte_array *frame) {
+	mip_chain_t *mips = data->mips;
+	mips->submitted_time = data->frame_time;
+	vd_mutex_lock(&mips->mutex);
+	api->godot_pool_byte_array_destroy(&mips->source);
+	api->godot_pool_byte_array_new_copy(&mips->source, frame);
+	mips->source_width = data->out_width;
+	mips->source_height = data->out_height;
+	mips->source_pending = true;
+	bool push = !mips->running;
+	mips->running = true;
+	vd_mutex_unlock(&mips->mutex);
+	if (push && (_decoders() == NULL || worker_push(decoders, _mip_job, mips) != 0)) {
+		_mip_job(mips);
+	}
+}
+
+// The newest finished chain, without waiting for the job: while it builds the chain of
+// the last frame godot got, this is the one of a frame before.
+static void _mip_get(mip_chain_t *mips, godot_pool_byte_array *dest) {
+	vd_mutex_lock(&mips->mutex);
+	api->godot_pool_byte_array_new_copy(dest, &mips->pixels);
+	vd_mutex_unlock(&mips->mutex);
+}
+
+static int64_t _mip_memory(videodecoder_data_struct *data) {
+	vd_mutex_lock(&data->mips->mutex);
+	int64_t size = api->godot_pool_byte_array_size(&data->mips->pixels);
+	vd_mutex_unlock(&data->mips->mutex);
+	return size;
+}
+
+/* ---------------------- Bake ------------------------- */
+
+// bake option, for short looping clips: the instance that opens the file first keeps the
+// converted frames of its first loop, then it and every instance playing the same file
+// with the same output get their frames from there. The video stream isn't demuxed or
+// decoded anymore, the audio plays on as usual. The frames are stored as converted,
+// a clip that doesn't fit in bake_budget is decoded like without the option.
+
+enum BAKE_STATE {BAKE_RECORDING, BAKE_READY, BAKE_FAILED};
+
+typedef struct bake_frame_t {
+	godot_pool_byte_array pixels;
+	// without clip_offset
+	double time;
+	double duration;
+} bake_frame_t;
+
+typedef struct bake_t {
+	// the file (see _probe_key()), stream and conversion the frames are of
+	int64_t file_len;
+	uint32_t probe_hash;
+	int stream_idx;
+	int width, height;
+	int64_t crop_x, crop_y;
+	enum BAKE_STATE state;
+	bake_frame_t *frames;
+	int nb_frames;
+	int capacity;
+	int64_t bytes;
+	// of one loop, once ready
+	double duration;
+	// instances holding it, the one recording included
+	int refs;
+	struct bake_t *next;
+} bake_t;
+
+// Bakes that are ready or being recorded, failed ones are taken out right away.
+static bake_t *bakes = NULL;
+// bytes of the frames of all bakes
+static volatile int64_t bake_total_bytes = 0;
+
+static bool _bake_eligible(videodecoder_data_struct *data) {
+	return data->options.bake && data->options.loop && !data->options.live && !data->options.offline
+		&& data->atlas == NULL && data->videostream_idx >= 0;
+}
+
+static bool _bake_matches(bake_t *bake, videodecoder_data_struct *data, int64_t file_len, uint32_t probe_hash) {
+	return bake->file_len == file_len && bake->probe_hash == probe_hash && bake->stream_idx == data->videostream_idx
+		&& bake->width == data->out_width && bake->height == data->out_height
+		&& bake->crop_x == data->options.crop_x && bake->crop_y == data->options.crop_y;
+}
+
+// Call with bake_mutex held.
+static void _bake_drop_frames(bake_t *bake) {
+	for (int i = 0; i < bake->nb_frames; i++) {
+		api->godot_pool_byte_array_destroy(&bake->frames[i].pixels);
+	}
+	vd_atomic_add(&bake_total_bytes, -bake->bytes);
+	bake->nb_frames = 0;
+	bake->bytes = 0;
+}
+
+// Call with bake_mutex held.
+static void _bake_unlink(bake_t *bake) {
+	bake_t **link = &bakes;
+	while (*link != NULL && *link != bake) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		*link = bake->next;
+	}
+}
+
+// Call with bake_mutex held. The instances waiting for it decode on, the next open records again.
+static void _bake_fail(bake_t *bake) {
+	if (bake->state != BAKE_RECORDING) {
+		return;
+	}
+	bake->state = BAKE_FAILED;
+	_bake_drop_frames(bake);
+	_bake_unlink(bake);
+}
+
+static void _bake_release(videodecoder_data_struct *data) {
+	bake_t *bake = data->bake;
+	if (bake == NULL) {
+		return;
+	}
+	vd_mutex_lock(&bake_mutex);
+	if (data->bake_recording) {
+		_bake_fail(bake);
+	}
+	bool last = --bake->refs == 0;
+	if (last) {
+		_bake_drop_frames(bake);
+		_bake_unlink(bake);
+	}
+	vd_mutex_unlock(&bake_mutex);
+	if (last) {
+		if (bake->frames != NULL) {
+			api->godot_free(bake->frames);
+		}
+		api->godot_free(bake);
+	}
+	data->bake = NULL;
+	data->bake_recording = false;
+	data->bake_serving = false;
+	data->bake_frame = -1;
+}
+
+// After opening: joins the bake of the same file and output, or records one starting
+// with the prerolled frame.
+static void _bake_attach(videodecoder_data_struct *data, int64_t file_len, uint32_t probe_hash) {
+	if (file_len < 0 || !_bake_eligible(data)) {
+		return;
+	}
+	vd_mutex_lock(&bake_mutex);
+	bake_t *bake = bakes;
+	while (bake != NULL && !_bake_matches(bake, data, file_len, probe_hash)) {
+		bake = bake->next;
+	}
+	if (bake == NULL && data->poster_pending) {
+		bake = (bake_t *)api->godot_alloc(sizeof(bake_t));
+		if (bake != NULL) {
+			memset(bake, 0, sizeof(bake_t));
+			bake->file_len = file_len;
+			bake->probe_hash = probe_hash;
+			bake->stream_idx = data->videostream_idx;
+			bake->width = data->out_width;
+			bake->height = data->out_height;
+			bake->crop_x = data->options.crop_x;
+			bake->crop_y = data->options.crop_y;
+			bake->state = BAKE_RECORDING;
+			bake->next = bakes;
+			bakes = bake;
+			data->bake_recording = true;
+		}
+	}
+	if (bake != NULL) {
+		bake->refs++;
+	}
+	data->bake = bake;
+	vd_mutex_unlock(&bake_mutex);
+	if (data->bake_recording) {
+		_bake_record(data);
+	}
+}
+
+// The frame just converted into unwrapped_frame, by the instance recording. Frames have to
+// come in order from the start of the stream, anything else (seeking away, skipped frames,
+// a moved crop region) gives up. The first frame of the second loop completes the bake.
+static void _bake_record(videodecoder_data_struct *data) {
+	bake_t *bake = data->bake;
+	double time = data->frame_time - data->clip_offset;
+	int64_t frame_size = (int64_t)data->out_width * data->out_height * 4;
+	AVStream *stream = data->format_ctx->streams[data->videostream_idx];
+	double start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time * av_q2d(stream->time_base) : 0;
+
+	vd_mutex_lock(&bake_mutex);
+	if (bake->nb_frames > 0 && data->loop_offset > 0 && time >= bake->frames[0].time + _avtime_to_sec(data->loop_offset)) {
+		bake->duration = _avtime_to_sec(data->loop_offset);
+		bake->state = BAKE_READY;
+		data->bake_recording = false;
+		vd_mutex_unlock(&bake_mutex);
+		return;
+	}
+	bool ok = data->vcodec_ctx != NULL && data->vcodec_ctx->skip_frame == AVDISCARD_DEFAULT
+		&& data->options.crop_x == bake->crop_x && data->options.crop_y == bake->crop_y
+		&& api->godot_pool_byte_array_size(&data->unwrapped_frame) == frame_size;
+	if (bake->nb_frames == 0) {
+		ok = ok && time < start + FFMAX(data->frame_duration, 0.001) / 2;
+	} else {
+		ok = ok && time > bake->frames[bake->nb_frames - 1].time;
+	}
+	if (ok && bake->bytes + frame_size > data->options.bake_budget) {
+		api->godot_print_warning("Clip doesn't fit in bake_budget, decoding it.", "_bake_record()", __FILE__, __LINE__);
+		ok = false;
+	}
+	if (ok && bake->nb_frames == bake->capacity) {
+		int capacity = FFMAX(bake->capacity * 2, 64);
+		bake_frame_t *frames = (bake_frame_t *)api->godot_realloc(bake->frames, sizeof(bake_frame_t) * capacity);
+		if (frames != NULL) {
+			bake->frames = frames;
+			bake->capacity = capacity;
+		}
+		ok = frames != NULL;
+	}
+	if (!ok) {
+		_bake_fail(bake);
+		data->bake_recording = false;
+		vd_mutex_unlock(&bake_mutex);
+		return;
+	}
+	// shares the buffer, the next conversion copies on write.
+	bake_frame_t *frame = &bake->frames[bake->nb_frames++];
+	api->godot_pool_byte_array_new_copy(&frame->pixels, &data->unwrapped_frame);
+	frame->time = time;
+	frame->duration = data->frame_duration;
+	bake->bytes += frame_size;
+	vd_atomic_add(&bake_total_bytes, frame_size);
+	vd_mutex_unlock(&bake_mutex);
+}
+
+// A seek while recording starts over, the poster decoded at the new position
+// is the first frame again if it's at the start.
+static void _bake_restart(videodecoder_data_struct *data) {
+	if (!data->bake_recording) {
+		return;
+	}
+	vd_mutex_lock(&bake_mutex);
+	_bake_drop_frames(data->bake);
+	vd_mutex_unlock(&bake_mutex);
+}
+
+// The bake is ready: the video packets are discarded and the codec goes to the reaper.
+static void _bake_start_serving(videodecoder_data_struct *data) {
+	data->bake_recording = false;
+	data->bake_serving = true;
+	data->bake_frame = -1;
+	data->poster_pending = false;
+	if (data->frame_yuv != NULL) {
+		av_frame_unref(data->frame_yuv);
+	}
+	_teardown(data, TEARDOWN_VIDEO_CODEC);
+	packet_queue_flush(data->video_packet_queue);
+	_update_discard(data);
+}
+
+// Puts the baked frame for data->time in unwrapped_frame. False while the frames
+// still come from the codec: recording, or waiting for the instance that records.
+static bool _bake_serve(videodecoder_data_struct *data) {
+	bake_t *bake = data->bake;
+	if (!data->bake_serving) {
+		vd_mutex_lock(&bake_mutex);
+		enum BAKE_STATE state = bake->state;
+		vd_mutex_unlock(&bake_mutex);
+		if (state == BAKE_FAILED) {
+			_bake_release(data);
+		}
+		if (state != BAKE_READY) {
+			return false;
+		}
+		_bake_start_serving(data);
+	}
+	// ready bakes don't change anymore.
+	double start = bake->frames[0].time;
+	double elapsed = FFMAX(data->time - data->clip_offset - start, 0);
+	int64_t loop = (int64_t)floor(elapsed / bake->duration);
+	double offset = elapsed - loop * bake->duration;
+	// the last frame starting at or before offset
+	int lo = 0, hi = bake->nb_frames - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (bake->frames[mid].time - start <= offset) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	int64_t serial = loop * bake->nb_frames + lo;
+	data->position_type = POS_TIME;
+	if (serial == data->bake_frame) {
+		data->frame_changed = false;
+		data->repeat_frame++;
+		return true;
+	}
+	bake_frame_t *frame = &bake->frames[lo];
+	api->godot_pool_byte_array_destroy(&data->unwrapped_frame);
+	api->godot_pool_byte_array_new_copy(&data->unwrapped_frame, &frame->pixels);
+	data->bake_frame = serial;
+	data->frame_time = frame->time + loop * bake->duration + data->clip_offset;
+	data->frame_duration = frame->duration;
+	data->frame_unwrapped = true;
+	data->frame_changed = true;
+	data->total_frame++;
+	return true;
+}
+
+static int64_t _bake_memory(videodecoder_data_struct *data) {
+	if (data->bake == NULL) {
+		return 0;
+	}
+	vd_mutex_lock(&bake_mutex);
+	int64_t bytes = data->bake->bytes;
+	vd_mutex_unlock(&bake_mutex);
+	return bytes;
+}
+
+static godot_pool_byte_array *_get_videoframe(void *p_data) {
+	PROFILE_START("get_videoframe", __LINE__);
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	size_t drop_count = 0;
+	// to maintain a decent game frame rate
+	// don't let frame decoding take more than this number of ms
+	uint64_t max_frame_drop_time = (uint64_t)FFMAX(data->options.max_frame_drop_msec, 0);
+	// but we do need to drop frames, so try to drop at least some frames even if it's a bit slow :(
+	size_t min_frame_drop_count = (size_t)FFMAX(data->options.min_frame_drop_count, 0);
+	uint64_t start = get_ticks_msec();
+	data->last_visible_msec = start;
+
+	if (data->suspended) {
+		// the last converted frame is kept while suspended.
+		PROFILE_END;
+		return &data->unwrapped_frame;
+	}
+
+	if (data->videostream_idx < 0) {
+		PROFILE_END;
+		return _audio_finished(data) && data->next_clip < 0 ? NULL : &data->unwrapped_frame;
+	}
+
+	if (_is_offline(data)) {
+		godot_pool_byte_array *frame = _ahead_next(data);
+		PROFILE_END;
+		return frame;
+	}
+
+	if (_poster_busy(data)) {
+		// the previous frame stays up until the one at the seek position is decoded.
+		data->frame_changed = false;
+		data->repeat_frame++;
+		data->position_type = POS_TIME;
+		PROFILE_END;
+		return &data->unwrapped_frame;
+	}
+
+	if (data->bake != NULL && _bake_serve(data)) {
+		PROFILE_END;
+		return &data->unwrapped_frame;
+	}
+
+	if (data->poster_pending) {
+		data->poster_pending = false;
+		if (_video_frame_time(data) >= data->time - data->diff_tolerance) {
+			data->total_frame++;
+			data->position_type = POS_TIME;
+			PROFILE_END;
+			return &data->unwrapped_frame;
+		}
+	}
+
+	// godot asks for frames more often than the video has them (several calls per update,
+	// high refresh rate displays) so hand back the current frame until the next one is due.
+	if (data->frame_unwrapped && data->time < data->frame_time + data->frame_duration) {
+		data->frame_changed = false;
+		data->repeat_frame++;
+		data->position_type = POS_TIME;
+		PROFILE_END;
+		return &data->unwrapped_frame;
+	}
+
+retry:
+	if (!_decode_video_frame(data)) {
+		if (data->options.live && data->frame_unwrapped) {
+			// nothing new received yet
+			data->frame_changed = false;
+			data->position_type = POS_TIME;
+			PROFILE_END;
+			return &data->unwrapped_frame;
+		}
+		if (data->next_clip >= 0 && data->frame_unwrapped) {
+			// keep showing the last frame until update() switches to the next clip.
+			data->clip_ended = true;
+			data->frame_changed = false;
+			PROFILE_END;
+			return &data->unwrapped_frame;
+		}
+		PROFILE_END;
+		return NULL;
+	}
+
+	double ts = _video_frame_time(data);
+
+	data->total_frame++;
+
+	// frame successfully decoded here, now if it lags behind too much (diff_tolerance sec)
+	// let's discard this frame and get the next frame instead
+	// a recording bake needs every frame, the later loops make up for it.
+	bool drop = ts < data->time - data->diff_tolerance && !data->bake_recording;
+	uint64_t drop_duration = get_ticks_msec() - start;
+	if (drop && drop_duration > max_frame_drop_time && drop_count < min_frame_drop_count && data->frame_unwrapped) {
+		// only discard frames for max_frame_drop_time ms or we'll slow down the game's main thread!
+		if (fabs(data->seek_time - data->time) > data->diff_tolerance * 10) {
+			char msg[512];
+			snprintf(msg, sizeof(msg) -1, "Slow CPU? Dropped  %d frames for %"PRId64"ms frame dropped: %lu/%lu (%.1f%%) pts=%.1f t=%.1f",
+				(int)drop_count,
+				drop_duration,
+				data->drop_frame,
+				data->total_frame,
+				100.0 * data->drop_frame / data->total_frame,
+				ts, (double)data->time);
+			api->godot_print_warning(msg, "godot_videodecoder_get_videoframe()", __FILE__, __LINE__);
+		}
+	} else if (drop) {
+		drop_count++;
+		data->drop_frame++;
+		goto retry;
+	}
+	if (!drop || fabs(data->seek_time - data->time) > data->diff_tolerance * 2) {
+		// Don't overwrite the current frame when dropping frames for performance reasons
+		// except when the time is within 2 frames of the most recent seek
+		// because we don't want a glitchy 'fast forward' effect when seeking.
+		// NOTE: VideoPlayer currently doesnt' ask for a frame when seeking while paused so you'd
+		// have to fake it inside godot by unpausing briefly. (see FIG1 below)
+		_convert_video_frame(data);
+	}
+
+	// hack to get video_stream_gdnative to stop asking for frames.
+	// stop trusting video pts until the next time update() is called.
+	// this will unblock VideoStreamPlaybackGDNative::update() which
+	// keeps calling get_texture() until the time matches
+	// we don't need this behavior as we already handle frame skipping internally.
+	data->position_type = POS_TIME;
+	PROFILE_END;
+	return data->frame_unwrapped ? &data->unwrapped_frame : NULL;
+}
+
+/*
+FIG1: how to seek while paused...
+
+var _paused_seeking = 0
+func seek_player(value):
+	var was_playing = _playing
+	if _playing:
+		stop()
+	_player.stream_position = value
+
+	if was_playing:
+		play(value)
+		if _player.paused || _paused_seeking > 0:
+			_player.paused = false
+			_paused_seeking = _paused_seeking + 1
+			# yes, it seems like 5 idle frames _is_ the magic number.
+			# VideoPlayer gets notified to do NOTIFICATION_INTERNAL_PROCESS on idle frames
+			# so this should always work?
+			for i in range(5):
+				yield(get_tree(), 'idle_frame')
+			# WARNING: -= double decrements here somehow?
+			_paused_seeking = _paused_seeking - 1
+			assert(_paused_seeking >= 0)
+			if _paused_seeking == 0:
+				_player.paused = true
+
+*/
+
+// Room for `samples` staged samples, keeps the ones that are there.
+static bool _audio_buffer_reserve(videodecoder_data_struct *data, int samples) {
+	int size = samples * data->audio_channels;
+	if (size <= data->audio_buffer_size) {
+		return true;
+	}
+	size = FFMAX(size, data->audio_buffer_size * 2);
+	float *buffer = (float *)mem_alloc(&data->mem, MEM_AUDIO, size * sizeof(float));
+	if (buffer == NULL) {
+		api->godot_print_error("Audio buffer alloc failed.", "godot_videodecoder_get_audio()", __FILE__, __LINE__);
+		return false;
+	}
+	if (data->num_decoded_samples > 0) {
+		memcpy(buffer, data->audio_buffer + data->audio_channels * data->audio_buffer_pos,
+				sizeof(float) * data->num_decoded_samples * data->audio_channels);
+	}
+	if (data->audio_buffer != NULL) {
+		mem_free(&data->mem, MEM_AUDIO, data->audio_buffer, data->audio_buffer_size * sizeof(float));
+	}
+	data->audio_buffer = buffer;
+	data->audio_buffer_size = size;
+	data->audio_buffer_pos = 0;
+	return true;
+}
+
+// Resamples audio_frame straight into `dest`, which has room for `space` samples, and returns
+// how many were written. Only what doesn't fit is staged in audio_buffer.
+static int _resample_audio_frame(videodecoder_data_struct *data, float *dest, int space) {
+	const uint8_t **in = (const uint8_t **)data->audio_frame->extended_data;
+	uint8_t *out = (uint8_t *)dest;
+	int converted = swr_convert(data->swr_ctx, &out, space, in, data->audio_frame->nb_samples);
+	data->num_decoded_samples = 0;
+	data->audio_buffer_pos = 0;
+	// the resampler kept the input it had no room for, take it out without draining the filter.
+	int tail = swr_get_out_samples(data->swr_ctx, 0);
+	if (tail > 0 && _audio_buffer_reserve(data, tail)) {
+		uint8_t *staging = (uint8_t *)data->audio_buffer;
+		int staged = swr_convert(data->swr_ctx, &staging, data->audio_buffer_size / data->audio_channels, in, 0);
+		data->num_decoded_samples = staged > 0 ? staged : 0;
+	}
+	return converted > 0 ? converted : 0;
+}
+
+// Puts `count` samples that were written to godot's buffer back in front of the staged ones.
+static void _unread_audio(videodecoder_data_struct *data, const float *samples, int count) {
+	if (count <= 0) {
+		return;
+	}
+	int staged = FFMAX(data->num_decoded_samples, 0);
+	if (!_audio_buffer_reserve(data, count + staged)) {
+		return;
+	}
+	float *start = data->audio_buffer + data->audio_channels * data->audio_buffer_pos;
+	memmove(data->audio_buffer + data->audio_channels * count, start, sizeof(float) * staged * data->audio_channels);
+	memcpy(data->audio_buffer, samples, sizeof(float) * count * data->audio_channels);
+	data->audio_buffer_pos = 0;
+	data->num_decoded_samples = count + staged;
+}
+
+static godot_int _get_audio(void *p_data, float *pcm, int pcm_remaining) {
+	PROFILE_START("get_audio", __LINE__);
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	if (data->audiostream_idx < 0 || data->suspended || _audio_muted(data) || _poster_running(data)) {
+		PROFILE_END;
+		return 0;
+	}
+	bool first_frame = true;
+
+	// if playback has just started or just seeked then we enter the audio_reset state.
+	// during audio_reset it's important to skip old samples
+	// _and_ avoid sending samples from the future until the presentation timestamp syncs up.
+	bool audio_reset = isnan(data->audio_time) || data->audio_time > data->time - data->diff_tolerance;
+
+	const int pcm_buffer_size = pcm_remaining;
+	int pcm_offset = 0;
+
+	double p_time = data->audio_frame->pts * av_q2d(data->format_ctx->streams[data->audiostream_idx]->time_base) + data->clip_offset;
+
+	if (audio_reset && data->num_decoded_samples > 0) {
+		// don't send any pcm data if the frame hasn't started yet
+		if (p_time > data->time) {
+			PROFILE_END;
+			return 0;
+		}
+		// skip the any decoded samples if their presentation timestamp is too old
+		if (data->time - p_time > data->diff_tolerance) {
+			data->num_decoded_samples = 0;
+		}
+	}
+
+	int sample_count = (pcm_remaining < data->num_decoded_samples) ? pcm_remaining : data->num_decoded_samples;
+
+	if (sample_count > 0) {
+		memcpy(pcm, data->audio_buffer + data->audio_channels * data->audio_buffer_pos, sizeof(float) * sample_count * data->audio_channels);
+		pcm_offset += sample_count;
+		pcm_remaining -= sample_count;
+		data->num_decoded_samples -= sample_count;
+		data->audio_buffer_pos += sample_count;
+	}
+	while (pcm_remaining > 0) {
+		// samples of a newly decoded frame that went straight to pcm + pcm_offset
+		int converted = 0;
+		if (data->num_decoded_samples <= 0) {
+			AVPacket pkt;
+
+			int ret;
+retry_audio:
+			ret = avcodec_receive_frame(data->acodec_ctx, data->audio_frame);
+			if (ret == AVERROR(EAGAIN)) {
+				// need to call avcodec_send_packet, get a packet from queue to send it
+				// audio muxed behind the video is demuxed right here, the video queue is trimmed meanwhile
+				if (!packet_queue_get(data->audio_packet_queue, &pkt)
+						&& (data->demux_eof || !_read_frame_for(data, data->audio_packet_queue)
+								|| !packet_queue_get(data->audio_packet_queue, &pkt))) {
+					if (pcm_offset == 0) {
+						// if we haven't got any on-time audio yet, then the audio_time counter is meaningless.
+						data->audio_time = NAN;
+					}
+					PROFILE_END;
+					return pcm_offset;
+				}
+				ret = avcodec_send_packet(data->acodec_ctx, &pkt);
+				if (ret < 0) {
+					char msg[512];
+					snprintf(msg, sizeof(msg) -1, "avcodec_send_packet returns %d", ret);
+					api->godot_print_error(msg, "godot_videodecoder_get_audio()", __FILE__, __LINE__);
+					av_packet_unref(&pkt);
+					PROFILE_END;
+					return pcm_offset;
+				}
+				av_packet_unref(&pkt);
+				goto retry_audio;
+			} else if (ret < 0) {
+				char msg[512];
+				snprintf(msg, sizeof(msg) - 1, "avcodec_receive_frame returns %d", ret);
+				api->godot_print_error(msg, "godot_videodecoder_get_audio()", __FILE__, __LINE__);
+				PROFILE_END;
+				return pcm_buffer_size - pcm_remaining;
+			}
+			// only set the audio frame time if this is the first frame we've decoded during this update.
+			// any remaining frames are going into a buffer anyways
+			p_time = data->audio_frame->pts * av_q2d(data->format_ctx->streams[data->audiostream_idx]->time_base) + data->clip_offset;
+			if (first_frame) {
+				data->audio_time = p_time;
+				first_frame = false;
+			}
+			// decoded audio ready here
+			converted = _resample_audio_frame(data, pcm + pcm_offset * data->audio_channels, pcm_remaining);
+		}
+		if (audio_reset) {
+			if (data->time - p_time > data->diff_tolerance) {
+				// skip samples if the frame time is too far in the past
+				converted = 0;
+				data->num_decoded_samples = 0;
+			} else if (p_time > data->time) {
+				// don't send any pcm data if the first frame hasn't started yet
+				_unread_audio(data, pcm + pcm_offset * data->audio_channels, converted);
+				data->audio_time = NAN;
+				break;
+			}
+		}
+		pcm_offset += converted;
+		pcm_remaining -= converted;
+		sample_count = pcm_remaining < data->num_decoded_samples ? pcm_remaining : data->num_decoded_samples;
+		if (sample_count > 0) {
+			memcpy(pcm + pcm_offset * data->audio_channels, data->audio_buffer + data->audio_channels * data->audio_buffer_pos, sizeof(float) * sample_count * data->audio_channels);
+			pcm_offset += sample_count;
+			pcm_remaining -= sample_count;
+			data->num_decoded_samples -= sample_count;
+			data->audio_buffer_pos += sample_count;
+		}
+	}
+
+	PROFILE_END;
+	return pcm_offset;
+}
+
+godot_pool_byte_array *godot_videodecoder_get_videoframe(void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	godot_pool_byte_array *frame = _get_videoframe(p_data);
+	if (frame != NULL && data->options.mipmaps && data->videostream_idx >= 0 && data->frame_changed
+			&& data->frame_time != data->mips->submitted_time) {
+		_mip_submit(data, frame);
+	}
+	return frame;
+}
+
+godot_int godot_videodecoder_get_audio(void *p_data, float *pcm, int pcm_remaining) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	if (!_shares_pipeline(data)) {
+		return _get_audio(p_data, pcm, pcm_remaining);
+	}
+	// the decode ahead or atlas job may be demuxing
+	vd_mutex_lock(&data->ahead->pipeline_mutex);
+	godot_int ret = _get_audio(p_data, pcm, pcm_remaining);
+	vd_mutex_unlock(&data->ahead->pipeline_mutex);
+	return ret;
+}
+
+static godot_real _media_position(videodecoder_data_struct *data) {
+	// atlas frames are pulled through update_atlas(), godot must not ask for (and upload) its own.
+	if (data->format_ctx && (data->suspended || data->clip_ended || data->atlas != NULL || _poster_running(data))) {
+		return (godot_real)data->time;
+	}
+
+	if (data->format_ctx && _is_offline(data)) {
+		// godot keeps asking for frames until the last one handed out reaches its clock.
+		return isnan(data->frame_time) ? (godot_real)data->time - 0.01 : (godot_real)data->frame_time;
+	}
+
+	if (data->format_ctx && data->bake_serving) {
+		// any time has its frame at hand, godot only needs to ask once per update.
+		bool in_update = data->position_type == POS_V_PTS;
+		data->position_type = POS_TIME;
+		return (godot_real)data->time - (in_update ? 0.01 : 0.0);
+	}
+
+	if (data->format_ctx && data->videostream_idx < 0) {
+		// without video godot only needs to call get_videoframe() to find out playback has ended.
+		bool ended = _audio_finished(data) && data->next_clip < 0;
+		return ended ? (godot_real)data->time - 1 : (godot_real)data->time;
+	}
+
+	if (data->format_ctx) {
+		bool use_v_pts = data->frame_yuv->pts != AV_NOPTS_VALUE && data->position_type == POS_V_PTS;
+		bool use_a_time = data->position_type == POS_A_TIME;
+		bool in_update = data->position_type == POS_V_PTS;
+		data->position_type = POS_TIME;
+
+		if (use_v_pts) {
+			double pts = (double)data->frame_yuv->pts;
+			pts *= av_q2d(data->format_ctx->streams[data->videostream_idx]->time_base);
+			return (godot_real)(pts + data->clip_offset);
+		} else {
+			if (!isnan(data->audio_time) && use_a_time) {
+				return (godot_real)data->audio_time;
+			}
+			// fudge the time if we in the first frame after an update but don't have V_PTS yet
+			godot_real adjustment = in_update ? -0.01 : 0.0;
+			return (godot_real)data->time + adjustment;
+		}
+	}
+	return (godot_real)0;
+}
+
+godot_real godot_videodecoder_get_playback_position(const void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	godot_real position = _media_position(data);
+	if (data->format_ctx == NULL) {
+		return position;
+	}
+	// godot compares it with its own clock, which doesn't know about the speed option.
+	return data->clock + (position - data->time) / (data->speed > 0 ? data->speed : 1.0);
+}
+
+static void flush_frames(AVCodecContext* ctx) {
+	PROFILE_START("flush_frames", __LINE__);
+	/**
+	* from https://www.ffmpeg.org/doxygen/4.1/group__lavc__encdec.html
+	* End of stream situations. These require "flushing" (aka draining) the codec, as the codec might buffer multiple frames or packets internally for performance or out of necessity (consider B-frames). This is handled as follows:
+	* Instead of valid input, send NULL to the avcodec_send_packet() (decoding) or avcodec_send_frame() (encoding) functions. This will enter draining mode.
+	* Call avcodec_receive_frame() (decoding) or avcodec_receive_packet() (encoding) in a loop until AVERROR_EOF is returned. The functions will not return AVERROR(EAGAIN), unless you forgot to enter draining mode.
+	* Before decoding can be resumed again, the codec has to be reset with avcodec_flush_buffers().
+	*/
+	int ret = avcodec_send_packet(ctx, NULL);
+	AVFrame frame = {0};
+	if (ret <= 0) {
+		do {
+			ret = avcodec_receive_frame(ctx, &frame);
+		} while (ret != AVERROR_EOF);
+	}
+	PROFILE_END;
+}
+
+void godot_videodecoder_seek(void *p_data, godot_real p_time) {
+	PROFILE_START("seek", __LINE__);
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	// Hack to find the end of the video. Really VideoPlayer should expose this!
+	if (p_time < 0) {
+		p_time = _avtime_to_sec(data->format_ctx->duration);
+	}
+	if (data->suspended) {
+		// resume() seeks to data->time
+		data->time = p_time;
+		data->clock = p_time;
+		PROFILE_END;
+		return;
+	}
+	if (data->options.live) {
+		PROFILE_END;
+		return;
+	}
+	_ahead_stop(data);
+	_bake_restart(data);
+	int64_t seek_target = p_time * AV_TIME_BASE;
+	// seek within seek_margin seconds of the selected spot.
+	int64_t margin = (int64_t)(FFMAX(data->options.seek_margin, 0) * AV_TIME_BASE);
+
+	// printf("seek(): %fs = %lld\n", p_time, seek_target);
+	int ret = avformat_seek_file(data->format_ctx, -1, seek_target - margin, seek_target, seek_target, 0);
+	if (ret < 0) {
+		api->godot_print_warning("avformat_seek_file() can't seek backward?", "godot_videodecoder_seek()\n", __FILE__, __LINE__);
+		ret = avformat_seek_file(data->format_ctx, -1, seek_target - margin, seek_target, seek_target + margin, 0);
+	}
+	if (ret < 0) {
+		api->godot_print_error("avformat_seek_file() failed", "godot_videodecoder_seek()\n", __FILE__, __LINE__);
+	} else {
+		packet_queue_flush(data->video_packet_queue);
+		packet_queue_flush(data->audio_packet_queue);
+		data->demux_eof = false;
+		data->loop_offset = 0;
+		data->clip_offset = 0;
+		data->clip_ended = false;
+		if (data->vcodec_ctx) {
+			flush_frames(data->vcodec_ctx);
+			avcodec_flush_buffers(data->vcodec_ctx);
+		}
+		if (data->acodec_ctx) {
+			flush_frames(data->acodec_ctx);
+			avcodec_flush_buffers(data->acodec_ctx);
+		}
+		data->num_decoded_samples = 0;
+		data->audio_buffer_pos = 0;
+		data->poster_pending = false;
+		data->frame_time = NAN;
+		data->time = p_time;
+		data->clock = p_time;
+		data->seek_time = p_time;
+		// try to use the audio time as the seek position
+		data->position_type = POS_A_TIME;
+		data->audio_time = NAN;
+		// have the frame at the new position decoded in the background, see _poster_busy().
+		if (data->videostream_idx >= 0 && !data->bake_serving) {
+			_poster_start(data, p_time);
+		}
+	}
+	PROFILE_END;
+}
+
+// Back to decoding the video, e.g. for an atlas, which converts straight from the codec's frames.
+static void _bake_stop(videodecoder_data_struct *data) {
+	bool serving = data->bake_serving;
+	_bake_release(data);
+	if (!serving || data->suspended) {
+		return;
+	}
+	_update_discard(data);
+	if (!_reopen_video_codec(data, data->videostream_idx) || !_alloc_video_buffers(data)) {
+		api->godot_print_error("Unable to reopen the video stream.", "_bake_stop()", __FILE__, __LINE__);
+		return;
+	}
+	// the video packets before the read position were discarded, read them again.
+	godot_real clock = data->clock;
+	godot_videodecoder_seek(data, data->time);
+	data->clock = clock;
+}
+
+// Switch to another stream of the same file without reopening it.
+// The video output keeps its size, so godot's texture stays valid.
+static godot_bool _select_stream(videodecoder_data_struct *data, enum AVMediaType type, int stream_idx) {
+	if (data->suspended) {
+		// the codec is opened on resume()
+		if (type == AVMEDIA_TYPE_VIDEO) {
+			_bake_release(data);
+			data->videostream_idx = stream_idx;
+		} else if (type == AVMEDIA_TYPE_AUDIO) {
+			data->audiostream_idx = stream_idx;
+		} else {
+			return GODOT_FALSE;
+		}
+		_update_discard(data);
+		return GODOT_TRUE;
+	}
+	_ahead_stop(data);
+	if (type == AVMEDIA_TYPE_VIDEO) {
+		if (stream_idx == data->videostream_idx) return GODOT_TRUE;
+		// the bake is of the other stream, the codec is opened right below.
+		_bake_release(data);
+		int prev_idx = data->videostream_idx;
+		_teardown(data, TEARDOWN_VIDEO_CODEC | TEARDOWN_VIDEO_BUFFERS);
+		data->videostream_idx = stream_idx;
+		if (!_open_video_codec(data, stream_idx) || !_alloc_video_buffers(data)) {
+			// keep playing the previous stream
+			_free_video_buffers(data);
+			_close_video_codec(data);
+			data->videostream_idx = prev_idx;
+			if (!_open_video_codec(data, prev_idx) || !_alloc_video_buffers(data)) {
+				api->godot_print_error("Unable to restore the video stream.", "_select_stream()", __FILE__, __LINE__);
+			}
+			return GODOT_FALSE;
+		}
+	} else if (type == AVMEDIA_TYPE_AUDIO) {
+		if (stream_idx == data->audiostream_idx) return GODOT_TRUE;
+		_teardown(data, TEARDOWN_AUDIO_CODEC);
+		data->audiostream_idx = stream_idx;
+		if (!_open_audio_codec(data, stream_idx)) {
+			_close_audio_codec(data);
+			data->audiostream_idx = -1;
+			_update_discard(data);
+			return GODOT_FALSE;
+		}
+	} else {
+		return GODOT_FALSE;
+	}
+	_update_discard(data);
+	// packets of the new stream before the read position were discarded, read them again.
+	godot_real clock = data->clock;
+	godot_videodecoder_seek(data, data->time);
+	data->clock = clock;
+	return GODOT_TRUE;
+}
+
+// Releases everything but the demuxer: codecs (and their threads), conversion buffers,
+// the audio buffer, queued packets and the io chunk. The last converted frame, the position
+// and the stream info are kept, so _resume() only has to reopen the codecs and seek.
+// The AVIO buffer stays: the demuxer's AVIOContext reads into it, and libavformat may
+// have replaced it while probing, so it can't be freed under the open demuxer.
+static void _suspend(videodecoder_data_struct *data) {
+	if (data->suspended || data->format_ctx == NULL) {
+		return;
+	}
+	_ahead_stop(data);
+	_teardown(data, TEARDOWN_VIDEO_CODEC | TEARDOWN_VIDEO_BUFFERS | TEARDOWN_AUDIO_CODEC | TEARDOWN_AUDIO_BUFFERS);
+	packet_queue_flush(data->video_packet_queue);
+	packet_queue_flush(data->audio_packet_queue);
+	if (data->io_chunk != NULL) {
+		// io_chunk_size stays, _resume() allocates it again
+		io_source_set_chunk(data->io_source, NULL, 0);
+		mem_free(&data->mem, MEM_IO, data->io_chunk, data->io_chunk_size);
+		data->io_chunk = NULL;
+	}
+	data->num_decoded_samples = 0;
+	data->audio_buffer_pos = 0;
+	data->poster_pending = false;
+	data->suspended = true;
+}
+
+// Over the memory budget: drops the queued packets and the frames decoded ahead, then
+// seeks back to the current position like _resume(). While shrunk the queues only hold
+// the next packet and the ring one frame. False if the pipeline is busy, it's tried again later.
+static bool _shrink(videodecoder_data_struct *data) {
+	if (data->format_ctx == NULL || data->suspended || data->options.live) {
+		return true;
+	}
+	if (_poster_running(data)) {
+		return false;
+	}
+	godot_real clock = data->clock;
+	godot_videodecoder_seek(data, data->time);
+	data->clock = clock;
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	if (!ahead->running) {
+		_ahead_resize(ahead, 0);
+	}
+	vd_mutex_unlock(&ahead->mutex);
+	return true;
+}
+
+static godot_bool _resume(videodecoder_data_struct *data) {
+	if (!data->suspended) {
+		return GODOT_TRUE;
+	}
+	data->suspended = false;
+	if (data->io_chunk == NULL && data->io_chunk_size > 0) {
+		// without it the reads go straight to the file
+		data->io_chunk = (uint8_t *)mem_alloc(&data->mem, MEM_IO, data->io_chunk_size);
+		if (data->io_chunk != NULL) {
+			io_source_set_chunk(data->io_source, data->io_chunk, data->io_chunk_size);
+		}
+	}
+	if (data->videostream_idx >= 0 && !data->bake_serving
+			&& (!_open_video_codec(data, data->videostream_idx) || !_alloc_video_buffers(data))) {
+		api->godot_print_error("Unable to reopen the video stream.", "_resume()", __FILE__, __LINE__);
+		_suspend(data);
+		return GODOT_FALSE;
+	}
+	if (data->audiostream_idx >= 0 && !_open_audio_codec(data, data->audiostream_idx)) {
+		api->godot_print_error("Unable to reopen the audio stream.", "_resume()", __FILE__, __LINE__);
+		_suspend(data);
+		return GODOT_FALSE;
+	}
+	// back to the keyframe before the current position, decode up to it.
+	godot_real clock = data->clock;
+	godot_videodecoder_seek(data, data->time);
+	data->clock = clock;
+	return GODOT_TRUE;
+}
+
+void godot_videodecoder_set_audio_track(void *p_data, godot_int p_audiotrack) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	if (p_audiotrack <= 0 && data->audio_track < 0) {
+		// godot passes VideoPlayer.audio_track (0 unless set) with every stream,
+		// track 0 keeps the best stream until another track was asked for.
+		return;
+	}
+	data->audio_track = p_audiotrack;
+	if (data->format_ctx == NULL || data->audiostream_idx < 0) {
+		return;
+	}
+	int stream_idx = _find_stream(data, AVMEDIA_TYPE_AUDIO, p_audiotrack);
+	if (stream_idx < 0) {
+		api->godot_print_warning("Audio track not found.", "godot_videodecoder_set_audio_track()", __FILE__, __LINE__);
+		return;
+	}
+	_select_stream(data, AVMEDIA_TYPE_AUDIO, stream_idx);
+}
+
+/* ---------------------- TODO ------------------------- */
+
+godot_int godot_videodecoder_get_channels(const void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+
+	if (data->acodec_ctx != NULL) {
+		return data->audio_channels;
+	}
+	return 0;
+}
+
+godot_int godot_videodecoder_get_mix_rate(const void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+
+	if (data->acodec_ctx != NULL) {
+		return data->audio_mix_rate;
+	}
+	return 0;
+}
+
+godot_vector2 godot_videodecoder_get_texture_size(const void *p_data) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+	godot_vector2 vec;
+
+	api->godot_vector2_new(&vec, data->out_width, data->out_height);
+	return vec;
+}
+
+/* ---------------------- Preloading ------------------------- */
+
+// Call with preload_mutex held.
+static void _preload_slot_clear(preload_slot_t *slot) {
+	if (slot->data != NULL) {
+		_free_data(slot->data);
+		slot->data = NULL;
+	}
+	if (slot->file != NULL) {
+		gdfile_close(slot->file);
+		slot->file = NULL;
+	}
+	if (slot->path != NULL) {
+		api->godot_free(slot->path);
+		slot->path = NULL;
+	}
+	slot->release_pending = false;
+	slot->playlist = false;
+	slot->state = PRELOAD_EMPTY;
+}
+
+static void _preload_job(void *arg) {
+	preload_slot_t *slot = (preload_slot_t *)arg;
+	godot_bool ok = GODOT_FALSE;
+
+	slot->file = gdfile_open(slot->path);
+	if (slot->file != NULL) {
+		_probe_key(slot->file, gdfile_read, gdfile_seek, &slot->file_len, &slot->probe_hash);
+		ok = _open_stream(slot->data, slot->file, gdfile_read, gdfile_seek);
+		if (ok) {
+			_preroll(slot->data);
+		}
+	} else {
+		char msg[512] = {0};
+		snprintf(msg, sizeof(msg) - 1, "Unable to open %s", slot->path);
+		api->godot_print_error(msg, "_preload_job()", __FILE__, __LINE__);
+	}
+
+	vd_mutex_lock(&preload_mutex);
+	slot->state = ok ? PRELOAD_READY : PRELOAD_FAILED;
+	if (slot->release_pending) {
+		_preload_slot_clear(slot);
+	}
+	vd_cond_broadcast(&preload_cond);
+	vd_mutex_unlock(&preload_mutex);
+}
+
+// Start opening `path` on the loader thread. Returns a handle or -1 when the pool is full.
+// For a playlist `like` is the instance the clip will play on, the clip gets its options,
+// texture size and audio layout.
+static godot_int _preload_start(const char *path, const videodecoder_data_struct *like) {
+	gdfile_init();
+	if (loader == NULL) {
+		loader = worker_create(1);
+		if (loader == NULL) {
+			return -1;
+		}
+	}
+
+	vd_mutex_lock(&preload_mutex);
+	preload_slot_t *slot = NULL;
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		if (preload_slots[i].state == PRELOAD_EMPTY) {
+			slot = &preload_slots[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		vd_mutex_unlock(&preload_mutex);
+		api->godot_print_warning("Preload pool is full.", "_preload_start()", __FILE__, __LINE__);
+		return -1;
+	}
+	slot->path = (char *)api->godot_alloc(strlen(path) + 1);
+	strcpy(slot->path, path);
+	slot->data = godot_videodecoder_constructor(NULL);
+	slot->playlist = like != NULL;
+	if (like != NULL) {
+		slot->data->options = like->options;
+		slot->data->audio_track = like->audio_track;
+		slot->data->out_width = like->out_width;
+		slot->data->out_height = like->out_height;
+		slot->data->audio_channels = like->audio_channels;
+		slot->data->audio_channel_layout = like->audio_channel_layout;
+		slot->data->audio_mix_rate = like->audio_mix_rate;
+	}
+	slot->handle = ++preload_serial;
+	slot->state = PRELOAD_LOADING;
+	godot_int handle = slot->handle;
+	vd_mutex_unlock(&preload_mutex);
+
+	worker_push(loader, _preload_job, slot);
+	return handle;
+}
+
+static godot_int videodecoder_prepare(const char *path) {
+	return _preload_start(path, NULL);
+}
+
+static preload_slot_t *_preload_find(godot_int handle) {
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		if (preload_slots[i].state != PRELOAD_EMPTY && preload_slots[i].handle == handle) {
+			return &preload_slots[i];
+		}
+	}
+	return NULL;
+}
+
+static godot_bool videodecoder_is_prepared(godot_int handle) {
+	vd_mutex_lock(&preload_mutex);
+	preload_slot_t *slot = _preload_find(handle);
+	godot_bool ready = slot != NULL && slot->state == PRELOAD_READY;
+	vd_mutex_unlock(&preload_mutex);
+	return ready;
+}
+
+static void videodecoder_release(godot_int handle) {
+	vd_mutex_lock(&preload_mutex);
+	preload_slot_t *slot = _preload_find(handle);
+	if (slot != NULL) {
+		if (slot->state == PRELOAD_LOADING) {
+			// the loader thread clears it once it's done.
+			slot->release_pending = true;
+		} else {
+			_preload_slot_clear(slot);
+		}
+	}
+	vd_mutex_unlock(&preload_mutex);
+}
+
+/* ---------------------- Playlist ------------------------- */
+
+// Queue `path` to play right after the current clip, it's opened and prerolled on the loader thread.
+static godot_bool videodecoder_queue_next(videodecoder_data_struct *data, const char *path) {
+	if (data->next_clip >= 0) {
+		videodecoder_release(data->next_clip);
+	}
+	data->next_clip = _preload_start(path, data);
+	return data->next_clip >= 0;
+}
+
+// Everything of the current clip was shown and its audio decoded. The samples that
+// are still staged carry over into the next clip, see _switch_clip().
+static bool _clip_finished(videodecoder_data_struct *data) {
+	return data->format_ctx != NULL && data->demux_eof && data->audio_packet_queue->nb_packets == 0
+		&& (data->videostream_idx < 0 || data->clip_ended);
+}
+
+// After _swap_pipeline(): moves the samples `prev` staged in front of what `data` decodes,
+// so the audio runs on across the boundary without a gap.
+static void _carry_audio(videodecoder_data_struct *data, videodecoder_data_struct *prev) {
+	int staged = FFMAX(prev->num_decoded_samples, 0);
+	if (staged == 0 || data->num_decoded_samples > 0 || data->audiostream_idx < 0 || prev->audiostream_idx < 0
+			|| data->audio_frame == NULL || data->audio_channels != prev->audio_channels
+			|| !_audio_buffer_reserve(data, staged)) {
+		return;
+	}
+	memcpy(data->audio_buffer, prev->audio_buffer + prev->audio_channels * prev->audio_buffer_pos,
+			sizeof(float) * staged * prev->audio_channels);
+	data->audio_buffer_pos = 0;
+	data->num_decoded_samples = staged;
+	// _get_audio() takes their time from audio_frame, on the new clip's time base.
+	double time = prev->audio_frame->pts * av_q2d(prev->format_ctx->streams[prev->audiostream_idx]->time_base) + prev->clip_offset;
+	data->audio_frame->pts = llrint((time - data->clip_offset) / av_q2d(data->format_ctx->streams[data->audiostream_idx]->time_base));
+}
+
+// Swap in the prepared pipeline of the next clip. Its timestamps continue where
+// the current clip ended, godot's clock (data->time) carries on.
+static void _switch_clip(videodecoder_data_struct *data) {
+	vd_mutex_lock(&preload_mutex);
+	preload_slot_t *slot = _preload_find(data->next_clip);
+	if (slot != NULL && slot->state == PRELOAD_LOADING) {
+		// not ready yet, the last frame stays up until it is.
+		vd_mutex_unlock(&preload_mutex);
+		return;
+	}
+	videodecoder_data_struct *next = NULL;
+	gdfile_t *next_file = NULL;
+	if (slot != NULL && slot->state == PRELOAD_READY) {
+		next = slot->data;
+		next_file = slot->file;
+		slot->data = NULL;
+		slot->file = NULL;
+	}
+	if (slot != NULL) {
+		_preload_slot_clear(slot);
+	}
+	vd_mutex_unlock(&preload_mutex);
+	data->next_clip = -1;
+	if (next == NULL) {
+		api->godot_print_error("Next clip failed to open.", "_switch_clip()", __FILE__, __LINE__);
+		return;
+	}
+
+	double end = data->clip_offset + (data->loop_end > 0 ? _avtime_to_sec(data->loop_end) : _avtime_to_sec(data->format_ctx->duration));
+	double next_start = next->format_ctx->start_time != AV_NOPTS_VALUE ? _avtime_to_sec(next->format_ctx->start_time) : 0;
+	godot_real time = data->time;
+	godot_real clock = data->clock;
+	double diff_tolerance = data->diff_tolerance;
+	double audio_time = data->audio_time;
+
+	next->clip_file = next_file;
+	_ahead_stop(data);
+	_swap_pipeline(data, next);
+
+	data->time = time;
+	data->clock = clock;
+	data->seek_time = time;
+	data->diff_tolerance = diff_tolerance;
+	// the audio clock runs on, the next clip's samples start where the staged ones end
+	data->audio_time = audio_time;
+	data->clip_offset = end - next_start;
+	// the prerolled poster frame
+	data->frame_time += data->clip_offset;
+	_carry_audio(data, next);
+	// `next` now holds the finished clip. Its codecs go to the reaper anyway, so
+	// does its demuxer unless it reads godot's file.
+	_teardown(next, TEARDOWN_INPUT);
+	_free_data(next);
+}
+
+/* ---------------------- Memory budget ------------------------- */
+
+// 0 means unlimited.
+static int64_t memory_budget = 0;
+static uint64_t budget_check_msec = 0;
+#define BUDGET_CHECK_INTERVAL_MSEC 500
+
+static int64_t _queue_memory(PacketQueue *q) {
+	return q != NULL ? q->size + q->nb_packets * (int64_t)sizeof(AVPacketList) : 0;
+}
+
+// Video frames are counted by the frame pool. FFmpeg's audio pools aren't visible from here,
+// estimate them from the last decoded frame.
+static int64_t _codec_pool_memory(videodecoder_data_struct *data) {
+	int64_t bytes = 0;
+	if (data->vcodec_ctx != NULL) {
+		bytes += frame_pool_codec_bytes(data->vcodec_ctx);
+	}
+	if (data->audio_frame != NULL && data->acodec_ctx != NULL) {
+		bytes += (int64_t)data->audio_frame->nb_samples * data->acodec_ctx->channels
+				* av_get_bytes_per_sample(data->acodec_ctx->sample_fmt);
+	}
+	return bytes;
+}
+
+static int64_t _instance_memory(videodecoder_data_struct *data) {
+	return mem_stats_total(&data->mem)
+		+ _queue_memory(data->video_packet_queue) + _queue_memory(data->audio_packet_queue)
+		+ api->godot_pool_byte_array_size(&data->unwrapped_frame)
+		+ _codec_pool_memory(data) + _ahead_memory(data) + _mip_memory(data);
+}
+
+static int _compare_last_visible(const void *a, const void *b) {
+	uint64_t va = (*(videodecoder_data_struct **)a)->last_visible_msec;
+	uint64_t vb = (*(videodecoder_data_struct **)b)->last_visible_msec;
+	return va < vb ? 1 : (va > vb ? -1 : 0);
+}
+
+// Over budget, prepared decoders nobody opened yet are dropped first. Then the
+// instances that were visible most recently keep their queues until the budget
+// runs out, the rest are shrunk. Called from update, at most every BUDGET_CHECK_INTERVAL_MSEC.
+static void _enforce_memory_budget() {
+	if (memory_budget <= 0) {
+		return;
+	}
+	uint64_t now = get_ticks_msec();
+	if (now - budget_check_msec < BUDGET_CHECK_INTERVAL_MSEC) {
+		return;
+	}
+	budget_check_msec = now;
+
+	vd_mutex_lock(&instances_mutex);
+	int nb_instances = 0;
+	int64_t total = 0;
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		nb_instances++;
+		total += _instance_memory(data);
+	}
+	int64_t instances_total = total;
+
+	vd_mutex_lock(&preload_mutex);
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		if (preload_slots[i].state == PRELOAD_READY) {
+			total += _instance_memory(preload_slots[i].data);
+		}
+	}
+	for (int i = 0; i < PRELOAD_POOL_SIZE && total > memory_budget; i++) {
+		preload_slot_t *slot = &preload_slots[i];
+		if (slot->state == PRELOAD_READY && !slot->playlist) {
+			total -= _instance_memory(slot->data);
+			api->godot_print_warning("Memory budget exceeded, dropping a prepared file.", "_enforce_memory_budget()", __FILE__, __LINE__);
+			_preload_slot_clear(slot);
+		}
+	}
+	vd_mutex_unlock(&preload_mutex);
+	// idle decoded frame buffers, held ones are counted per instance. They're only
+	// trimmed when they are what's over, the decoders would allocate them again.
+	int64_t idle = frame_pool_idle_bytes();
+	total += idle;
+	if (idle > 0 && total > memory_budget && total - idle <= memory_budget) {
+		frame_pool_trim();
+		total -= idle;
+	}
+
+	videodecoder_data_struct **sorted = NULL;
+	if (nb_instances > 0) {
+		sorted = (videodecoder_data_struct **)api->godot_alloc(sizeof(videodecoder_data_struct *) * nb_instances);
+	}
+	if (sorted != NULL) {
+		int i = 0;
+		for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+			sorted[i++] = data;
+		}
+		qsort(sorted, nb_instances, sizeof(videodecoder_data_struct *), _compare_last_visible);
+		// prepared files and idle buffers first
+		int64_t used = total - instances_total;
+		for (i = 0; i < nb_instances; i++) {
+			used += _instance_memory(sorted[i]);
+			sorted[i]->mem_shrunk = used > memory_budget;
+			if (!sorted[i]->mem_shrunk) {
+				sorted[i]->mem_trimmed = false;
+			} else if (!sorted[i]->mem_trimmed) {
+				sorted[i]->mem_trimmed = _shrink(sorted[i]);
+			}
+		}
+		api->godot_free(sorted);
+	}
+	vd_mutex_unlock(&instances_mutex);
+}
+
+static void _preload_shutdown() {
+	if (loader != NULL) {
+		worker_destroy(loader);
+		loader = NULL;
+	}
+	if (batch_loader != NULL) {
+		worker_destroy(batch_loader);
+		batch_loader = NULL;
+	}
+	vd_mutex_lock(&preload_mutex);
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		_preload_slot_clear(&preload_slots[i]);
+	}
+	vd_mutex_unlock(&preload_mutex);
+}
+
+/* ---------------------- Atlas ------------------------- */
+
+// Many small videos converted into one RGBA buffer, so the game uploads a single texture.
+// Members are placed on shelves in the order of the instance list, and repacked when one leaves.
+typedef struct atlas_t {
+	godot_int id;
+	int width, height;
+	// what the jobs convert into, open for writing while they run
+	godot_pool_byte_array pixels;
+	godot_pool_byte_array_write_access *write_access;
+	// the pixels of the last finished update, what update_atlas() returns
+	godot_pool_byte_array front;
+	struct atlas_t *next;
+} atlas_t;
+
+// All atlas state is guarded by instances_mutex.
+static atlas_t *atlases = NULL;
+static godot_int atlas_serial = 0;
+// Converts the members of an atlas in parallel.
+static worker_t *converters = NULL;
+#define MAX_CONVERTER_THREADS 8
+
+static atlas_t *_find_atlas(godot_int id) {
+	atlas_t *atlas = atlases;
+	while (atlas != NULL && atlas->id != id) {
+		atlas = atlas->next;
+	}
+	return atlas;
+}
+
+static void _atlas_place(atlas_t *atlas, videodecoder_data_struct *data, int *x, int *y, int *shelf_height, bool *fits) {
+	if (*x + data->out_width > atlas->width) {
+		*x = 0;
+		*y += *shelf_height;
+		*shelf_height = 0;
+	}
+	if (*x + data->out_width > atlas->width || *y + data->out_height > atlas->height) {
+		*fits = false;
+	}
+	data->atlas_x = *x;
+	data->atlas_y = *y;
+	data->atlas_dirty = true;
+	*x += data->out_width;
+	if (data->out_height > *shelf_height) {
+		*shelf_height = data->out_height;
+	}
+}
+
+// Shelf packing of the members of `atlas`, plus `extra` when it isn't NULL. False if they don't fit.
+static bool _atlas_pack(atlas_t *atlas, videodecoder_data_struct *extra) {
+	int x = 0, y = 0, shelf_height = 0;
+	bool fits = true;
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		if (data->atlas == atlas || data == extra) {
+			_atlas_place(atlas, data, &x, &y, &shelf_height, &fits);
+		}
+	}
+	return fits;
+}
+
+static void _atlas_wait_member(videodecoder_data_struct *data) {
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->mutex);
+	while (ahead->atlas_running) {
+		vd_cond_wait(&ahead->cond, &ahead->mutex);
+	}
+	vd_mutex_unlock(&ahead->mutex);
+}
+
+static bool _atlas_busy(atlas_t *atlas) {
+	bool busy = false;
+	for (videodecoder_data_struct *data = instances; data != NULL && !busy; data = data->next_instance) {
+		if (data->atlas == atlas) {
+			vd_mutex_lock(&data->ahead->mutex);
+			busy = data->ahead->atlas_running;
+			vd_mutex_unlock(&data->ahead->mutex);
+		}
+	}
+	return busy;
+}
+
+// Waits for the jobs update_atlas() started and closes the pixels, before members move or leave.
+static void _atlas_wait(atlas_t *atlas) {
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		if (data->atlas == atlas) {
+			_atlas_wait_member(data);
+		}
+	}
+	if (atlas->write_access != NULL) {
+		api->godot_pool_byte_array_write_access_destroy(atlas->write_access);
+		atlas->write_access = NULL;
+	}
+}
+
+// After a repack: the rects that were left or moved would keep their old pixels. Every
+// member is marked dirty by _atlas_place() and redraws its frame.
+static void _atlas_clear(atlas_t *atlas) {
+	godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(&atlas->pixels);
+	memset(api->godot_pool_byte_array_write_access_ptr(write_access), 0, (size_t)atlas->width * atlas->height * 4);
+	api->godot_pool_byte_array_write_access_destroy(write_access);
+}
+
+static bool _atlas_add(atlas_t *atlas, videodecoder_data_struct *data) {
+	if (data->videostream_idx < 0 || data->out_width <= 0) {
+		return false;
+	}
+	if (data->atlas != NULL) {
+		_atlas_remove(data);
+	}
+	// atlas members aren't decoded ahead nor baked
+	_ahead_stop(data);
+	_bake_stop(data);
+	_atlas_wait(atlas);
+	if (!_atlas_pack(atlas, data)) {
+		_atlas_pack(atlas, NULL);
+		return false;
+	}
+	data->atlas = atlas;
+	_atlas_clear(atlas);
+	return true;
+}
+
+static void _atlas_remove(videodecoder_data_struct *data) {
+	atlas_t *atlas = data->atlas;
+	// the destructor already unlinked it from the instances
+	_atlas_wait_member(data);
+	_atlas_wait(atlas);
+	data->atlas = NULL;
+	data->atlas_dst = NULL;
+	_atlas_pack(atlas, NULL);
+	_atlas_clear(atlas);
+}
+
+// Converts the current frame (frame_yuv) straight into the member's rect.
+static void _atlas_draw(videodecoder_data_struct *data) {
+	uint8_t *dst[4] = { data->atlas_dst, NULL, NULL, NULL };
+	int dst_linesize[4] = { data->atlas->width * 4, 0, 0, 0 };
+	_scale_video_frame(data, dst, dst_linesize);
+	data->atlas_dirty = false;
+}
+
+// One member: decodes up to the current time like get_videoframe() does, the frame that's
+// due goes straight into the atlas. Late frames are dropped without a time limit, this
+// isn't the main thread.
+static void _atlas_advance(videodecoder_data_struct *data) {
+	if (_poster_busy(data)) {
+		// its rect keeps the frame from before the seek
+		return;
+	}
+	data->last_visible_msec = get_ticks_msec();
+	if (data->poster_pending) {
+		// decoded by a seek or the preroll, still in frame_yuv
+		data->poster_pending = false;
+		data->atlas_dirty = true;
+		data->total_frame++;
+	}
+	while (!data->frame_unwrapped || data->time >= data->frame_time + data->frame_duration) {
+		if (!_decode_video_frame(data)) {
+			if (data->next_clip >= 0 && data->frame_unwrapped) {
+				// keep the last frame until update() switches to the next clip.
+				data->clip_ended = true;
+			}
+			break;
+		}
+		data->total_frame++;
+		if (_video_frame_time(data) >= data->time - data->diff_tolerance) {
+			_convert_video_frame(data);
+			return;
+		}
+		data->drop_frame++;
+	}
+	if (data->atlas_dirty && data->frame_unwrapped && data->frame_yuv->data[0] != NULL) {
+		_atlas_draw(data);
+	}
+}
+
+static void _atlas_job(void *arg) {
+	videodecoder_data_struct *data = (videodecoder_data_struct *)arg;
+	ahead_queue_t *ahead = data->ahead;
+	vd_mutex_lock(&ahead->pipeline_mutex);
+	_atlas_advance(data);
+	vd_mutex_unlock(&ahead->pipeline_mutex);
+	data->atlas_dst = NULL;
+	vd_mutex_lock(&ahead->mutex);
+	ahead->atlas_running = false;
+	vd_cond_broadcast(&ahead->cond);
+	vd_mutex_unlock(&ahead->mutex);
+}
+
+// Starts bringing every member up to date on the converters and returns the pixels of the
+// previous update (RGBA8, width x height), so the main thread never waits for the jobs.
+// While they still run the same pixels are returned again.
+static godot_pool_byte_array *_atlas_update(atlas_t *atlas) {
+	if (_atlas_busy(atlas)) {
+		return &atlas->front;
+	}
+	if (atlas->write_access != NULL) {
+		_atlas_wait(atlas);
+		api->godot_pool_byte_array_destroy(&atlas->front);
+		api->godot_pool_byte_array_new_copy(&atlas->front, &atlas->pixels);
+	}
+	if (converters == NULL) {
+		int threads = av_cpu_count();
+		converters = worker_create(threads < MAX_CONVERTER_THREADS ? threads : MAX_CONVERTER_THREADS);
+	}
+	atlas->write_access = api->godot_pool_byte_array_write(&atlas->pixels);
+	uint8_t *pixels = api->godot_pool_byte_array_write_access_ptr(atlas->write_access);
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		if (data->atlas != atlas || data->suspended || data->vcodec_ctx == NULL) {
+			continue;
+		}
+		data->atlas_dst = pixels + ((size_t)data->atlas_y * atlas->width + data->atlas_x) * 4;
+		vd_mutex_lock(&data->ahead->mutex);
+		data->ahead->atlas_running = true;
+		vd_mutex_unlock(&data->ahead->mutex);
+		if (converters == NULL || worker_push(converters, _atlas_job, data) != 0) {
+			_atlas_job(data);
+		}
+	}
+	return &atlas->front;
+}
+
+static godot_int _atlas_create(int width, int height) {
+	if (width <= 0 || height <= 0) {
+		return -1;
+	}
+	atlas_t *atlas = (atlas_t *)api->godot_alloc(sizeof(atlas_t));
+	if (atlas == NULL) {
+		return -1;
+	}
+	atlas->id = ++atlas_serial;
+	atlas->width = width;
+	atlas->height = height;
+	api->godot_pool_byte_array_new(&atlas->pixels);
+	api->godot_pool_byte_array_resize(&atlas->pixels, width * height * 4);
+	godot_pool_byte_array_write_access *write_access = api->godot_pool_byte_array_write(&atlas->pixels);
+	memset(api->godot_pool_byte_array_write_access_ptr(write_access), 0, width * height * 4);
+	api->godot_pool_byte_array_write_access_destroy(write_access);
+	api->godot_pool_byte_array_new_copy(&atlas->front, &atlas->pixels);
+	atlas->next = atlases;
+	atlases = atlas;
+	return atlas->id;
+}
+
+static void _atlas_destroy(atlas_t *atlas) {
+	_atlas_wait(atlas);
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		if (data->atlas == atlas) {
+			data->atlas = NULL;
+			data->atlas_dst = NULL;
+		}
+	}
+	atlas_t **link = &atlases;
+	while (*link != atlas) {
+		link = &(*link)->next;
+	}
+	*link = atlas->next;
+	api->godot_pool_byte_array_destroy(&atlas->front);
+	api->godot_pool_byte_array_destroy(&atlas->pixels);
+	api->godot_free(atlas);
+}
+
+static void _atlas_shutdown() {
+	if (converters != NULL) {
+		worker_destroy(converters);
+		converters = NULL;
+	}
+	vd_mutex_lock(&instances_mutex);
+	while (atlases != NULL) {
+		_atlas_destroy(atlases);
+	}
+	vd_mutex_unlock(&instances_mutex);
+}
+
+/* ---------------------- Thumbnails ------------------------- */
+
+// Scrub bar strips and chapter images, made on the batch loader thread with a decoder of their own.
+// Only keyframes are decoded and they are scaled straight to the thumbnail size.
+typedef struct thumbnail_t {
+	double time;
+	godot_pool_byte_array pixels;
+} thumbnail_t;
+
+typedef struct thumbnail_request_t {
+	godot_int handle;
+	bool done;
+	char *path;
+	int width;
+	// 0: keep the video's aspect ratio
+	int height;
+	// the requested times, or one every `every` seconds when it's > 0
+	double *times;
+	int nb_times;
+	double every;
+	thumbnail_t *thumbnails;
+	int nb_thumbnails;
+	struct thumbnail_request_t *next;
+} thumbnail_request_t;
+
+// Guarded by preload_mutex, preload_cond is signaled when a request is done.
+static thumbnail_request_t *thumbnail_requests = NULL;
+static godot_int thumbnail_serial = 0;
+#define MAX_THUMBNAILS 1024
+
+// Decodes the keyframe at or before `time` into data->frame_yuv.
+static bool _thumbnail_decode(videodecoder_data_struct *data, double time) {
+	int64_t start_time = data->format_ctx->start_time != AV_NOPTS_VALUE ? data->format_ctx->start_time : 0;
+	int64_t target = start_time + (int64_t)(time * AV_TIME_BASE);
+	if (avformat_seek_file(data->format_ctx, -1, INT64_MIN, target, target, 0) < 0) {
+		return false;
+	}
+	avcodec_flush_buffers(data->vcodec_ctx);
+	AVPacket pkt;
+	while (av_read_frame(data->format_ctx, &pkt) >= 0) {
+		bool key = pkt.stream_index == data->videostream_idx && (pkt.flags & AV_PKT_FLAG_KEY);
+		int ret = key ? avcodec_send_packet(data->vcodec_ctx, &pkt) : 0;
+		av_packet_unref(&pkt);
+		if (!key || ret < 0) {
+			continue;
+		}
+		// drain, so the keyframe comes out without waiting for the frames after it.
+		avcodec_send_packet(data->vcodec_ctx, NULL);
+		ret = avcodec_receive_frame(data->vcodec_ctx, data->frame_yuv);
+		avcodec_flush_buffers(data->vcodec_ctx);
+		if (ret >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void _thumbnail_extract(thumbnail_request_t *req, videodecoder_data_struct *data) {
+	// only the video stream is demuxed, and only its keyframes are decoded.
+	_close_audio_codec(data);
+	data->audiostream_idx = -1;
+	_update_discard(data);
+	data->vcodec_ctx->skip_frame = AVDISCARD_NONKEY;
+	// blocking is invisible once scaled down
+	data->vcodec_ctx->skip_loop_filter = AVDISCARD_ALL;
+
+	if (req->height <= 0) {
+		int crop_width, crop_height;
+		_crop_size(data, &crop_width, &crop_height);
+		data->out_width = req->width;
+		data->out_height = FFMAX(1, req->width * crop_height / FFMAX(1, crop_width));
+		if (!_alloc_video_buffers(data)) {
+			return;
+		}
+	}
+	if (req->every > 0) {
+		double length = _avtime_to_sec(data->format_ctx->duration);
+		int count = length > 0 ? (int)ceil(length / req->every) : 1;
+		count = FFMIN(FFMAX(count, 1), MAX_THUMBNAILS);
+		req->times = (double *)api->godot_alloc(sizeof(double) * count);
+		if (req->times == NULL) {
+			return;
+		}
+		for (int i = 0; i < count; i++) {
+			req->times[i] = i * req->every;
+		}
+		req->nb_times = count;
+	}
+	req->thumbnails = (thumbnail_t *)api->godot_alloc(sizeof(thumbnail_t) * FFMAX(req->nb_times, 1));
+	if (req->thumbnails == NULL) {
+		return;
+	}
+	for (int i = 0; i < req->nb_times; i++) {
+		if (!_thumbnail_decode(data, req->times[i])) {
+			continue;
+		}
+		thumbnail_t *thumb = &req->thumbnails[req->nb_thumbnails];
+		thumb->time = _video_frame_time(data);
+		thumbnail_t *prev = req->nb_thumbnails > 0 ? thumb - 1 : NULL;
+		if (prev != NULL && prev->time == thumb->time) {
+			// same keyframe as the previous time
+			api->godot_pool_byte_array_new_copy(&thumb->pixels, &prev->pixels);
+		} else {
+			api->godot_pool_byte_array_new(&thumb->pixels);
+			_scale_video_frame(data, data->frame_rgb->data, data->frame_rgb->linesize);
+			_unwrap_video_frame(&thumb->pixels, data->frame_rgb, data->out_width, data->out_height);
+		}
+		req->nb_thumbnails++;
+	}
+}
+
+static void _thumbnail_job(void *arg) {
+	thumbnail_request_t *req = (thumbnail_request_t *)arg;
+	videodecoder_data_struct *data = godot_videodecoder_constructor(NULL);
+	data->options.audio_only = GODOT_FALSE;
+	data->options.loop = GODOT_FALSE;
+	data->options.live = GODOT_FALSE;
+	data->options.offline = GODOT_FALSE;
+	// every keyframe seek would read a whole chunk
+	data->options.io_chunk_size = 0;
+	data->options.io_buffer_size = MIN_IO_BUFFER_SIZE;
+	if (req->height > 0) {
+		data->out_width = req->width;
+		data->out_height = req->height;
+	}
+
+	gdfile_t *file = gdfile_open(req->path);
+	if (file != NULL && _open_stream(data, file, gdfile_read, gdfile_seek) && data->videostream_idx >= 0) {
+		_thumbnail_extract(req, data);
+	} else {
+		char msg[512] = {0};
+		snprintf(msg, sizeof(msg) - 1, "Unable to open the video of %s", req->path);
+		api->godot_print_error(msg, "_thumbnail_job()", __FILE__, __LINE__);
+	}
+	_free_data(data);
+	gdfile_close(file);
+
+	vd_mutex_lock(&preload_mutex);
+	req->done = true;
+	vd_cond_broadcast(&preload_cond);
+	vd_mutex_unlock(&preload_mutex);
+}
+
+// Takes ownership of `times`. Returns a handle, or -1.
+static godot_int _thumbnail_start(const char *path, double *times, int nb_times, double every, int width, int height) {
+	gdfile_init();
+	if (batch_loader == NULL) {
+		batch_loader = worker_create(1);
+	}
+	thumbnail_request_t *req = (thumbnail_request_t *)api->godot_alloc(sizeof(thumbnail_request_t));
+	if (batch_loader == NULL || req == NULL) {
+		if (req != NULL) {
+			api->godot_free(req);
+		}
+		if (times != NULL) {
+			api->godot_free(times);
+		}
+		return -1;
+	}
+	memset(req, 0, sizeof(thumbnail_request_t));
+	req->path = (char *)api->godot_alloc(strlen(path) + 1);
+	strcpy(req->path, path);
+	req->width = width;
+	req->height = height;
+	req->times = times;
+	req->nb_times = nb_times;
+	req->every = every;
+
+	vd_mutex_lock(&preload_mutex);
+	req->handle = ++thumbnail_serial;
+	req->next = thumbnail_requests;
+	thumbnail_requests = req;
+	godot_int handle = req->handle;
+	vd_mutex_unlock(&preload_mutex);
+
+	worker_push(batch_loader, _thumbnail_job, req);
+	return handle;
+}
+
+// Call with preload_mutex held.
+static thumbnail_request_t *_thumbnail_find(godot_int handle) {
+	thumbnail_request_t *req = thumbnail_requests;
+	while (req != NULL && req->handle != handle) {
+		req = req->next;
+	}
+	return req;
+}
+
+// Call with preload_mutex held, once the request is done.
+static void _thumbnail_free(thumbnail_request_t *req) {
+	thumbnail_request_t **link = &thumbnail_requests;
+	while (*link != req) {
+		link = &(*link)->next;
+	}
+	*link = req->next;
+	for (int i = 0; i < req->nb_thumbnails; i++) {
+		api->godot_pool_byte_array_destroy(&req->thumbnails[i].pixels);
+	}
+	if (req->thumbnails != NULL) {
+		api->godot_free(req->thumbnails);
+	}
+	if (req->times != NULL) {
+		api->godot_free(req->times);
+	}
+	api->godot_free(req->path);
+	api->godot_free(req);
+}
+
+// After the loader is gone, every request is done.
+static void _thumbnail_shutdown() {
+	vd_mutex_lock(&preload_mutex);
+	while (thumbnail_requests != NULL) {
+		_thumbnail_free(thumbnail_requests);
+	}
+	vd_mutex_unlock(&preload_mutex);
+}
+
+/* ---------------------- Compressed clips ------------------------- */
+
+// UI loops that play all the time: compress_clip() decodes a clip once on the batch loader thread
+// and writes its frames BC1 compressed to a sidecar file. open_compressed() maps that file
+// and get_compressed_frame() copies a frame out of it, no decoding or conversion, and an
+// eighth of the bytes of RGBA8 to upload.
+#define SIDECAR_MAGIC "VDBC"
+#define SIDECAR_VERSION 1
+#define SIDECAR_FORMAT_BC1 1
+// Image.FORMAT_DXT1
+#define IMAGE_FORMAT_DXT1 17
+#define MAX_COMPRESSED_SIZE 16384
+
+// In the byte order of the machine that wrote it.
+typedef struct sidecar_header_t {
+	char magic[4];
+	uint32_t version;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t nb_frames;
+	// frames follow each other from frames_offset
+	uint32_t frame_size;
+	// of the source file, see _probe_key()
+	uint32_t probe_hash;
+	int64_t file_len;
+	int64_t frames_offset;
+	// nb_frames sidecar_frame_t
+	int64_t index_offset;
+	double duration;
+} sidecar_header_t;
+
+typedef struct sidecar_frame_t {
+	// from the first frame
+	double time;
+	double duration;
+} sidecar_frame_t;
+
+typedef struct compress_request_t {
+	godot_int handle;
+	bool done;
+	godot_error result;
+	char *path;
+	// OS path, the batch loader thread can't ask ProjectSettings
+	char *sidecar_path;
+	// 0: the size of the video
+	int width;
+	int height;
+	struct compress_request_t *next;
+} compress_request_t;
+
+// Guarded by preload_mutex like the thumbnail requests.
+static compress_request_t *compress_requests = NULL;
+static godot_int compress_serial = 0;
+
+typedef struct compressed_clip_t {
+	godot_int handle;
+	mapfile_t *map;
+	const sidecar_header_t *header;
+	const sidecar_frame_t *frames;
+	struct compressed_clip_t *next;
+} compressed_clip_t;
+
+// Guarded by instances_mutex like the atlases.
+static compressed_clip_t *compressed_clips = NULL;
+static godot_int compressed_serial = 0;
+
+// The next frame of the clip into data->frame_yuv, the codec is drained at the end of the file.
+static bool _compress_decode(videodecoder_data_struct *data, bool *draining) {
+	if (!*draining) {
+		if (_decode_video_frame(data)) {
+			return true;
+		}
+		*draining = true;
+		avcodec_send_packet(data->vcodec_ctx, NULL);
+	}
+	return avcodec_receive_frame(data->vcodec_ctx, data->frame_yuv) >= 0;
+}
+
+// Writes "<sidecar_path>.tmp" and renames it, so a sidecar is either whole or missing.
+// OS paths are UTF-8 (see gdfile_globalize_path()), the narrow calls on Windows take the ANSI code page.
+static FILE *_os_fopen_write(const char *path) {
+#ifdef _WIN32
+	wchar_t wpath[MAX_PATH];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH) == 0) {
+		return NULL;
+	}
+	return _wfopen(wpath, L"wb");
+#else
+	return fopen(path, "wb");
+#endif
+}
+
+// Atomically replaces `to` with `from`.
+static bool _os_replace(const char *from, const char *to) {
+#ifdef _WIN32
+	wchar_t wfrom[MAX_PATH], wto[MAX_PATH];
+	if (MultiByteToWideChar(CP_UTF8, 0, from, -1, wfrom, MAX_PATH) == 0
+			|| MultiByteToWideChar(CP_UTF8, 0, to, -1, wto, MAX_PATH) == 0) {
+		return false;
+	}
+	return MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+static void _os_remove(const char *path) {
+#ifdef _WIN32
+	wchar_t wpath[MAX_PATH];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH) != 0) {
+		DeleteFileW(wpath);
+	}
+#else
+	remove(path);
+#endif
+}
+
+static godot_error _compress_write(compress_request_t *req, videodecoder_data_struct *data, int64_t file_len, uint32_t probe_hash) {
+	sidecar_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SIDECAR_MAGIC, 4);
+	header.version = SIDECAR_VERSION;
+	header.format = SIDECAR_FORMAT_BC1;
+	header.width = data->out_width;
+	header.height = data->out_height;
+	header.frame_size = bcn_bc1_size(data->out_width, data->out_height);
+	header.probe_hash = probe_hash;
+	header.file_len = file_len;
+	header.frames_offset = sizeof(sidecar_header_t);
+
+	size_t tmp_path_len = strlen(req->sidecar_path) + 5;
+	char *tmp_path = (char *)api->godot_alloc(tmp_path_len);
+	uint8_t *blocks = (uint8_t *)api->godot_alloc(header.frame_size);
+	sidecar_frame_t *index = NULL;
+	uint32_t index_capacity = 0;
+	FILE *f = NULL;
+	godot_error err = GODOT_OK;
+	if (tmp_path == NULL || blocks == NULL) {
+		err = GODOT_ERR_OUT_OF_MEMORY;
+	} else {
+		snprintf(tmp_path, tmp_path_len, "%s.tmp", req->sidecar_path);
+		f = _os_fopen_write(tmp_path);
+		if (f == NULL || fwrite(&header, sizeof(header), 1, f) != 1) {
+			err = GODOT_ERR_FILE_CANT_WRITE;
+		}
+	}
+
+	double start_time = NAN;
+	bool draining = false;
+	while (err == GODOT_OK && _compress_decode(data, &draining)) {
+		if (header.nb_frames == index_capacity) {
+			index_capacity = FFMAX(index_capacity * 2, 256);
+			sidecar_frame_t *grown = (sidecar_frame_t *)api->godot_realloc(index, sizeof(sidecar_frame_t) * index_capacity);
+			if (grown == NULL) {
+				err = GODOT_ERR_OUT_OF_MEMORY;
+				break;
+			}
+			index = grown;
+		}
+		double time = _video_frame_time(data);
+		if (isnan(start_time)) {
+			start_time = time;
+		}
+		_scale_video_frame(data, data->frame_rgb->data, data->frame_rgb->linesize);
+		bcn_bc1_encode(data->frame_rgb->data[0], data->frame_rgb->linesize[0], data->out_width, data->out_height, blocks);
+		if (fwrite(blocks, header.frame_size, 1, f) != 1) {
+			err = GODOT_ERR_FILE_CANT_WRITE;
+			break;
+		}
+		index[header.nb_frames].time = FFMAX(time - start_time, 0);
+		index[header.nb_frames].duration = _video_frame_duration(data);
+		header.nb_frames++;
+	}
+	if (err == GODOT_OK && header.nb_frames == 0) {
+		err = GODOT_ERR_FILE_CORRUPT;
+	}
+	if (err == GODOT_OK) {
+		const sidecar_frame_t *last = &index[header.nb_frames - 1];
+		header.duration = last->time + last->duration;
+		header.index_offset = header.frames_offset + (int64_t)header.nb_frames * header.frame_size;
+		if (fwrite(index, sizeof(sidecar_frame_t), header.nb_frames, f) != header.nb_frames
+				|| fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, f) != 1) {
+			err = GODOT_ERR_FILE_CANT_WRITE;
+		}
+	}
+	if (f != NULL && fclose(f) != 0 && err == GODOT_OK) {
+		err = GODOT_ERR_FILE_CANT_WRITE;
+	}
+	if (err == GODOT_OK) {
+		if (!_os_replace(tmp_path, req->sidecar_path)) {
+			err = GODOT_ERR_FILE_CANT_WRITE;
+		}
+	}
+	if (err != GODOT_OK && f != NULL) {
+		_os_remove(tmp_path);
+	}
+	if (index != NULL) {
+		api->godot_free(index);
+	}
+	if (blocks != NULL) {
+		api->godot_free(blocks);
+	}
+	if (tmp_path != NULL) {
+		api->godot_free(tmp_path);
+	}
+	return err;
+}
+
+static void _compress_job(void *arg) {
+	compress_request_t *req = (compress_request_t *)arg;
+	videodecoder_data_struct *data = godot_videodecoder_constructor(NULL);
+	data->options.audio_only = GODOT_FALSE;
+	data->options.loop = GODOT_FALSE;
+	data->options.live = GODOT_FALSE;
+	data->options.offline = GODOT_FALSE;
+	// no chunk reads holding the io scheduler for the players
+	data->options.io_chunk_size = 0;
+	data->options.io_buffer_size = MIN_IO_BUFFER_SIZE;
+	if (req->width > 0 && req->height > 0) {
+		data->out_width = req->width;
+		data->out_height = req->height;
+	}
+
+	godot_error err = GODOT_ERR_FILE_CANT_OPEN;
+	gdfile_t *file = gdfile_open(req->path);
+	if (file != NULL) {
+		int64_t file_len;
+		uint32_t probe_hash;
+		_probe_key(file, gdfile_read, gdfile_seek, &file_len, &probe_hash);
+		if (_open_stream(data, file, gdfile_read, gdfile_seek) && data->videostream_idx >= 0) {
+			// only the video stream is demuxed
+			_close_audio_codec(data);
+			data->audiostream_idx = -1;
+			_update_discard(data);
+			err = _compress_write(req, data, file_len, probe_hash);
+		}
+	}
+	if (err != GODOT_OK) {
+		char msg[512] = {0};
+		snprintf(msg, sizeof(msg) - 1, "Unable to compress %s into %s (error %d)", req->path, req->sidecar_path, err);
+		api->godot_print_error(msg, "_compress_job()", __FILE__, __LINE__);
+	}
+	_free_data(data);
+	gdfile_close(file);
+
+	vd_mutex_lock(&preload_mutex);
+	req->result = err;
+	req->done = true;
+	vd_cond_broadcast(&preload_cond);
+	vd_mutex_unlock(&preload_mutex);
+}
+
+// Returns a handle, or -1.
+static godot_int _compress_start(const char *path, const char *sidecar_path, int width, int height) {
+	gdfile_init();
+	if (batch_loader == NULL) {
+		batch_loader = worker_create(1);
+	}
+	char *os_path = gdfile_globalize_path(sidecar_path);
+	compress_request_t *req = (compress_request_t *)api->godot_alloc(sizeof(compress_request_t));
+	if (batch_loader == NULL || os_path == NULL || req == NULL) {
+		if (os_path != NULL) {
+			api->godot_free(os_path);
+		}
+		if (req != NULL) {
+			api->godot_free(req);
+		}
+		return -1;
+	}
+	memset(req, 0, sizeof(compress_request_t));
+	req->path = (char *)api->godot_alloc(strlen(path) + 1);
+	strcpy(req->path, path);
+	req->sidecar_path = os_path;
+	req->width = width;
+	req->height = height;
+
+	vd_mutex_lock(&preload_mutex);
+	req->handle = ++compress_serial;
+	req->next = compress_requests;
+	compress_requests = req;
+	godot_int handle = req->handle;
+	vd_mutex_unlock(&preload_mutex);
+
+	worker_push(batch_loader, _compress_job, req);
+	return handle;
+}
+
+// Call with preload_mutex held.
+static compress_request_t *_compress_find(godot_int handle) {
+	compress_request_t *req = compress_requests;
+	while (req != NULL && req->handle != handle) {
+		req = req->next;
+	}
+	return req;
+}
+
+// Call with preload_mutex held, once the request is done.
+static void _compress_free(compress_request_t *req) {
+	compress_request_t **link = &compress_requests;
+	while (*link != req) {
+		link = &(*link)->next;
+	}
+	*link = req->next;
+	api->godot_free(req->sidecar_path);
+	api->godot_free(req->path);
+	api->godot_free(req);
+}
+
+static bool _compressed_valid(const mapfile_t *map) {
+	const sidecar_header_t *header = (const sidecar_header_t *)map->data;
+	if (map->size < (int64_t)sizeof(sidecar_header_t) || memcmp(header->magic, SIDECAR_MAGIC, 4) != 0
+			|| header->version != SIDECAR_VERSION || header->format != SIDECAR_FORMAT_BC1) {
+		return false;
+	}
+	if (header->width == 0 || header->height == 0 || header->width > MAX_COMPRESSED_SIZE || header->height > MAX_COMPRESSED_SIZE
+			|| header->frame_size != (uint32_t)bcn_bc1_size(header->width, header->height) || header->nb_frames == 0
+			|| !(header->duration > 0)) {
+		return false;
+	}
+	// the offsets come from the file: compared against what's left of it, nothing can overflow
+	int64_t frames_offset = header->frames_offset, index_offset = header->index_offset;
+	if (frames_offset < (int64_t)sizeof(sidecar_header_t) || frames_offset > map->size
+			|| header->nb_frames > (map->size - frames_offset) / header->frame_size) {
+		return false;
+	}
+	int64_t frames_end = frames_offset + (int64_t)header->nb_frames * header->frame_size;
+	return index_offset >= frames_end && index_offset <= map->size && index_offset % sizeof(double) == 0
+			&& header->nb_frames <= (map->size - index_offset) / (int64_t)sizeof(sidecar_frame_t);
+}
+
+// Maps a sidecar written by compress_clip(). With a `source_path`, only if it was made from
+// that file as it is now. Returns a handle, or -1.
+static godot_int _compressed_open(const char *sidecar_path, const char *source_path) {
+	gdfile_init();
+	char *os_path = gdfile_globalize_path(sidecar_path);
+	mapfile_t *map = os_path != NULL ? mapfile_open(os_path) : NULL;
+	if (os_path != NULL) {
+		api->godot_free(os_path);
+	}
+	bool valid = map != NULL && _compressed_valid(map);
+	if (valid && source_path != NULL && source_path[0] != 0) {
+		const sidecar_header_t *header = (const sidecar_header_t *)map->data;
+		int64_t file_len = -1;
+		uint32_t probe_hash = 0;
+		gdfile_t *source = gdfile_open(source_path);
+		if (source != NULL) {
+			_probe_key(source, gdfile_read, gdfile_seek, &file_len, &probe_hash);
+			gdfile_close(source);
+		}
+		valid = file_len == header->file_len && probe_hash == header->probe_hash;
+	}
+	compressed_clip_t *clip = valid ? (compressed_clip_t *)api->godot_alloc(sizeof(compressed_clip_t)) : NULL;
+	if (clip == NULL) {
+		mapfile_close(map);
+		return -1;
+	}
+	clip->map = map;
+	clip->header = (const sidecar_header_t *)map->data;
+	clip->frames = (const sidecar_frame_t *)(map->data + clip->header->index_offset);
+
+	vd_mutex_lock(&instances_mutex);
+	clip->handle = ++compressed_serial;
+	clip->next = compressed_clips;
+	compressed_clips = clip;
+	godot_int handle = clip->handle;
+	vd_mutex_unlock(&instances_mutex);
+	return handle;
+}
+
+// Call with instances_mutex held.
+static compressed_clip_t *_compressed_find(godot_int handle) {
+	compressed_clip_t *clip = compressed_clips;
+	while (clip != NULL && clip->handle != handle) {
+		clip = clip->next;
+	}
+	return clip;
+}
+
+// Call with instances_mutex held.
+static void _compressed_close(compressed_clip_t *clip) {
+	compressed_clip_t **link = &compressed_clips;
+	while (*link != clip) {
+		link = &(*link)->next;
+	}
+	*link = clip->next;
+	mapfile_close(clip->map);
+	api->godot_free(clip);
+}
+
+// The frame shown `time` seconds after the first one, wrapped around or held at the ends.
+static int _compressed_frame_at(const compressed_clip_t *clip, double time, bool loop) {
+	const sidecar_header_t *header = clip->header;
+	if (loop) {
+		time = fmod(time, header->duration);
+		if (time < 0) {
+			time += header->duration;
+		}
+	}
+	int lo = 0, hi = header->nb_frames - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (clip->frames[mid].time <= time) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+// After the loader is gone, every request is done.
+static void _compress_shutdown() {
+	vd_mutex_lock(&preload_mutex);
+	while (compress_requests != NULL) {
+		_compress_free(compress_requests);
+	}
+	vd_mutex_unlock(&preload_mutex);
+	vd_mutex_lock(&instances_mutex);
+	while (compressed_clips != NULL) {
+		_compressed_close(compressed_clips);
+	}
+	vd_mutex_unlock(&instances_mutex);
+}
+
+/* ---------------------- NativeScript ------------------------- */
+
+// VideoDecoderServer exposes the parts of the plugin that don't fit
+// the VideoStreamGDNative interface. It is stateless, all instances share the same data.
+
+static const char *server_class_name = "VideoDecoderServer";
+
+static void *server_constructor(godot_object *p_instance, void *p_method_data) {
+	return NULL;
+}
+
+static void server_destructor(godot_object *p_instance, void *p_method_data, void *p_user_data) {
+}
+
+static int64_t _arg_int(godot_variant **p_args, int p_num_args, int idx, int64_t def) {
+	return idx < p_num_args ? api->godot_variant_as_int(p_args[idx]) : def;
+}
+
+// Returns a godot_alloc'ed utf8 copy of the argument, or NULL.
+static char *_arg_string(godot_variant **p_args, int p_num_args, int idx) {
+	if (idx >= p_num_args) {
+		return NULL;
+	}
+	godot_string g_str = api->godot_variant_as_string(p_args[idx]);
+	godot_char_string c_str = api->godot_string_utf8(&g_str);
+	const char *chars = api->godot_char_string_get_data(&c_str);
+	char *str = (char *)api->godot_alloc(strlen(chars) + 1);
+	strcpy(str, chars);
+	api->godot_char_string_destroy(&c_str);
+	api->godot_string_destroy(&g_str);
+	return str;
+}
+
+static godot_variant server_prepare(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	char *path = _arg_string(p_args, p_num_args, 0);
+	api->godot_variant_new_int(&ret, path != NULL ? videodecoder_prepare(path) : -1);
+	if (path != NULL) {
+		api->godot_free(path);
+	}
+	return ret;
+}
+
+static godot_variant server_is_prepared(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, videodecoder_is_prepared(_arg_int(p_args, p_num_args, 0, -1)));
+	return ret;
+}
+
+static godot_variant server_release(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	videodecoder_release(_arg_int(p_args, p_num_args, 0, -1));
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
+
+// Call with instances_mutex held.
+static videodecoder_data_struct *_find_instance(godot_int id) {
+	videodecoder_data_struct *data = instances;
+	while (data != NULL && data->id != id) {
+		data = data->next_instance;
+	}
+	return data;
+}
+
+// id of the decoder that most recently opened a file, e.g. right after assigning VideoPlayer.stream
+static godot_variant server_get_last_instance_id(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, last_instance_id);
+	return ret;
+}
+
+static godot_variant server_get_instance_ids(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_array ids;
+	api->godot_array_new(&ids);
+	vd_mutex_lock(&instances_mutex);
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		godot_variant id;
+		api->godot_variant_new_int(&id, data->id);
+		api->godot_array_append(&ids, &id);
+		api->godot_variant_destroy(&id);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_array(&ret, &ids);
+	api->godot_array_destroy(&ids);
+	return ret;
+}
+
+// false if the last get_videoframe() returned the same image as the one before, so uploading it can be skipped.
+static godot_variant server_is_frame_changed(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	api->godot_variant_new_bool(&ret, data != NULL && data->frame_changed);
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
+}
+
+static enum AVMediaType _arg_media_type(godot_variant **p_args, int p_num_args, int idx) {
+	char *type_name = _arg_string(p_args, p_num_args, idx);
+	enum AVMediaType type = AVMEDIA_TYPE_UNKNOWN;
+	if (type_name != NULL) {
+		if (strcmp(type_name, "video") == 0) {
+			type = AVMEDIA_TYPE_VIDEO;
+		} else if (strcmp(type_name, "audio") == 0) {
+			type = AVMEDIA_TYPE_AUDIO;
+		}
+		api->godot_free(type_name);
+	}
+	return type;
+}
+
+static void _dict_set_int(godot_dictionary *dict, const char *key, int64_t value) {
+	godot_string g_key = api->godot_string_chars_to_utf8(key);
+	godot_variant v_key, v_value;
+	api->godot_variant_new_string(&v_key, &g_key);
+	api->godot_variant_new_int(&v_value, value);
+	api->godot_dictionary_set(dict, &v_key, &v_value);
+	api->godot_variant_destroy(&v_value);
+	api->godot_variant_destroy(&v_key);
+	api->godot_string_destroy(&g_key);
+}
+
+static void _dict_set_real(godot_dictionary *dict, const char *key, double value) {
+	godot_string g_key = api->godot_string_chars_to_utf8(key);
+	godot_variant v_key, v_value;
+	api->godot_variant_new_string(&v_key, &g_key);
+	api->godot_variant_new_real(&v_value, value);
+	api->godot_dictionary_set(dict, &v_key, &v_value);
+	api->godot_variant_destroy(&v_value);
+	api->godot_variant_destroy(&v_key);
+	api->godot_string_destroy(&g_key);
+}
+
+static void _dict_set_string(godot_dictionary *dict, const char *key, const char *value) {
+	godot_string g_key = api->godot_string_chars_to_utf8(key);
+	godot_string g_value = api->godot_string_chars_to_utf8(value);
+	godot_variant v_key, v_value;
+	api->godot_variant_new_string(&v_key, &g_key);
+	api->godot_variant_new_string(&v_value, &g_value);
+	api->godot_dictionary_set(dict, &v_key, &v_value);
+	api->godot_variant_destroy(&v_value);
+	api->godot_variant_destroy(&v_key);
+	api->godot_string_destroy(&g_value);
+	api->godot_string_destroy(&g_key);
+}
+
+// [{type, track, codec, language, selected}, ...] for the audio and video streams of an instance.
+static godot_variant server_get_tracks(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_array tracks;
+	api->godot_array_new(&tracks);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->format_ctx != NULL) {
+		int nth_video = 0, nth_audio = 0;
+		for (int i = 0; i < data->format_ctx->nb_streams; i++) {
+			AVStream *stream = data->format_ctx->streams[i];
+			enum AVMediaType type = stream->codecpar->codec_type;
+			if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+				continue;
+			}
+			const AVCodecDescriptor *desc = avcodec_descriptor_get(stream->codecpar->codec_id);
+			AVDictionaryEntry *language = av_dict_get(stream->metadata, "language", NULL, 0);
+			godot_dictionary track;
+			api->godot_dictionary_new(&track);
+			_dict_set_string(&track, "type", type == AVMEDIA_TYPE_VIDEO ? "video" : "audio");
+			_dict_set_int(&track, "track", type == AVMEDIA_TYPE_VIDEO ? nth_video++ : nth_audio++);
+			_dict_set_string(&track, "codec", desc != NULL ? desc->name : "");
+			_dict_set_string(&track, "language", language != NULL ? language->value : "");
+			_dict_set_int(&track, "selected", i == data->videostream_idx || i == data->audiostream_idx);
+			godot_variant v_track;
+			api->godot_variant_new_dictionary(&v_track, &track);
+			api->godot_array_append(&tracks, &v_track);
+			api->godot_variant_destroy(&v_track);
+			api->godot_dictionary_destroy(&track);
+		}
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_array(&ret, &tracks);
+	api->godot_array_destroy(&tracks);
+	return ret;
+}
+
+// select_track(id, "audio" or "video", track), track counts streams of that type from 0.
+static godot_variant server_select_track(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_bool ok = GODOT_FALSE;
+	enum AVMediaType type = _arg_media_type(p_args, p_num_args, 1);
+	int track = _arg_int(p_args, p_num_args, 2, 0);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->format_ctx != NULL) {
+		int stream_idx = _find_stream(data, type, track);
+		if (stream_idx >= 0) {
+			if (type == AVMEDIA_TYPE_AUDIO) {
+				data->audio_track = track;
+			}
+			ok = _select_stream(data, type, stream_idx);
+		}
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ok);
+	return ret;
+}
+
+// {io, video, audio, queues, frame, codec_pools, pooled_frames, decode_ahead, mipmaps, bake, total, shrunk}
+// in bytes, the audio part of codec_pools is an estimate. pooled_frames counts the decoded frames held.
+// bake is shared with the other instances playing the file and isn't part of total.
+static godot_variant server_get_memory_usage(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_dictionary usage;
+	api->godot_dictionary_new(&usage);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		_dict_set_int(&usage, "io", data->mem.bytes[MEM_IO]);
+		_dict_set_int(&usage, "video", data->mem.bytes[MEM_VIDEO]);
+		_dict_set_int(&usage, "audio", data->mem.bytes[MEM_AUDIO]);
+		_dict_set_int(&usage, "queues", _queue_memory(data->video_packet_queue) + _queue_memory(data->audio_packet_queue));
+		_dict_set_int(&usage, "frame", api->godot_pool_byte_array_size(&data->unwrapped_frame));
+		_dict_set_int(&usage, "codec_pools", _codec_pool_memory(data));
+		_dict_set_int(&usage, "pooled_frames", data->vcodec_ctx != NULL ? frame_pool_codec_frames(data->vcodec_ctx) : 0);
+		_dict_set_int(&usage, "decode_ahead", _ahead_memory(data));
+		_dict_set_int(&usage, "mipmaps", _mip_memory(data));
+		_dict_set_int(&usage, "bake", _bake_memory(data));
+		_dict_set_int(&usage, "total", _instance_memory(data));
+		_dict_set_int(&usage, "shrunk", data->mem_shrunk);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &usage);
+	api->godot_dictionary_destroy(&usage);
+	return ret;
+}
+
+// Bytes of all io, frame and audio buffers of the process, including prepared files, the frame pools and the bakes.
+static godot_variant server_get_memory_total(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, vd_atomic_add(&mem_total_bytes, 0) + frame_pool_total_bytes() + vd_atomic_add(&bake_total_bytes, 0));
+	return ret;
+}
+
+static godot_variant server_set_memory_budget(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	memory_budget = _arg_int(p_args, p_num_args, 0, 0);
+	budget_check_msec = 0;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
+
+static godot_variant server_get_memory_budget(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, memory_budget);
+	return ret;
+}
+
+// get_stats(id): what the instance did so far and what it holds right now.
+static godot_variant server_get_stats(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_dictionary stats;
+	api->godot_dictionary_new(&stats);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		_dict_set_int(&stats, "frames", data->total_frame);
+		_dict_set_int(&stats, "dropped_frames", data->drop_frame);
+		_dict_set_int(&stats, "repeated_frames", data->repeat_frame);
+		_dict_set_int(&stats, "trimmed_packets", data->trimmed_packets);
+		_dict_set_int(&stats, "video_packets", data->video_packet_queue != NULL ? data->video_packet_queue->nb_packets : 0);
+		_dict_set_int(&stats, "audio_packets", data->audio_packet_queue != NULL ? data->audio_packet_queue->nb_packets : 0);
+		_dict_set_int(&stats, "decoder_threads", data->vcodec_ctx != NULL ? data->vcodec_ctx->thread_count : 0);
+		_dict_set_int(&stats, "mix_rate", data->acodec_ctx != NULL ? data->audio_mix_rate : 0);
+		_dict_set_int(&stats, "io_buffer_size", data->io_buffer_size);
+		_dict_set_real(&stats, "time", data->time);
+		_dict_set_real(&stats, "frame_time", isnan(data->frame_time) ? -1 : data->frame_time);
+		_dict_set_int(&stats, "suspended", data->suspended);
+		_dict_set_int(&stats, "shrunk", data->mem_shrunk);
+		_dict_set_int(&stats, "baking", data->bake_recording);
+		_dict_set_int(&stats, "baked", data->bake_serving);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &stats);
+	api->godot_dictionary_destroy(&stats);
+	return ret;
+}
+
+// get_global_stats(): totals over every decoder of the process.
+static godot_variant server_get_global_stats(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_dictionary stats;
+	api->godot_dictionary_new(&stats);
+	int64_t count = 0, frames = 0, dropped = 0;
+	vd_mutex_lock(&instances_mutex);
+	for (videodecoder_data_struct *data = instances; data != NULL; data = data->next_instance) {
+		count++;
+		frames += data->total_frame;
+		dropped += data->drop_frame;
+	}
+	vd_mutex_unlock(&instances_mutex);
+	int64_t prepared = 0;
+	vd_mutex_lock(&preload_mutex);
+	for (int i = 0; i < PRELOAD_POOL_SIZE; i++) {
+		prepared += preload_slots[i].state != PRELOAD_EMPTY;
+	}
+	vd_mutex_unlock(&preload_mutex);
+	_dict_set_int(&stats, "instances", count);
+	_dict_set_int(&stats, "frames", frames);
+	_dict_set_int(&stats, "dropped_frames", dropped);
+	_dict_set_int(&stats, "prepared", prepared);
+	int64_t baked = 0;
+	vd_mutex_lock(&bake_mutex);
+	for (bake_t *bake = bakes; bake != NULL; bake = bake->next) {
+		baked += bake->state == BAKE_READY;
+	}
+	vd_mutex_unlock(&bake_mutex);
+	_dict_set_int(&stats, "pending_teardowns", vd_atomic_add(&teardown_pending, 0));
+	_dict_set_int(&stats, "baked_clips", baked);
+	_dict_set_int(&stats, "memory_total", vd_atomic_add(&mem_total_bytes, 0) + frame_pool_total_bytes() + vd_atomic_add(&bake_total_bytes, 0));
+	_dict_set_int(&stats, "frame_pool_bytes", frame_pool_total_bytes());
+	_dict_set_int(&stats, "bake_bytes", vd_atomic_add(&bake_total_bytes, 0));
+	_dict_set_int(&stats, "memory_budget", memory_budget);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &stats);
+	api->godot_dictionary_destroy(&stats);
+	return ret;
+}
+
+// set_io_bandwidth(bytes_per_second): cap for reading ahead, 0 (the default) for none.
+// Instances about to run out of packets read anyway.
+static godot_variant server_set_io_bandwidth(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	io_sched_set_bandwidth(_arg_int(p_args, p_num_args, 0, 0));
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
+
+static godot_variant server_get_io_bandwidth(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, io_sched_get_bandwidth());
+	return ret;
+}
+
+static godot_variant server_get_io_stats(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	io_sched_stats_t io_stats = io_sched_get_stats();
+	godot_dictionary stats;
+	api->godot_dictionary_new(&stats);
+	_dict_set_int(&stats, "bytes", io_stats.bytes);
+	_dict_set_int(&stats, "reads", io_stats.reads);
+	_dict_set_int(&stats, "waits", io_stats.waits);
+	_dict_set_int(&stats, "main_reads", io_stats.main_reads);
+	_dict_set_int(&stats, "throttled", io_stats.throttled);
+	_dict_set_int(&stats, "deferred", io_stats.deferred);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &stats);
+	api->godot_dictionary_destroy(&stats);
+	return ret;
+}
+
+// Teardowns (closed or reopened players) the reaper thread hasn't freed yet.
+static godot_variant server_get_pending_teardowns(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, vd_atomic_add(&teardown_pending, 0));
+	return ret;
+}
+
+static godot_variant server_suspend(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		_suspend(data);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
+
+static godot_variant server_resume(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_bool ok = GODOT_FALSE;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		ok = _resume(data);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ok);
+	return ret;
+}
+
+static godot_variant server_is_suspended(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	api->godot_variant_new_bool(&ret, data != NULL && data->suspended);
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
+}
+
+// queue_next(id, path): play path right after the current clip, without a gap.
+static godot_variant server_queue_next(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_bool ok = GODOT_FALSE;
+	char *path = _arg_string(p_args, p_num_args, 1);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && path != NULL) {
+		ok = videodecoder_queue_next(data, path);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	if (path != NULL) {
+		api->godot_free(path);
+	}
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ok);
+	return ret;
+}
+
+static godot_variant server_clear_next(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->next_clip >= 0) {
+		videodecoder_release(data->next_clip);
+		data->next_clip = -1;
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
+
+static godot_variant server_has_next(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	api->godot_variant_new_bool(&ret, data != NULL && data->next_clip >= 0);
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
+}
+
+// {frame_pts, newest_pts, latency} in seconds for a live instance. The pts are the input's own
+// timestamps, compare frame_pts with the sender's clock to measure glass-to-glass latency.
+static godot_variant server_get_live_info(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_dictionary info;
+	api->godot_dictionary_new(&info);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->options.live && !isnan(data->live_newest) && !isnan(data->frame_time)) {
+		double frame_pts = data->frame_time - data->clip_offset;
+		_dict_set_real(&info, "frame_pts", frame_pts);
+		_dict_set_real(&info, "newest_pts", data->live_newest);
+		_dict_set_real(&info, "latency", data->live_newest - frame_pts);
 	}
-	av_packet_unref(&pkt);
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &info);
+	api->godot_dictionary_destroy(&info);
+	return ret;
+}
 
-	// hack to get video_stream_gdnative to stop asking for frames.
-	// stop trusting video pts until the next time update() is called.
-	// this will unblock VideoStreamPlaybackGDNative::update() which
-	// keeps calling get_texture() until the time matches
-	// we don't need this behavior as we already handle frame skipping internally.
-	data->position_type = POS_TIME;
-	PROFILE_END;
-	return data->frame_unwrapped ? &data->unwrapped_frame : NULL;
+// Position in the video, VideoPlayer.stream_position follows godot's clock when the speed isn't 1.
+static godot_variant server_get_media_time(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	api->godot_variant_new_real(&ret, data != NULL ? data->time : 0);
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
 }
 
-/*
-FIG1: how to seek while paused...
+// get_frames(id, count): the next `count` frames of an offline instance as RGBA8 PoolByteArrays,
+// fewer at the end of the stream.
+static godot_variant server_get_frames(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_array frames;
+	api->godot_array_new(&frames);
+	int64_t count = _arg_int(p_args, p_num_args, 1, 1);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->format_ctx != NULL && !data->suspended && _is_offline(data)) {
+		for (int64_t i = 0; i < count; i++) {
+			godot_pool_byte_array *pixels = _ahead_next(data);
+			if (pixels == NULL || !data->frame_changed) {
+				break;
+			}
+			godot_variant frame;
+			api->godot_variant_new_pool_byte_array(&frame, pixels);
+			api->godot_array_append(&frames, &frame);
+			api->godot_variant_destroy(&frame);
+		}
+	} else if (data != NULL) {
+		api->godot_print_warning("get_frames() needs the offline option and an open video.", "VideoDecoderServer.get_frames()", __FILE__, __LINE__);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_array(&ret, &frames);
+	api->godot_array_destroy(&frames);
+	return ret;
+}
 
-var _paused_seeking = 0
-func seek_player(value):
-	var was_playing = _playing
-	if _playing:
-		stop()
-	_player.stream_position = value
+// get_mipmaps(id): the newest frame whose mipmaps are built, with all of them, for
+// Image.create_from_data(width, height, true, Image.FORMAT_RGBA8, ...). Empty without the mipmaps option.
+static godot_variant server_get_mipmaps(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_pool_byte_array pixels;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->options.mipmaps) {
+		_mip_get(data->mips, &pixels);
+	} else {
+		api->godot_pool_byte_array_new(&pixels);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_pool_byte_array(&ret, &pixels);
+	api->godot_pool_byte_array_destroy(&pixels);
+	return ret;
+}
 
-	if was_playing:
-		play(value)
-		if _player.paused || _paused_seeking > 0:
-			_player.paused = false
-			_paused_seeking = _paused_seeking + 1
-			# yes, it seems like 5 idle frames _is_ the magic number.
-			# VideoPlayer gets notified to do NOTIFICATION_INTERNAL_PROCESS on idle frames
-			# so this should always work?
-			for i in range(5):
-				yield(get_tree(), 'idle_frame')
-			# WARNING: -= double decrements here somehow?
-			_paused_seeking = _paused_seeking - 1
-			assert(_paused_seeking >= 0)
-			if _paused_seeking == 0:
-				_player.paused = true
+// create_atlas(width, height), returns the atlas id.
+static godot_variant server_create_atlas(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	api->godot_variant_new_int(&ret, _atlas_create(_arg_int(p_args, p_num_args, 0, 0), _arg_int(p_args, p_num_args, 1, 0)));
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
+}
 
-*/
+static godot_variant server_destroy_atlas(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&instances_mutex);
+	atlas_t *atlas = _find_atlas(_arg_int(p_args, p_num_args, 0, -1));
+	if (atlas != NULL) {
+		_atlas_destroy(atlas);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
 
-godot_int godot_videodecoder_get_audio(void *p_data, float *pcm, int pcm_remaining) {
-	PROFILE_START("get_audio", __LINE__);
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-	if (data->audiostream_idx < 0) {
-		PROFILE_END;
-		return 0;
+// atlas_add(atlas_id, id): false if the instance's frames don't fit in the atlas.
+static godot_variant server_atlas_add(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_bool ok = GODOT_FALSE;
+	vd_mutex_lock(&instances_mutex);
+	atlas_t *atlas = _find_atlas(_arg_int(p_args, p_num_args, 0, -1));
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 1, -1));
+	if (atlas != NULL && data != NULL) {
+		ok = _atlas_add(atlas, data);
 	}
-	bool first_frame = true;
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ok);
+	return ret;
+}
 
-	// if playback has just started or just seeked then we enter the audio_reset state.
-	// during audio_reset it's important to skip old samples
-	// _and_ avoid sending samples from the future until the presentation timestamp syncs up.
-	bool audio_reset = isnan(data->audio_time) || data->audio_time > data->time - data->diff_tolerance;
+static godot_variant server_atlas_remove(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->atlas != NULL) {
+		_atlas_remove(data);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
+}
 
-	const int pcm_buffer_size = pcm_remaining;
-	int pcm_offset = 0;
+// UV rect (0..1) of an instance in its atlas, it changes when members are removed.
+static godot_variant server_get_atlas_uv(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_rect2 rect;
+	api->godot_rect2_new(&rect, 0, 0, 0, 0);
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL && data->atlas != NULL) {
+		godot_real w = data->atlas->width, h = data->atlas->height;
+		api->godot_rect2_new(&rect, data->atlas_x / w, data->atlas_y / h, data->out_width / w, data->out_height / h);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_rect2(&ret, &rect);
+	return ret;
+}
 
-	double p_time = data->audio_frame->pts * av_q2d(data->format_ctx->streams[data->audiostream_idx]->time_base);
+// Starts decoding and converting the current frame of every member, returns the RGBA8 pixels
+// of the atlas as the previous call left them.
+static godot_variant server_update_atlas(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	atlas_t *atlas = _find_atlas(_arg_int(p_args, p_num_args, 0, -1));
+	if (atlas != NULL) {
+		api->godot_variant_new_pool_byte_array(&ret, _atlas_update(atlas));
+	} else {
+		api->godot_variant_new_nil(&ret);
+	}
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
+}
 
-	if (audio_reset && data->num_decoded_samples > 0) {
-		// don't send any pcm data if the frame hasn't started yet
-		if (p_time > data->time) {
-			PROFILE_END;
-			return 0;
-		}
-		// skip the any decoded samples if their presentation timestamp is too old
-		if (data->time - p_time > data->diff_tolerance) {
-			data->num_decoded_samples = 0;
+// request_thumbnails(path, times, width, height = 0): `times` is an array of seconds, or a number
+// for one thumbnail every that many seconds. A height of 0 keeps the aspect ratio. Returns a handle.
+static godot_variant server_request_thumbnails(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	char *path = _arg_string(p_args, p_num_args, 0);
+	double *times = NULL;
+	int nb_times = 0;
+	double every = 0;
+	if (p_num_args > 1 && api->godot_variant_get_type(p_args[1]) == GODOT_VARIANT_TYPE_ARRAY) {
+		godot_array array = api->godot_variant_as_array(p_args[1]);
+		nb_times = FFMIN(api->godot_array_size(&array), MAX_THUMBNAILS);
+		times = nb_times > 0 ? (double *)api->godot_alloc(sizeof(double) * nb_times) : NULL;
+		for (int i = 0; times != NULL && i < nb_times; i++) {
+			godot_variant time = api->godot_array_get(&array, i);
+			times[i] = api->godot_variant_as_real(&time);
+			api->godot_variant_destroy(&time);
 		}
+		api->godot_array_destroy(&array);
+	} else if (p_num_args > 1) {
+		every = api->godot_variant_as_real(p_args[1]);
+	}
+	int width = _arg_int(p_args, p_num_args, 2, 160);
+	int height = _arg_int(p_args, p_num_args, 3, 0);
+	godot_int handle = -1;
+	if (path != NULL && width > 0 && (times != NULL || every > 0)) {
+		handle = _thumbnail_start(path, times, nb_times, every, width, height);
+	} else if (times != NULL) {
+		api->godot_free(times);
+	}
+	if (path != NULL) {
+		api->godot_free(path);
 	}
+	api->godot_variant_new_int(&ret, handle);
+	return ret;
+}
 
-	int sample_count = (pcm_remaining < data->num_decoded_samples) ? pcm_remaining : data->num_decoded_samples;
+static godot_variant server_are_thumbnails_ready(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&preload_mutex);
+	thumbnail_request_t *req = _thumbnail_find(_arg_int(p_args, p_num_args, 0, -1));
+	godot_bool ready = req != NULL && req->done;
+	vd_mutex_unlock(&preload_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ready);
+	return ret;
+}
 
-	if (sample_count > 0) {
-		memcpy(pcm, data->audio_buffer + data->acodec_ctx->channels * data->audio_buffer_pos, sizeof(float) * sample_count * data->acodec_ctx->channels);
-		pcm_offset += sample_count;
-		pcm_remaining -= sample_count;
-		data->num_decoded_samples -= sample_count;
-		data->audio_buffer_pos += sample_count;
+// get_thumbnails(handle): [{time, pixels}, ...] with RGBA8 pixels, waits for the request
+// if it isn't done yet. The handle is released.
+static godot_variant server_get_thumbnails(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_array thumbnails;
+	api->godot_array_new(&thumbnails);
+	vd_mutex_lock(&preload_mutex);
+	thumbnail_request_t *req = _thumbnail_find(_arg_int(p_args, p_num_args, 0, -1));
+	while (req != NULL && !req->done) {
+		vd_cond_wait(&preload_cond, &preload_mutex);
 	}
-	while (pcm_remaining > 0) {
-		if (data->num_decoded_samples <= 0) {
-			AVPacket pkt;
+	for (int i = 0; req != NULL && i < req->nb_thumbnails; i++) {
+		godot_dictionary thumb;
+		api->godot_dictionary_new(&thumb);
+		_dict_set_real(&thumb, "time", req->thumbnails[i].time);
+		godot_string g_key = api->godot_string_chars_to_utf8("pixels");
+		godot_variant v_key, v_pixels;
+		api->godot_variant_new_string(&v_key, &g_key);
+		api->godot_variant_new_pool_byte_array(&v_pixels, &req->thumbnails[i].pixels);
+		api->godot_dictionary_set(&thumb, &v_key, &v_pixels);
+		api->godot_variant_destroy(&v_pixels);
+		api->godot_variant_destroy(&v_key);
+		api->godot_string_destroy(&g_key);
+
+		godot_variant v_thumb;
+		api->godot_variant_new_dictionary(&v_thumb, &thumb);
+		api->godot_array_append(&thumbnails, &v_thumb);
+		api->godot_variant_destroy(&v_thumb);
+		api->godot_dictionary_destroy(&thumb);
+	}
+	if (req != NULL) {
+		_thumbnail_free(req);
+	}
+	vd_mutex_unlock(&preload_mutex);
+	godot_variant ret;
+	api->godot_variant_new_array(&ret, &thumbnails);
+	api->godot_array_destroy(&thumbnails);
+	return ret;
+}
 
-			int ret;
-retry_audio:
-			ret = avcodec_receive_frame(data->acodec_ctx, data->audio_frame);
-			if (ret == AVERROR(EAGAIN)) {
-				// need to call avcodec_send_packet, get a packet from queue to send it
-				if (!packet_queue_get(data->audio_packet_queue, &pkt)) {
-					if (pcm_offset == 0) {
-						// if we haven't got any on-time audio yet, then the audio_time counter is meaningless.
-						data->audio_time = NAN;
-					}
-					PROFILE_END;
-					return pcm_offset;
-				}
-				ret = avcodec_send_packet(data->acodec_ctx, &pkt);
-				if (ret < 0) {
-					char msg[512];
-					snprintf(msg, sizeof(msg) -1, "avcodec_send_packet returns %d", ret);
-					api->godot_print_error(msg, "godot_videodecoder_get_audio()", __FILE__, __LINE__);
-					av_packet_unref(&pkt);
-					PROFILE_END;
-					return pcm_offset;
-				}
-				av_packet_unref(&pkt);
-				goto retry_audio;
-			} else if (ret < 0) {
-				char msg[512];
-				snprintf(msg, sizeof(msg) - 1, "avcodec_receive_frame returns %d", ret);
-				api->godot_print_error(msg, "godot_videodecoder_get_audio()", __FILE__, __LINE__);
-				PROFILE_END;
-				return pcm_buffer_size - pcm_remaining;
-			}
-			// only set the audio frame time if this is the first frame we've decoded during this update.
-			// any remaining frames are going into a buffer anyways
-			p_time = data->audio_frame->pts * av_q2d(data->format_ctx->streams[data->audiostream_idx]->time_base);
-			if (first_frame) {
-				data->audio_time = p_time;
-				first_frame = false;
-			}
-			// decoded audio ready here
-			data->num_decoded_samples = swr_convert(data->swr_ctx, (uint8_t **)&data->audio_buffer, data->audio_frame->nb_samples, (const uint8_t **)data->audio_frame->extended_data, data->audio_frame->nb_samples);
-			// data->num_decoded_samples = _interleave_audio_frame(data->audio_buffer, data->audio_frame);
-			data->audio_buffer_pos = 0;
-		}
-		if (audio_reset) {
-			if (data->time - p_time > data->diff_tolerance) {
-				// skip samples if the frame time is too far in the past
-				data->num_decoded_samples = 0;
-			} else if (p_time > data->time) {
-				// don't send any pcm data if the first frame hasn't started yet
-				data->audio_time = NAN;
-				break;
-			}
-		}
-		sample_count = pcm_remaining < data->num_decoded_samples ? pcm_remaining : data->num_decoded_samples;
-		if (sample_count > 0) {
-			memcpy(pcm + pcm_offset * data->acodec_ctx->channels, data->audio_buffer + data->acodec_ctx->channels * data->audio_buffer_pos, sizeof(float) * sample_count * data->acodec_ctx->channels);
-			pcm_offset += sample_count;
-			pcm_remaining -= sample_count;
-			data->num_decoded_samples -= sample_count;
-			data->audio_buffer_pos += sample_count;
-		}
+// compress_clip(path, sidecar_path, width = 0, height = 0): writes the frames of the video at
+// `path` BC1 compressed to `sidecar_path`, on the batch loader thread. Without a size the video
+// keeps its own. Returns a handle.
+static godot_variant server_compress_clip(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	char *path = _arg_string(p_args, p_num_args, 0);
+	char *sidecar_path = _arg_string(p_args, p_num_args, 1);
+	godot_int handle = -1;
+	if (path != NULL && sidecar_path != NULL) {
+		handle = _compress_start(path, sidecar_path, _arg_int(p_args, p_num_args, 2, 0), _arg_int(p_args, p_num_args, 3, 0));
+	}
+	if (path != NULL) {
+		api->godot_free(path);
 	}
+	if (sidecar_path != NULL) {
+		api->godot_free(sidecar_path);
+	}
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, handle);
+	return ret;
+}
 
-	PROFILE_END;
-	return pcm_offset;
+static godot_variant server_is_compression_done(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&preload_mutex);
+	compress_request_t *req = _compress_find(_arg_int(p_args, p_num_args, 0, -1));
+	godot_bool done = req != NULL && req->done;
+	vd_mutex_unlock(&preload_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, done);
+	return ret;
 }
 
-godot_real godot_videodecoder_get_playback_position(const void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+// get_compression_result(handle): OK or the error, waits for the request if it isn't done
+// yet. The handle is released.
+static godot_variant server_get_compression_result(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&preload_mutex);
+	compress_request_t *req = _compress_find(_arg_int(p_args, p_num_args, 0, -1));
+	while (req != NULL && !req->done) {
+		vd_cond_wait(&preload_cond, &preload_mutex);
+	}
+	godot_error result = GODOT_ERR_DOES_NOT_EXIST;
+	if (req != NULL) {
+		result = req->result;
+		_compress_free(req);
+	}
+	vd_mutex_unlock(&preload_mutex);
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, result);
+	return ret;
+}
 
-	if (data->format_ctx) {
-		bool use_v_pts = data->frame_yuv->pts != AV_NOPTS_VALUE && data->position_type == POS_V_PTS;
-		bool use_a_time = data->position_type == POS_A_TIME;
-		bool in_update = data->position_type == POS_V_PTS;
-		data->position_type = POS_TIME;
+// open_compressed(sidecar_path, source_path = ""): -1 if the sidecar is missing or broken, or
+// with a `source_path`, if it wasn't made from that file as it is now.
+static godot_variant server_open_compressed(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	char *sidecar_path = _arg_string(p_args, p_num_args, 0);
+	char *source_path = _arg_string(p_args, p_num_args, 1);
+	godot_int handle = -1;
+	if (sidecar_path != NULL) {
+		handle = _compressed_open(sidecar_path, source_path);
+		api->godot_free(sidecar_path);
+	}
+	if (source_path != NULL) {
+		api->godot_free(source_path);
+	}
+	godot_variant ret;
+	api->godot_variant_new_int(&ret, handle);
+	return ret;
+}
 
-		if (use_v_pts) {
-			double pts = (double)data->frame_yuv->pts;
-			pts *= av_q2d(data->format_ctx->streams[data->videostream_idx]->time_base);
-			return (godot_real)pts;
-		} else {
-			if (!isnan(data->audio_time) && use_a_time) {
-				return (godot_real)data->audio_time;
-			}
-			// fudge the time if we in the first frame after an update but don't have V_PTS yet
-			godot_real adjustment = in_update ? -0.01 : 0.0;
-			return (godot_real)data->time + adjustment;
-		}
+static godot_variant server_close_compressed(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	vd_mutex_lock(&instances_mutex);
+	compressed_clip_t *clip = _compressed_find(_arg_int(p_args, p_num_args, 0, -1));
+	if (clip != NULL) {
+		_compressed_close(clip);
 	}
-	return (godot_real)0;
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_nil(&ret);
+	return ret;
 }
 
-static void flush_frames(AVCodecContext* ctx) {
-	PROFILE_START("flush_frames", __LINE__);
-	/**
-	* from https://www.ffmpeg.org/doxygen/4.1/group__lavc__encdec.html
-	* End of stream situations. These require "flushing" (aka draining) the codec, as the codec might buffer multiple frames or packets internally for performance or out of necessity (consider B-frames). This is handled as follows:
-	* Instead of valid input, send NULL to the avcodec_send_packet() (decoding) or avcodec_send_frame() (encoding) functions. This will enter draining mode.
-	* Call avcodec_receive_frame() (decoding) or avcodec_receive_packet() (encoding) in a loop until AVERROR_EOF is returned. The functions will not return AVERROR(EAGAIN), unless you forgot to enter draining mode.
-	* Before decoding can be resumed again, the codec has to be reset with avcodec_flush_buffers().
-	*/
-	int ret = avcodec_send_packet(ctx, NULL);
-	AVFrame frame = {0};
-	if (ret <= 0) {
-		do {
-			ret = avcodec_receive_frame(ctx, &frame);
-		} while (ret != AVERROR_EOF);
+// get_compressed_info(handle): {width, height, format, image_format, frames, duration}, empty
+// for an unknown handle. image_format is the Image format of the frames.
+static godot_variant server_get_compressed_info(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+	vd_mutex_lock(&instances_mutex);
+	compressed_clip_t *clip = _compressed_find(_arg_int(p_args, p_num_args, 0, -1));
+	if (clip != NULL) {
+		_dict_set_int(&dict, "width", clip->header->width);
+		_dict_set_int(&dict, "height", clip->header->height);
+		_dict_set_string(&dict, "format", "bc1");
+		_dict_set_int(&dict, "image_format", IMAGE_FORMAT_DXT1);
+		_dict_set_int(&dict, "frames", clip->header->nb_frames);
+		_dict_set_real(&dict, "duration", clip->header->duration);
 	}
-	PROFILE_END;
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
 }
 
-void godot_videodecoder_seek(void *p_data, godot_real p_time) {
-	PROFILE_START("seek", __LINE__);
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-	// Hack to find the end of the video. Really VideoPlayer should expose this!
-	if (p_time < 0) {
-		p_time = _avtime_to_sec(data->format_ctx->duration);
+// get_compressed_frame(handle, time, loop = true): the data of the frame shown `time` seconds
+// into the clip, for Image.create_from_data() in the image_format of get_compressed_info().
+static godot_variant server_get_compressed_frame(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_pool_byte_array pixels;
+	api->godot_pool_byte_array_new(&pixels);
+	double time = p_num_args > 1 ? api->godot_variant_as_real(p_args[1]) : 0;
+	bool loop = _arg_int(p_args, p_num_args, 2, 1) != 0;
+	vd_mutex_lock(&instances_mutex);
+	compressed_clip_t *clip = _compressed_find(_arg_int(p_args, p_num_args, 0, -1));
+	if (clip != NULL) {
+		const sidecar_header_t *header = clip->header;
+		int frame = _compressed_frame_at(clip, time, loop);
+		api->godot_pool_byte_array_resize(&pixels, header->frame_size);
+		godot_pool_byte_array_write_access *write = api->godot_pool_byte_array_write(&pixels);
+		memcpy(api->godot_pool_byte_array_write_access_ptr(write),
+				clip->map->data + header->frames_offset + (int64_t)frame * header->frame_size, header->frame_size);
+		api->godot_pool_byte_array_write_access_destroy(write);
 	}
-	int64_t seek_target = p_time * AV_TIME_BASE;
-	// seek within 10 seconds of the selected spot.
-	int64_t margin = 10 * AV_TIME_BASE;
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_pool_byte_array(&ret, &pixels);
+	api->godot_pool_byte_array_destroy(&pixels);
+	return ret;
+}
 
-	// printf("seek(): %fs = %lld\n", p_time, seek_target);
-	int ret = avformat_seek_file(data->format_ctx, -1, seek_target - margin, seek_target, seek_target, 0);
-	if (ret < 0) {
-		api->godot_print_warning("avformat_seek_file() can't seek backward?", "godot_videodecoder_seek()\n", __FILE__, __LINE__);
-		ret = avformat_seek_file(data->format_ctx, -1, seek_target - margin, seek_target, seek_target + margin, 0);
+static const option_desc *_find_option(const char *name) {
+	for (int i = 0; i < NUM_OPTIONS; i++) {
+		if (strcmp(option_descs[i].name, name) == 0) {
+			return &option_descs[i];
+		}
 	}
-	if (ret < 0) {
-		api->godot_print_error("avformat_seek_file() failed", "godot_videodecoder_seek()\n", __FILE__, __LINE__);
+	return NULL;
+}
+
+static godot_variant _option_get(const videodecoder_options *options, godot_variant **p_args, int p_num_args, int idx) {
+	godot_variant ret;
+	char *name = _arg_string(p_args, p_num_args, idx);
+	const option_desc *desc = name != NULL ? _find_option(name) : NULL;
+	const char *field = (const char *)options + (desc != NULL ? desc->offset : 0);
+	if (desc == NULL) {
+		api->godot_variant_new_nil(&ret);
+	} else if (desc->type == OPTION_BOOL) {
+		api->godot_variant_new_bool(&ret, *(const godot_bool *)field);
+	} else if (desc->type == OPTION_INT) {
+		api->godot_variant_new_int(&ret, *(const int64_t *)field);
 	} else {
-		packet_queue_flush(data->video_packet_queue);
-		packet_queue_flush(data->audio_packet_queue);
-		flush_frames(data->vcodec_ctx);
-		avcodec_flush_buffers(data->vcodec_ctx);
-		if (data->acodec_ctx) {
-			flush_frames(data->acodec_ctx);
-			avcodec_flush_buffers(data->acodec_ctx);
-		}
-		data->num_decoded_samples = 0;
-		data->audio_buffer_pos = 0;
-		data->time = p_time;
-		data->seek_time = p_time;
-		// try to use the audio time as the seek position
-		data->position_type = POS_A_TIME;
-		data->audio_time = NAN;
+		api->godot_variant_new_real(&ret, *(const double *)field);
 	}
-	PROFILE_END;
+	if (name != NULL) {
+		api->godot_free(name);
+	}
+	return ret;
 }
 
-/* ---------------------- TODO ------------------------- */
+static godot_bool _option_set(videodecoder_options *options, godot_variant **p_args, int p_num_args, int idx) {
+	char *name = _arg_string(p_args, p_num_args, idx);
+	const option_desc *desc = name != NULL ? _find_option(name) : NULL;
+	if (name != NULL) {
+		if (desc == NULL) {
+			api->godot_print_warning(name, "VideoDecoderServer.set_option()", __FILE__, __LINE__);
+		}
+		api->godot_free(name);
+	}
+	if (desc == NULL || idx + 1 >= p_num_args) {
+		return GODOT_FALSE;
+	}
+	char *field = (char *)options + desc->offset;
+	if (desc->type == OPTION_BOOL) {
+		*(godot_bool *)field = api->godot_variant_as_bool(p_args[idx + 1]);
+	} else if (desc->type == OPTION_INT) {
+		*(int64_t *)field = api->godot_variant_as_int(p_args[idx + 1]);
+	} else {
+		*(double *)field = api->godot_variant_as_real(p_args[idx + 1]);
+	}
+	return GODOT_TRUE;
+}
 
-void godot_videodecoder_set_audio_track(void *p_data, godot_int p_audiotrack) {
-	// api->godot_print_warning("set_audio_track not implemented", "set_audio_track()\n", __FILE__, __LINE__);
+// Options given to decoders created from now on, e.g. before assigning VideoPlayer.stream.
+static godot_variant server_set_default_option(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, _option_set(&default_options, p_args, p_num_args, 0));
+	return ret;
 }
 
-godot_int godot_videodecoder_get_channels(const void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
+static godot_variant server_get_default_option(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	return _option_get(&default_options, p_args, p_num_args, 0);
+}
 
-	if (data->acodec_ctx != NULL) {
-		return data->acodec_ctx->channels;
+// set_option(id, name, value), options used while opening (e.g. audio_only) apply from the next open.
+static godot_variant server_set_option(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_bool ok = GODOT_FALSE;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		// e.g. leaving offline mode, the main thread decodes again.
+		_ahead_stop(data);
+		ok = _option_set(&data->options, p_args, p_num_args, 1);
 	}
-	return 0;
+	vd_mutex_unlock(&instances_mutex);
+	godot_variant ret;
+	api->godot_variant_new_bool(&ret, ok);
+	return ret;
 }
 
-godot_int godot_videodecoder_get_mix_rate(const void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-
-	if (data->acodec_ctx != NULL) {
-		return AUDIO_MIX_RATE;
+static godot_variant server_get_option(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	vd_mutex_lock(&instances_mutex);
+	videodecoder_data_struct *data = _find_instance(_arg_int(p_args, p_num_args, 0, -1));
+	if (data != NULL) {
+		ret = _option_get(&data->options, p_args, p_num_args, 1);
+	} else {
+		api->godot_variant_new_nil(&ret);
 	}
-	return 0;
+	vd_mutex_unlock(&instances_mutex);
+	return ret;
 }
 
-godot_vector2 godot_videodecoder_get_texture_size(const void *p_data) {
-	videodecoder_data_struct *data = (videodecoder_data_struct *)p_data;
-	godot_vector2 vec;
+static void _register_method(void *p_handle, const char *p_name, godot_variant (*p_method)(godot_object *, void *, void *, int, godot_variant **)) {
+	godot_method_attributes attributes = { GODOT_METHOD_RPC_MODE_DISABLED };
+	godot_instance_method method = { NULL, NULL, NULL };
+	method.method = p_method;
+	nativescript_api->godot_nativescript_register_method(p_handle, server_class_name, p_name, attributes, method);
+}
 
-	if (data->vcodec_ctx != NULL) {
-		api->godot_vector2_new(&vec, data->vcodec_ctx->width, data->vcodec_ctx->height);
+void GDN_EXPORT godot_nativescript_init(void *p_handle) {
+	if (nativescript_api == NULL) {
+		return;
 	}
-	return vec;
+	godot_instance_create_func create = { NULL, NULL, NULL };
+	create.create_func = server_constructor;
+	godot_instance_destroy_func destroy = { NULL, NULL, NULL };
+	destroy.destroy_func = server_destructor;
+	nativescript_api->godot_nativescript_register_class(p_handle, server_class_name, "Reference", create, destroy);
+
+	_register_method(p_handle, "prepare", server_prepare);
+	_register_method(p_handle, "is_prepared", server_is_prepared);
+	_register_method(p_handle, "release", server_release);
+	_register_method(p_handle, "get_last_instance_id", server_get_last_instance_id);
+	_register_method(p_handle, "get_instance_ids", server_get_instance_ids);
+	_register_method(p_handle, "is_frame_changed", server_is_frame_changed);
+	_register_method(p_handle, "get_tracks", server_get_tracks);
+	_register_method(p_handle, "select_track", server_select_track);
+	_register_method(p_handle, "set_default_option", server_set_default_option);
+	_register_method(p_handle, "get_default_option", server_get_default_option);
+	_register_method(p_handle, "set_option", server_set_option);
+	_register_method(p_handle, "get_option", server_get_option);
+	_register_method(p_handle, "get_memory_usage", server_get_memory_usage);
+	_register_method(p_handle, "get_memory_total", server_get_memory_total);
+	_register_method(p_handle, "set_memory_budget", server_set_memory_budget);
+	_register_method(p_handle, "get_memory_budget", server_get_memory_budget);
+	_register_method(p_handle, "get_pending_teardowns", server_get_pending_teardowns);
+	_register_method(p_handle, "get_stats", server_get_stats);
+	_register_method(p_handle, "get_global_stats", server_get_global_stats);
+	_register_method(p_handle, "set_io_bandwidth", server_set_io_bandwidth);
+	_register_method(p_handle, "get_io_bandwidth", server_get_io_bandwidth);
+	_register_method(p_handle, "get_io_stats", server_get_io_stats);
+	_register_method(p_handle, "suspend", server_suspend);
+	_register_method(p_handle, "resume", server_resume);
+	_register_method(p_handle, "is_suspended", server_is_suspended);
+	_register_method(p_handle, "queue_next", server_queue_next);
+	_register_method(p_handle, "clear_next", server_clear_next);
+	_register_method(p_handle, "has_next", server_has_next);
+	_register_method(p_handle, "get_live_info", server_get_live_info);
+	_register_method(p_handle, "get_frames", server_get_frames);
+	_register_method(p_handle, "get_media_time", server_get_media_time);
+	_register_method(p_handle, "get_mipmaps", server_get_mipmaps);
+	_register_method(p_handle, "create_atlas", server_create_atlas);
+	_register_method(p_handle, "destroy_atlas", server_destroy_atlas);
+	_register_method(p_handle, "atlas_add", server_atlas_add);
+	_register_method(p_handle, "atlas_remove", server_atlas_remove);
+	_register_method(p_handle, "get_atlas_uv", server_get_atlas_uv);
+	_register_method(p_handle, "update_atlas", server_update_atlas);
+	_register_method(p_handle, "request_thumbnails", server_request_thumbnails);
+	_register_method(p_handle, "are_thumbnails_ready", server_are_thumbnails_ready);
+	_register_method(p_handle, "get_thumbnails", server_get_thumbnails);
+	_register_method(p_handle, "compress_clip", server_compress_clip);
+	_register_method(p_handle, "is_compression_done", server_is_compression_done);
+	_register_method(p_handle, "get_compression_result", server_get_compression_result);
+	_register_method(p_handle, "open_compressed", server_open_compressed);
+	_register_method(p_handle, "close_compressed", server_close_compressed);
+	_register_method(p_handle, "get_compressed_info", server_get_compressed_info);
+	_register_method(p_handle, "get_compressed_frame", server_get_compressed_frame);
 }
 
 const godot_videodecoder_interface_gdnative plugin_interface = {
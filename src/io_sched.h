@@ -0,0 +1,327 @@
+#ifndef _IO_SCHED_H
+#define _IO_SCHED_H
+
+#include <gdnative_api_struct.gen.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "thread.h"
+
+extern const godot_gdnative_core_api_struct *api;
+
+// Every decoder reads its file through an io_source_t. Reads are served from a chunk
+// that is read from the file in one go, so players sharing a disk don't interleave
+// small reads. Only one chunk is read at a time by the background threads, waiting
+// sources go first when they're on screen, then the closest to running out of packets.
+// godot's main thread never waits for them, it reads next to whichever is reading.
+// io_sched_may_read() orders the reading ahead of the players instead: the ones that
+// aren't on screen wait while one that is runs short of packets, and the reads that
+// aren't urgent stay under a bandwidth cap.
+
+typedef int (*io_sched_read_func)(void *opaque, uint8_t *buf, int buf_size);
+typedef int64_t (*io_sched_seek_func)(void *opaque, int64_t offset, int whence);
+
+typedef struct io_source_t {
+	void *opaque;
+	io_sched_read_func read;
+	io_sched_seek_func seek;
+	// NULL: every read goes to the file
+	uint8_t *chunk;
+	int chunk_size;
+	// file offset of chunk[0], bytes read into the chunk and how many of them were consumed
+	int64_t chunk_start;
+	int chunk_len;
+	int chunk_pos;
+	// set by the owner: shown on screen, seconds of packets it has queued
+	volatile bool foreground;
+	volatile double queued;
+	// last io_sched_may_read() of the owner while it was on screen and urgent, 0 when it wasn't
+	volatile uint64_t short_usec;
+	struct io_source_t *next_waiter;
+	struct io_source_t *next_source;
+} io_source_t;
+
+typedef struct io_sched_stats_t {
+	// read from the files
+	int64_t bytes;
+	int64_t reads;
+	// reads that had to wait for another one
+	int64_t waits;
+	// reads on the main thread, which skip the queue
+	int64_t main_reads;
+	// io_sched_may_read() said no for the bandwidth cap...
+	int64_t throttled;
+	// ... or for a source on screen that is short of packets
+	int64_t deferred;
+} io_sched_stats_t;
+
+static vd_mutex io_sched_mutex;
+static vd_cond io_sched_cond;
+static bool io_sched_busy = false;
+static io_source_t *io_sched_waiters = NULL;
+static io_source_t *io_sched_sources = NULL;
+// a source on screen counts as short of packets this long after it last said so
+#define IO_SCHED_SHORT_USEC 100000
+// bytes per second, 0 for no limit
+static int64_t io_sched_bandwidth = 0;
+// bytes that can be read without exceeding the bandwidth, at most a second worth
+static double io_sched_tokens = 0;
+static uint64_t io_sched_refill_usec = 0;
+static io_sched_stats_t io_sched_stats;
+// the thread io_sched_init() ran on: godot's main thread
+static vd_thread_id io_sched_main_thread;
+
+void io_sched_init() {
+	io_sched_main_thread = vd_thread_self();
+	vd_mutex_init(&io_sched_mutex);
+	vd_cond_init(&io_sched_cond);
+	memset(&io_sched_stats, 0, sizeof(io_sched_stats));
+}
+
+void io_sched_shutdown() {
+	vd_cond_destroy(&io_sched_cond);
+	vd_mutex_destroy(&io_sched_mutex);
+}
+
+// `chunk` (chunk_size bytes) belongs to the caller, it may be NULL.
+io_source_t *io_source_open(void *opaque, io_sched_read_func read, io_sched_seek_func seek, uint8_t *chunk, int chunk_size) {
+	io_source_t *src = (io_source_t *)api->godot_alloc(sizeof(io_source_t));
+	if (src == NULL) {
+		return NULL;
+	}
+	memset(src, 0, sizeof(io_source_t));
+	src->opaque = opaque;
+	src->read = read;
+	src->seek = seek;
+	src->chunk = chunk;
+	src->chunk_size = chunk != NULL ? chunk_size : 0;
+	// nobody waits for it until the owner says otherwise
+	src->queued = HUGE_VAL;
+	vd_mutex_lock(&io_sched_mutex);
+	src->next_source = io_sched_sources;
+	io_sched_sources = src;
+	vd_mutex_unlock(&io_sched_mutex);
+	return src;
+}
+
+// Continues reading the same file through another handle, positioned where the previous one was.
+void io_source_retarget(io_source_t *src, void *opaque, io_sched_read_func read, io_sched_seek_func seek) {
+	src->opaque = opaque;
+	src->read = read;
+	src->seek = seek;
+}
+
+// Replaces the chunk (NULL for none) between reads, e.g. to free it while the owner is
+// suspended. The file is left where the reader got to.
+void io_source_set_chunk(io_source_t *src, uint8_t *chunk, int chunk_size) {
+	if (src->chunk_len > 0) {
+		src->chunk_start += src->chunk_pos;
+		src->seek(src->opaque, src->chunk_start, SEEK_SET);
+	}
+	src->chunk_len = src->chunk_pos = 0;
+	src->chunk = chunk;
+	src->chunk_size = chunk != NULL ? chunk_size : 0;
+}
+
+void io_source_close(io_source_t *src) {
+	if (src == NULL) return;
+	vd_mutex_lock(&io_sched_mutex);
+	io_source_t **link = &io_sched_sources;
+	while (*link != NULL && *link != src) {
+		link = &(*link)->next_source;
+	}
+	if (*link != NULL) {
+		*link = src->next_source;
+	}
+	vd_mutex_unlock(&io_sched_mutex);
+	api->godot_free(src);
+}
+
+static bool _io_sched_before(const io_source_t *a, const io_source_t *b) {
+	if (a->foreground != b->foreground) {
+		return a->foreground;
+	}
+	return a->queued < b->queued;
+}
+
+static void _io_sched_acquire(io_source_t *src) {
+	vd_mutex_lock(&io_sched_mutex);
+	if (io_sched_busy) {
+		io_sched_stats.waits++;
+	}
+	src->next_waiter = io_sched_waiters;
+	io_sched_waiters = src;
+	for (;;) {
+		if (!io_sched_busy) {
+			io_source_t *best = io_sched_waiters;
+			for (io_source_t *w = best->next_waiter; w != NULL; w = w->next_waiter) {
+				if (_io_sched_before(w, best)) {
+					best = w;
+				}
+			}
+			if (best == src) {
+				break;
+			}
+		}
+		vd_cond_wait(&io_sched_cond, &io_sched_mutex);
+	}
+	io_source_t **link = &io_sched_waiters;
+	while (*link != src) {
+		link = &(*link)->next_waiter;
+	}
+	*link = src->next_waiter;
+	io_sched_busy = true;
+	vd_mutex_unlock(&io_sched_mutex);
+}
+
+static void _io_sched_release(bool main, int bytes) {
+	vd_mutex_lock(&io_sched_mutex);
+	if (main) {
+		io_sched_stats.main_reads++;
+	} else {
+		io_sched_busy = false;
+		vd_cond_broadcast(&io_sched_cond);
+	}
+	if (bytes > 0) {
+		io_sched_stats.bytes += bytes;
+		io_sched_tokens -= bytes;
+	}
+	io_sched_stats.reads++;
+	vd_mutex_unlock(&io_sched_mutex);
+}
+
+// AVIOContext read_packet callback, opaque is the io_source_t.
+int io_source_read(void *opaque, uint8_t *buf, int buf_size) {
+	io_source_t *src = (io_source_t *)opaque;
+	if (src->chunk_pos == src->chunk_len) {
+		src->chunk_start += src->chunk_len;
+		src->chunk_len = src->chunk_pos = 0;
+		// reads at least as large as the chunk skip it
+		bool direct = src->chunk == NULL || buf_size >= src->chunk_size;
+		// a frame waits for the main thread's reads, so they don't queue behind the workers'
+		bool main = vd_thread_is_self(io_sched_main_thread);
+		if (!main) {
+			_io_sched_acquire(src);
+		}
+		int ret = src->read(src->opaque, direct ? buf : src->chunk, direct ? buf_size : src->chunk_size);
+		_io_sched_release(main, ret);
+		if (ret <= 0) {
+			return ret;
+		}
+		if (direct) {
+			src->chunk_start += ret;
+			return ret;
+		}
+		src->chunk_len = ret;
+	}
+	int n = src->chunk_len - src->chunk_pos;
+	if (n > buf_size) {
+		n = buf_size;
+	}
+	memcpy(buf, src->chunk + src->chunk_pos, n);
+	src->chunk_pos += n;
+	return n;
+}
+
+// AVIOContext seek callback. Seeks within the chunk don't touch the file.
+int64_t io_source_seek(void *opaque, int64_t offset, int whence) {
+	io_source_t *src = (io_source_t *)opaque;
+	if (whence & AVSEEK_SIZE) {
+		return src->seek(src->opaque, offset, whence);
+	}
+	int64_t target;
+	switch (whence & ~AVSEEK_FORCE) {
+		case SEEK_SET: target = offset; break;
+		case SEEK_CUR: target = src->chunk_start + src->chunk_pos + offset; break;
+		case SEEK_END: {
+			int64_t size = src->seek(src->opaque, 0, AVSEEK_SIZE);
+			if (size < 0) {
+				return size;
+			}
+			target = size + offset;
+			break;
+		}
+		default: return -1;
+	}
+	if (target >= src->chunk_start && target <= src->chunk_start + src->chunk_len) {
+		src->chunk_pos = (int)(target - src->chunk_start);
+		return target;
+	}
+	int64_t pos = src->seek(src->opaque, target, SEEK_SET);
+	if (pos < 0) {
+		return pos;
+	}
+	src->chunk_start = pos;
+	src->chunk_len = src->chunk_pos = 0;
+	return pos;
+}
+
+void io_sched_set_bandwidth(int64_t bytes_per_sec) {
+	vd_mutex_lock(&io_sched_mutex);
+	io_sched_bandwidth = bytes_per_sec > 0 ? bytes_per_sec : 0;
+	io_sched_tokens = (double)io_sched_bandwidth;
+	io_sched_refill_usec = 0;
+	vd_mutex_unlock(&io_sched_mutex);
+}
+
+int64_t io_sched_get_bandwidth() {
+	return io_sched_bandwidth;
+}
+
+// Whether another source on screen is about to run out of packets.
+static bool _io_sched_short(const io_source_t *src, uint64_t now_usec) {
+	for (io_source_t *s = io_sched_sources; s != NULL; s = s->next_source) {
+		if (s != src && s->short_usec != 0 && (int64_t)(now_usec - s->short_usec) < IO_SCHED_SHORT_USEC) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether the owner of `src` should read ahead now. Urgent reads (about to run out of
+// packets) always may. The others of sources that aren't on screen wait while one that
+// is runs short, with or without a cap, since the players' reads on the main thread
+// don't go through the queue. Then the bandwidth cap applies, and sources that aren't
+// on screen leave a quarter second worth of it to the ones that are.
+bool io_sched_may_read(io_source_t *src, bool urgent, uint64_t now_usec) {
+	if (src == NULL) {
+		return true;
+	}
+	src->short_usec = urgent && src->foreground ? FFMAX(now_usec, 1) : 0;
+	if (src->chunk_pos < src->chunk_len) {
+		return true;
+	}
+	vd_mutex_lock(&io_sched_mutex);
+	bool ok = true;
+	if (!urgent && !src->foreground && _io_sched_short(src, now_usec)) {
+		io_sched_stats.deferred++;
+		ok = false;
+	} else if (io_sched_bandwidth > 0) {
+		if (io_sched_refill_usec != 0) {
+			io_sched_tokens += (now_usec - io_sched_refill_usec) * (double)io_sched_bandwidth / 1000000.0;
+			if (io_sched_tokens > io_sched_bandwidth) {
+				io_sched_tokens = (double)io_sched_bandwidth;
+			}
+		}
+		io_sched_refill_usec = now_usec;
+		double reserve = src->foreground ? 0 : io_sched_bandwidth / 4.0;
+		ok = urgent || io_sched_tokens > reserve;
+		if (!ok) {
+			io_sched_stats.throttled++;
+		}
+	}
+	vd_mutex_unlock(&io_sched_mutex);
+	return ok;
+}
+
+io_sched_stats_t io_sched_get_stats() {
+	vd_mutex_lock(&io_sched_mutex);
+	io_sched_stats_t stats = io_sched_stats;
+	vd_mutex_unlock(&io_sched_mutex);
+	return stats;
+}
+
+#endif /* _IO_SCHED_H */
@@ -0,0 +1,98 @@
+#ifndef _MAPFILE_H
+#define _MAPFILE_H
+
+#include <gdnative_api_struct.gen.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+extern const godot_gdnative_core_api_struct *api;
+
+// Read-only memory map of a whole file, by OS path (see gdfile_globalize_path()).
+// The OS pages it in as it's read and shares the pages with every other map of the file.
+
+typedef struct mapfile_t {
+	const uint8_t *data;
+	int64_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} mapfile_t;
+
+mapfile_t *mapfile_open(const char *path) {
+	mapfile_t *m = (mapfile_t *)api->godot_alloc(sizeof(mapfile_t));
+	if (m == NULL) {
+		return NULL;
+	}
+	memset(m, 0, sizeof(mapfile_t));
+#ifdef _WIN32
+	wchar_t wpath[MAX_PATH];
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH) == 0) {
+		api->godot_free(m);
+		return NULL;
+	}
+	m->file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	if (m->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m->file, &size) || size.QuadPart == 0) {
+		if (m->file != INVALID_HANDLE_VALUE) {
+			CloseHandle(m->file);
+		}
+		api->godot_free(m);
+		return NULL;
+	}
+	m->mapping = CreateFileMappingW(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	m->data = m->mapping != NULL ? (const uint8_t *)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (m->data == NULL) {
+		if (m->mapping != NULL) {
+			CloseHandle(m->mapping);
+		}
+		CloseHandle(m->file);
+		api->godot_free(m);
+		return NULL;
+	}
+	m->size = size.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		api->godot_free(m);
+		return NULL;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// the map keeps the file
+	close(fd);
+	if (data == MAP_FAILED) {
+		api->godot_free(m);
+		return NULL;
+	}
+	m->data = (const uint8_t *)data;
+	m->size = st.st_size;
+#endif
+	return m;
+}
+
+void mapfile_close(mapfile_t *m) {
+	if (m == NULL) return;
+#ifdef _WIN32
+	UnmapViewOfFile(m->data);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+#else
+	munmap((void *)m->data, m->size);
+#endif
+	api->godot_free(m);
+}
+
+#endif /* _MAPFILE_H */
@@ -0,0 +1,54 @@
+#ifndef _MEM_H
+#define _MEM_H
+
+#include <gdnative_api_struct.gen.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "thread.h"
+
+extern const godot_gdnative_core_api_struct *api;
+
+// godot_alloc wrappers that count the bytes per category, so every decoder
+// can report what it holds. The caller passes the size back when freeing.
+
+enum MEM_CATEGORY {MEM_IO, MEM_VIDEO, MEM_AUDIO, MEM_CATEGORY_MAX};
+
+typedef struct mem_stats_t {
+	int64_t bytes[MEM_CATEGORY_MAX];
+} mem_stats_t;
+
+// All tagged allocations of the process.
+static volatile int64_t mem_total_bytes = 0;
+
+void *mem_alloc(mem_stats_t *stats, enum MEM_CATEGORY category, size_t size) {
+	void *ptr = api->godot_alloc(size);
+	if (ptr != NULL) {
+		stats->bytes[category] += size;
+		vd_atomic_add(&mem_total_bytes, size);
+	}
+	return ptr;
+}
+
+void mem_free(mem_stats_t *stats, enum MEM_CATEGORY category, void *ptr, size_t size) {
+	if (ptr == NULL) return;
+	api->godot_free(ptr);
+	stats->bytes[category] -= size;
+	vd_atomic_add(&mem_total_bytes, -(int64_t)size);
+}
+
+// Moves an allocation to other stats without freeing it, e.g. before handing it to another thread.
+void mem_transfer(mem_stats_t *from, mem_stats_t *to, enum MEM_CATEGORY category, size_t size) {
+	from->bytes[category] -= size;
+	to->bytes[category] += size;
+}
+
+int64_t mem_stats_total(const mem_stats_t *stats) {
+	int64_t total = 0;
+	for (int i = 0; i < MEM_CATEGORY_MAX; i++) {
+		total += stats->bytes[i];
+	}
+	return total;
+}
+
+#endif /* _MEM_H */
@@ -11,6 +11,7 @@ typedef struct PacketQueue {
 	AVPacketList *first_pkt, *last_pkt;
 	int nb_packets;
 	int size;
+	int64_t duration; // sum of the packet durations, in stream time_base
 } PacketQueue;
 
 int quit = 0;
@@ -36,6 +37,7 @@ void packet_queue_flush(PacketQueue *q) {
 	q->first_pkt = NULL;
 	q->nb_packets = 0;
 	q->size = 0;
+	q->duration = 0;
 }
 
 int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
@@ -54,6 +56,7 @@ int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 	q->last_pkt = pkt1;
 	q->nb_packets++;
 	q->size += pkt1->pkt.size;
+	q->duration += pkt1->pkt.duration;
 	return 0;
 }
 
@@ -69,6 +72,7 @@ int packet_queue_get(PacketQueue *q, AVPacket *pkt) {
 			q->last_pkt = NULL;
 		q->nb_packets--;
 		q->size -= pkt1->pkt.size;
+		q->duration -= pkt1->pkt.duration;
 		*pkt = pkt1->pkt;
 		api->godot_free(pkt1);
 		return 1;
@@ -77,6 +81,56 @@ int packet_queue_get(PacketQueue *q, AVPacket *pkt) {
 	}
 }
 
+static void _packet_queue_unlink(PacketQueue *q, AVPacketList **link) {
+	AVPacketList *pkt1 = *link;
+	*link = pkt1->next;
+	if (q->last_pkt == pkt1) {
+		q->last_pkt = NULL;
+		for (AVPacketList *p = q->first_pkt; p; p = p->next) {
+			q->last_pkt = p;
+		}
+	}
+	q->nb_packets--;
+	q->size -= pkt1->pkt.size;
+	q->duration -= pkt1->pkt.duration;
+	av_packet_unref(&pkt1->pkt);
+	api->godot_free(pkt1);
+}
+
+// Drops packets with all of `flags` set, oldest first, until the queue is at most
+// `max_size` bytes. Returns how many were dropped.
+int packet_queue_drop_flagged(PacketQueue *q, int flags, int max_size) {
+	int dropped = 0;
+	AVPacketList **link = &q->first_pkt;
+	while (*link && q->size > max_size) {
+		if (((*link)->pkt.flags & flags) == flags) {
+			_packet_queue_unlink(q, link);
+			dropped++;
+		} else {
+			link = &(*link)->next;
+		}
+	}
+	return dropped;
+}
+
+// Drops the oldest packets up to the next AV_PKT_FLAG_KEY one, which stays, so the queue
+// starts at a keyframe. Nothing is dropped when there's no later keyframe queued.
+int packet_queue_drop_to_key(PacketQueue *q) {
+	AVPacketList *key = q->first_pkt ? q->first_pkt->next : NULL;
+	while (key && !(key->pkt.flags & AV_PKT_FLAG_KEY)) {
+		key = key->next;
+	}
+	if (!key) {
+		return 0;
+	}
+	int dropped = 0;
+	while (q->first_pkt != key) {
+		_packet_queue_unlink(q, &q->first_pkt);
+		dropped++;
+	}
+	return dropped;
+}
+
 void packet_queue_deinit(PacketQueue *q) {
 	AVPacket pt;
 	while (packet_queue_get(q, &pt)) {
@@ -0,0 +1,174 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <gdnative_api_struct.gen.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+extern const godot_gdnative_core_api_struct *api;
+
+// Minimal mutex/condition/thread wrappers so the plugin doesn't depend on
+// godot's (unexported) threading api. pthreads everywhere except MSVC.
+
+#ifdef _MSC_VER
+typedef SRWLOCK vd_mutex;
+typedef CONDITION_VARIABLE vd_cond;
+typedef HANDLE vd_thread;
+#else
+typedef pthread_mutex_t vd_mutex;
+typedef pthread_cond_t vd_cond;
+typedef pthread_t vd_thread;
+#endif
+
+#ifdef _MSC_VER
+typedef DWORD vd_thread_id;
+#else
+typedef pthread_t vd_thread_id;
+#endif
+
+typedef void (*vd_thread_func)(void *arg);
+
+typedef struct vd_thread_start_t {
+	vd_thread_func func;
+	void *arg;
+} vd_thread_start_t;
+
+void vd_mutex_init(vd_mutex *m) {
+#ifdef _MSC_VER
+	InitializeSRWLock(m);
+#else
+	pthread_mutex_init(m, NULL);
+#endif
+}
+
+void vd_mutex_destroy(vd_mutex *m) {
+#ifndef _MSC_VER
+	pthread_mutex_destroy(m);
+#endif
+}
+
+void vd_mutex_lock(vd_mutex *m) {
+#ifdef _MSC_VER
+	AcquireSRWLockExclusive(m);
+#else
+	pthread_mutex_lock(m);
+#endif
+}
+
+void vd_mutex_unlock(vd_mutex *m) {
+#ifdef _MSC_VER
+	ReleaseSRWLockExclusive(m);
+#else
+	pthread_mutex_unlock(m);
+#endif
+}
+
+void vd_cond_init(vd_cond *c) {
+#ifdef _MSC_VER
+	InitializeConditionVariable(c);
+#else
+	pthread_cond_init(c, NULL);
+#endif
+}
+
+void vd_cond_destroy(vd_cond *c) {
+#ifndef _MSC_VER
+	pthread_cond_destroy(c);
+#endif
+}
+
+void vd_cond_wait(vd_cond *c, vd_mutex *m) {
+#ifdef _MSC_VER
+	SleepConditionVariableSRW(c, m, INFINITE, 0);
+#else
+	pthread_cond_wait(c, m);
+#endif
+}
+
+void vd_cond_signal(vd_cond *c) {
+#ifdef _MSC_VER
+	WakeConditionVariable(c);
+#else
+	pthread_cond_signal(c);
+#endif
+}
+
+void vd_cond_broadcast(vd_cond *c) {
+#ifdef _MSC_VER
+	WakeAllConditionVariable(c);
+#else
+	pthread_cond_broadcast(c);
+#endif
+}
+
+// Adds `value` to `*p` atomically, returns the new value.
+int64_t vd_atomic_add(volatile int64_t *p, int64_t value) {
+#ifdef _MSC_VER
+	return InterlockedExchangeAdd64(p, value) + value;
+#else
+	return __atomic_add_fetch(p, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+#ifdef _MSC_VER
+static DWORD WINAPI _vd_thread_trampoline(LPVOID p_arg) {
+#else
+static void *_vd_thread_trampoline(void *p_arg) {
+#endif
+	vd_thread_start_t start = *(vd_thread_start_t *)p_arg;
+	api->godot_free(p_arg);
+	start.func(start.arg);
+	return 0;
+}
+
+int vd_thread_start(vd_thread *t, vd_thread_func func, void *arg) {
+	vd_thread_start_t *start = (vd_thread_start_t *)api->godot_alloc(sizeof(vd_thread_start_t));
+	if (start == NULL) {
+		return -1;
+	}
+	start->func = func;
+	start->arg = arg;
+#ifdef _MSC_VER
+	*t = CreateThread(NULL, 0, _vd_thread_trampoline, start, 0, NULL);
+	if (*t == NULL) {
+#else
+	if (pthread_create(t, NULL, _vd_thread_trampoline, start) != 0) {
+#endif
+		api->godot_free(start);
+		return -1;
+	}
+	return 0;
+}
+
+vd_thread_id vd_thread_self() {
+#ifdef _MSC_VER
+	return GetCurrentThreadId();
+#else
+	return pthread_self();
+#endif
+}
+
+// Whether the calling thread is `id`.
+int vd_thread_is_self(vd_thread_id id) {
+#ifdef _MSC_VER
+	return GetCurrentThreadId() == id;
+#else
+	return pthread_equal(pthread_self(), id);
+#endif
+}
+
+void vd_thread_join(vd_thread *t) {
+#ifdef _MSC_VER
+	WaitForSingleObject(*t, INFINITE);
+	CloseHandle(*t);
+#else
+	pthread_join(*t, NULL);
+#endif
+}
+
+#endif /* _THREAD_H */
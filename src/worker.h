@@ -0,0 +1,146 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <gdnative_api_struct.gen.h>
+#include <string.h>
+
+#include "thread.h"
+
+extern const godot_gdnative_core_api_struct *api;
+
+// A fixed set of threads pulling jobs off a FIFO.
+
+typedef void (*worker_job_func)(void *arg);
+
+typedef struct worker_job_t {
+	worker_job_func func;
+	void *arg;
+	struct worker_job_t *next;
+} worker_job_t;
+
+typedef struct worker_t {
+	vd_mutex mutex;
+	vd_cond cond;
+	vd_cond idle_cond;
+	worker_job_t *first_job, *last_job;
+	int nb_jobs;
+	int nb_running;
+	int nb_threads;
+	vd_thread *threads;
+	int quit;
+} worker_t;
+
+static void _worker_main(void *arg) {
+	worker_t *w = (worker_t *)arg;
+	vd_mutex_lock(&w->mutex);
+	for (;;) {
+		while (w->first_job == NULL && !w->quit) {
+			vd_cond_wait(&w->cond, &w->mutex);
+		}
+		worker_job_t *job = w->first_job;
+		if (job == NULL) {
+			break;
+		}
+		w->first_job = job->next;
+		if (!w->first_job)
+			w->last_job = NULL;
+		w->nb_jobs--;
+		w->nb_running++;
+		vd_mutex_unlock(&w->mutex);
+
+		job->func(job->arg);
+		api->godot_free(job);
+
+		vd_mutex_lock(&w->mutex);
+		w->nb_running--;
+		if (w->nb_jobs == 0 && w->nb_running == 0) {
+			vd_cond_broadcast(&w->idle_cond);
+		}
+	}
+	vd_mutex_unlock(&w->mutex);
+}
+
+worker_t *worker_create(int nb_threads) {
+	worker_t *w = (worker_t *)api->godot_alloc(sizeof(worker_t));
+	if (w == NULL) {
+		return NULL;
+	}
+	memset(w, 0, sizeof(worker_t));
+	w->threads = (vd_thread *)api->godot_alloc(sizeof(vd_thread) * nb_threads);
+	if (w->threads == NULL) {
+		api->godot_free(w);
+		return NULL;
+	}
+	vd_mutex_init(&w->mutex);
+	vd_cond_init(&w->cond);
+	vd_cond_init(&w->idle_cond);
+	for (int i = 0; i < nb_threads; i++) {
+		if (vd_thread_start(&w->threads[i], _worker_main, w) != 0) {
+			break;
+		}
+		w->nb_threads++;
+	}
+	return w;
+}
+
+int worker_push(worker_t *w, worker_job_func func, void *arg) {
+	worker_job_t *job = (worker_job_t *)api->godot_alloc(sizeof(worker_job_t));
+	if (job == NULL) {
+		return -1;
+	}
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+
+	vd_mutex_lock(&w->mutex);
+	if (w->nb_threads == 0) {
+		// no threads could be started, run the job inline.
+		vd_mutex_unlock(&w->mutex);
+		func(arg);
+		api->godot_free(job);
+		return 0;
+	}
+	if (!w->last_job)
+		w->first_job = job;
+	else
+		w->last_job->next = job;
+	w->last_job = job;
+	w->nb_jobs++;
+	vd_cond_signal(&w->cond);
+	vd_mutex_unlock(&w->mutex);
+	return 0;
+}
+
+// Number of jobs queued or running.
+int worker_pending(worker_t *w) {
+	vd_mutex_lock(&w->mutex);
+	int pending = w->nb_jobs + w->nb_running;
+	vd_mutex_unlock(&w->mutex);
+	return pending;
+}
+
+void worker_wait_idle(worker_t *w) {
+	vd_mutex_lock(&w->mutex);
+	while (w->nb_jobs > 0 || w->nb_running > 0) {
+		vd_cond_wait(&w->idle_cond, &w->mutex);
+	}
+	vd_mutex_unlock(&w->mutex);
+}
+
+// Runs every queued job to completion before joining the threads.
+void worker_destroy(worker_t *w) {
+	vd_mutex_lock(&w->mutex);
+	w->quit = 1;
+	vd_cond_broadcast(&w->cond);
+	vd_mutex_unlock(&w->mutex);
+	for (int i = 0; i < w->nb_threads; i++) {
+		vd_thread_join(&w->threads[i]);
+	}
+	vd_cond_destroy(&w->idle_cond);
+	vd_cond_destroy(&w->cond);
+	vd_mutex_destroy(&w->mutex);
+	api->godot_free(w->threads);
+	api->godot_free(w);
+}
+
+#endif /* _WORKER_H */